@@ -0,0 +1,1114 @@
+#include "imageindex.h"
+
+#include <SQLiteCpp/Column.h>
+#include <SQLiteCpp/Statement.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+bool parseHashKind(const std::string &name, HashKind &kind)
+{
+    if (name == "dct")
+    {
+        kind = HashKind::Dct;
+    }
+    else if (name == "mh")
+    {
+        kind = HashKind::Mh;
+    }
+    else if (name == "bmb")
+    {
+        kind = HashKind::Bmb;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+int hashKindBit(HashKind kind)
+{
+    switch (kind)
+    {
+    case HashKind::Mh:
+        return PH_HASH_MH;
+    case HashKind::Bmb:
+        return PH_HASH_BMB;
+    case HashKind::Dct:
+    default:
+        return PH_HASH_DCT;
+    }
+}
+
+bool parseLshParams(const std::string &text, LshParams &params)
+{
+    char separator1 = 0;
+    char separator2 = 0;
+    std::istringstream fields(text);
+    LshParams parsed;
+    if (!(fields >> parsed.tables >> separator1 >> parsed.bits >> separator2 >> parsed.probes) || separator1 != ',' ||
+        separator2 != ',' || !fields.eof() || parsed.tables < 0 || parsed.bits < 1 || parsed.bits > 32 ||
+        parsed.probes < 1)
+    {
+        return false;
+    }
+    params = parsed;
+    return true;
+}
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+bool parseHash(HashKind kind, const std::string &hex, std::vector<uint8_t> &hash)
+{
+    hash.clear();
+    if (hex.empty())
+    {
+        return false;
+    }
+
+    if (kind == HashKind::Dct)
+    {
+        if (hex.size() > 16)
+        {
+            return false;
+        }
+        uint64_t value = 0;
+        for (char c : hex)
+        {
+            const int digit = hexDigit(c);
+            if (digit < 0)
+            {
+                return false;
+            }
+            value = (value << 4) | static_cast<uint64_t>(digit);
+        }
+        hash.resize(sizeof(value));
+        memcpy(hash.data(), &value, sizeof(value));
+        return true;
+    }
+
+    return parseHex(hex, hash);
+}
+
+bool parseHex(const std::string &hex, std::vector<uint8_t> &bytes)
+{
+    bytes.clear();
+    if (hex.empty() || hex.size() % 2 != 0)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < hex.size(); i += 2)
+    {
+        const int high = hexDigit(hex[i]);
+        const int low = hexDigit(hex[i + 1]);
+        if (high < 0 || low < 0)
+        {
+            bytes.clear();
+            return false;
+        }
+        bytes.push_back(static_cast<uint8_t>(high << 4 | low));
+    }
+    return true;
+}
+
+bool hasColumn(SQLite::Database &db, const std::string &table, const std::string &column)
+{
+    SQLite::Statement query(db, "SELECT COUNT(*) FROM pragma_table_info(?) WHERE name = ?");
+    query.bind(1, table);
+    query.bind(2, column);
+    return query.executeStep() && query.getColumn(0).getInt() > 0;
+}
+
+static bool byDistance(const ImageMatch &a, const ImageMatch &b)
+{
+    return a.distance != b.distance ? a.distance < b.distance : a.image < b.image;
+}
+
+ImageIndex::ImageIndex(SQLite::Database &db, int hashes, const LshParams &lsh) : lshParams(lsh)
+{
+    // Databases scanned before the coefficients were stored load without orientations.
+    const bool coeffs = (hashes & PH_HASH_DCT_COEFFS) && hasColumn(db, "images", "dctCoeffs");
+    const std::string columns = std::string("SELECT filename, fileHash, ") +
+                                (hashes & (PH_HASH_DCT | PH_HASH_DCT_COEFFS) ? "dctHash, " : "NULL, ") +
+                                (hashes & PH_HASH_MH ? "mhHash, " : "NULL, ") +
+                                (hashes & PH_HASH_BMB ? "bmbHash, " : "NULL, ") +
+                                (hashes & PH_HASH_DIGEST ? "digest, " : "NULL, ") +
+                                (coeffs ? "dctCoeffs " : "NULL ");
+    SQLite::Statement query(db, columns + "FROM images ORDER BY id");
+    while (query.executeStep())
+    {
+        const uint32_t image = static_cast<uint32_t>(filenames.size());
+        filenames.push_back(query.getColumn(0).getString());
+        fileHashes.push_back(query.getColumn(1).getString());
+        byFileHash.emplace(fileHashes.back(), image);
+
+        SQLite::Column dctHash = query.getColumn(2);
+        if (!dctHash.isNull())
+        {
+            const uint64_t hash = static_cast<uint64_t>(dctHash.getInt64());
+            addHash(dct, &hash, sizeof(hash), image);
+            if (coeffs)
+            {
+                SQLite::Column dctCoeffs = query.getColumn(6);
+                addDctVariants(dctCoeffs.isNull() ? nullptr : dctCoeffs.getBlob(), dctCoeffs.getBytes(), hash);
+            }
+        }
+        SQLite::Column mhHash = query.getColumn(3);
+        if (!mhHash.isNull())
+        {
+            addHash(mh, mhHash.getBlob(), mhHash.getBytes(), image);
+        }
+        SQLite::Column bmbHash = query.getColumn(4);
+        if (!bmbHash.isNull())
+        {
+            addHash(bmb, bmbHash.getBlob(), bmbHash.getBytes(), image);
+        }
+        digestRows.push_back(-1);
+        SQLite::Column digest = query.getColumn(5);
+        if (!digest.isNull() && digest.getBytes() > 0 && (digestLength == 0 || digest.getBytes() == digestLength))
+        {
+            digestLength = digest.getBytes();
+            digestRows.back() = static_cast<int32_t>(digests.size() / digestLength);
+            const uint8_t *coeffs = static_cast<const uint8_t *>(digest.getBlob());
+            digests.insert(digests.end(), coeffs, coeffs + digestLength);
+        }
+    }
+
+    buildFileHashFilter();
+    buildDctTables();
+    buildLsh(mh);
+    buildLsh(bmb);
+}
+
+ImageIndex::~ImageIndex()
+{
+    for (HashColumn *hashes : {&dct, &mh, &bmb})
+    {
+        ph_lsh_index_free(hashes->lsh);
+        ph_hash_arena_free(hashes->arena);
+    }
+}
+
+void ImageIndex::addDctVariants(const void *coeffs, int bytes, uint64_t hash)
+{
+    ulong64 variants[dctOrientations];
+    if (coeffs && bytes == 64 * static_cast<int>(sizeof(float)))
+    {
+        float block[64];
+        memcpy(block, coeffs, sizeof(block));
+        ph_dct_dihedral_hashes(block, variants);
+    }
+    else
+    {
+        // Without coefficients the image only matches as stored.
+        std::fill(variants, variants + dctOrientations, hash);
+    }
+    dctVariants.insert(dctVariants.end(), variants + 1, variants + dctOrientations);
+}
+
+void ImageIndex::buildLsh(HashColumn &column)
+{
+    if (!column.arena || lshParams.tables <= 0 || static_cast<uint32_t>(lshParams.bits) > 8 * column.arena->hash_length)
+    {
+        return;
+    }
+    column.lsh = ph_lsh_index_new(column.arena->hash_length, lshParams.tables, lshParams.bits);
+    if (!column.lsh)
+    {
+        throw std::bad_alloc();
+    }
+    // LSH ids are the arena rows
+    for (int row = 0; row < column.arena->count; ++row)
+    {
+        ph_lsh_index_add(column.lsh, ph_hash_arena_at(column.arena, row));
+    }
+    ph_lsh_index_build(column.lsh);
+}
+
+std::vector<ImageMatch> ImageIndex::searchLsh(const HashColumn &column, const uint8_t *hash, size_t k, int radius) const
+{
+    std::vector<ImageMatch> matches;
+    int count = 0;
+    LSHMatch *found = ph_lsh_index_query(column.lsh, hash, static_cast<int>(std::min<size_t>(k, INT_MAX)),
+                                         lshParams.probes, radius, &count);
+    for (int i = 0; i < count; ++i)
+    {
+        matches.push_back({column.owners[found[i].id], found[i].distance});
+    }
+    free(found);
+    return matches;
+}
+
+void ImageIndex::addHash(HashColumn &column, const void *hash, int length, uint32_t image)
+{
+    if (length <= 0)
+    {
+        return;
+    }
+    if (!column.arena)
+    {
+        column.arena = ph_hash_arena_new(static_cast<uint32_t>(length), 1024);
+        if (!column.arena)
+        {
+            throw std::bad_alloc();
+        }
+    }
+    // All hashes of a kind have the same length; anything else was stored by a different hash version.
+    if (column.arena->hash_length != static_cast<uint32_t>(length))
+    {
+        return;
+    }
+    if (ph_hash_arena_add(column.arena, static_cast<const uint8_t *>(hash)) < 0)
+    {
+        throw std::bad_alloc();
+    }
+    column.owners.push_back(image);
+}
+
+void ImageIndex::buildDctTables()
+{
+    const uint32_t rows = static_cast<uint32_t>(dct.owners.size());
+    const uint32_t values = 1u << dctChunkBits;
+    for (int c = 0; c < dctChunks; ++c)
+    {
+        std::vector<uint32_t> &start = dctStart[c];
+        std::vector<uint32_t> &table = dctRows[c];
+        start.assign(values + 1, 0);
+        table.resize(rows);
+
+        auto chunk = [this, c](uint32_t row) {
+            return static_cast<uint32_t>((dctRow(row) >> (c * dctChunkBits)) & ((1u << dctChunkBits) - 1));
+        };
+
+        for (uint32_t row = 0; row < rows; ++row)
+        {
+            ++start[chunk(row) + 1];
+        }
+        for (uint32_t v = 0; v < values; ++v)
+        {
+            start[v + 1] += start[v];
+        }
+        std::vector<uint32_t> fill(start.begin(), start.end() - 1);
+        for (uint32_t row = 0; row < rows; ++row)
+        {
+            table[fill[chunk(row)]++] = row;
+        }
+    }
+}
+
+uint64_t ImageIndex::dctRow(uint32_t row) const
+{
+    uint64_t hash;
+    memcpy(&hash, ph_hash_arena_at(dct.arena, static_cast<int>(row)), sizeof(hash));
+    return hash;
+}
+
+const ImageIndex::HashColumn &ImageIndex::column(HashKind kind) const
+{
+    switch (kind)
+    {
+    case HashKind::Mh:
+        return mh;
+    case HashKind::Bmb:
+        return bmb;
+    case HashKind::Dct:
+    default:
+        return dct;
+    }
+}
+
+uint32_t ImageIndex::hashLength(HashKind kind) const
+{
+    const HashColumn &hashes = column(kind);
+    return hashes.arena ? hashes.arena->hash_length : 0;
+}
+
+// Block of the Bloom filter a file hash falls in, and the bits it sets there.
+static size_t fileHashFilterMask(const std::string &md5, size_t blocks, int bits, uint64_t mask[8])
+{
+    uint64_t key = std::hash<std::string>()(md5) + 0x9E3779B97F4A7C15ull;
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ull;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EBull;
+    key ^= key >> 31;
+    const size_t block = static_cast<size_t>((static_cast<unsigned __int128>(key) * blocks) >> 64);
+
+    // The bit positions come from a second, independent mix of the key.
+    uint64_t positions = (key ^ (key >> 33)) * 0xC4CEB9FE1A85EC53ull;
+    std::fill(mask, mask + 8, 0);
+    for (int i = 0; i < bits; ++i, positions >>= 9)
+    {
+        mask[(positions >> 6) & 7] |= 1ull << (positions & 63);
+    }
+    return block;
+}
+
+void ImageIndex::buildFileHashFilter()
+{
+    if (fileHashes.size() < fileHashFilterMinImages)
+    {
+        return;
+    }
+    // 16 bits per image keep false positives near 0.1 %.
+    const size_t blocks = (fileHashes.size() * 16 + 511) / 512;
+    fileHashFilter.assign(blocks, FilterBlock());
+    uint64_t mask[8];
+    for (const std::string &md5 : fileHashes)
+    {
+        uint64_t *block = fileHashFilter[fileHashFilterMask(md5, blocks, fileHashFilterBits, mask)].words;
+        for (int w = 0; w < 8; ++w)
+        {
+            block[w] |= mask[w];
+        }
+    }
+}
+
+bool ImageIndex::mayHaveFileHash(const std::string &md5) const
+{
+    if (fileHashFilter.empty())
+    {
+        return true;
+    }
+    uint64_t mask[8];
+    const uint64_t *block =
+        fileHashFilter[fileHashFilterMask(md5, fileHashFilter.size(), fileHashFilterBits, mask)].words;
+    uint64_t missing = 0;
+    for (int w = 0; w < 8; ++w)
+    {
+        missing |= mask[w] & ~block[w];
+    }
+    return missing == 0;
+}
+
+std::vector<uint32_t> ImageIndex::findFileHash(const std::string &md5) const
+{
+    std::vector<uint32_t> images;
+    if (!mayHaveFileHash(md5))
+    {
+        return images;
+    }
+    auto range = byFileHash.equal_range(md5);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        images.push_back(it->second);
+    }
+    std::sort(images.begin(), images.end());
+    return images;
+}
+
+// Substring values with at most flips bits set, by flips: 1, 17 and 137 of them.
+static const std::vector<uint32_t> &probeMasks(int flips)
+{
+    static const std::vector<std::vector<uint32_t>> masks = [] {
+        std::vector<std::vector<uint32_t>> byFlips(3);
+        for (uint32_t mask = 0; mask < (1u << 16); ++mask)
+        {
+            for (int f = __builtin_popcount(mask); f < 3; ++f)
+            {
+                byFlips[f].push_back(mask);
+            }
+        }
+        return byFlips;
+    }();
+    return masks[flips];
+}
+
+std::vector<ImageMatch> ImageIndex::probeDct(uint64_t hash, int radius) const
+{
+    // Flipping up to radius / dctChunks bits of each substring reaches every hash within radius.
+    const std::vector<uint32_t> &masks = probeMasks(radius / dctChunks);
+    std::vector<uint32_t> candidates;
+    for (int c = 0; c < dctChunks; ++c)
+    {
+        const uint32_t key = static_cast<uint32_t>((hash >> (c * dctChunkBits)) & ((1u << dctChunkBits) - 1));
+        const std::vector<uint32_t> &start = dctStart[c];
+        for (uint32_t mask : masks)
+        {
+            const uint32_t value = key ^ mask;
+            candidates.insert(candidates.end(), dctRows[c].begin() + start[value], dctRows[c].begin() + start[value + 1]);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    std::vector<ImageMatch> matches;
+    for (uint32_t row : candidates)
+    {
+        const int distance = __builtin_popcountll(hash ^ dctRow(row));
+        if (distance <= radius)
+        {
+            matches.push_back({dct.owners[row], distance});
+        }
+    }
+    return matches;
+}
+
+void ImageIndex::closestDistances(const HashColumn &column, const uint8_t *hashes, int count, int start, int rows,
+                                  int *closest, std::vector<int> &scratch) const
+{
+    // All queries run over the same block while it is in cache.
+    ph_hamming_distances(hashes, column.arena, start, rows, closest);
+    scratch.resize(rows);
+    for (int q = 1; q < count; ++q)
+    {
+        ph_hamming_distances(hashes + static_cast<size_t>(q) * column.arena->hash_length, column.arena, start, rows,
+                             scratch.data());
+        for (int i = 0; i < rows; ++i)
+        {
+            closest[i] = std::min(closest[i], scratch[i]);
+        }
+    }
+}
+
+std::vector<ImageMatch> ImageIndex::scan(const HashColumn &column, const uint8_t *hashes, int count, int radius) const
+{
+    std::vector<ImageMatch> matches;
+    if (!column.arena)
+    {
+        return matches;
+    }
+    const int block = 4096;
+    std::vector<int> distances(block);
+    std::vector<int> scratch;
+    for (int start = 0; start < column.arena->count; start += block)
+    {
+        const int rows = std::min(block, column.arena->count - start);
+        closestDistances(column, hashes, count, start, rows, distances.data(), scratch);
+        for (int i = 0; i < rows; ++i)
+        {
+            if (distances[i] <= radius)
+            {
+                matches.push_back({column.owners[start + i], distances[i]});
+            }
+        }
+    }
+    return matches;
+}
+
+// Keeps the closest match of each image, for results merged from several queries.
+static void keepClosest(std::vector<ImageMatch> &matches)
+{
+    std::sort(matches.begin(), matches.end(), [](const ImageMatch &a, const ImageMatch &b) {
+        return a.image != b.image ? a.image < b.image : a.distance < b.distance;
+    });
+    matches.erase(std::unique(matches.begin(), matches.end(),
+                              [](const ImageMatch &a, const ImageMatch &b) { return a.image == b.image; }),
+                  matches.end());
+}
+
+std::vector<ImageMatch> ImageIndex::findWithin(HashKind kind, const uint8_t *hash, int radius) const
+{
+    return findWithinAny(kind, hash, 1, radius);
+}
+
+std::vector<ImageMatch> ImageIndex::findWithinAny(HashKind kind, const uint8_t *hashes, int count, int radius) const
+{
+    std::vector<ImageMatch> matches;
+    const HashColumn &column = this->column(kind);
+    if (!column.arena || radius < 0 || count <= 0)
+    {
+        return matches;
+    }
+    const uint32_t length = column.arena->hash_length;
+
+    if (kind == HashKind::Dct && radius <= maxProbeRadius)
+    {
+        for (int q = 0; q < count; ++q)
+        {
+            uint64_t value;
+            memcpy(&value, hashes + static_cast<size_t>(q) * length, sizeof(value));
+            const std::vector<ImageMatch> found = probeDct(value, radius);
+            matches.insert(matches.end(), found.begin(), found.end());
+        }
+    }
+    else if (column.lsh)
+    {
+        for (int q = 0; q < count; ++q)
+        {
+            const std::vector<ImageMatch> found =
+                searchLsh(column, hashes + static_cast<size_t>(q) * length, column.owners.size(), radius);
+            matches.insert(matches.end(), found.begin(), found.end());
+        }
+    }
+    else
+    {
+        matches = scan(column, hashes, count, radius);
+    }
+    if (count > 1)
+    {
+        keepClosest(matches);
+    }
+    std::sort(matches.begin(), matches.end(), byDistance);
+    return matches;
+}
+
+std::vector<ImageMatch> ImageIndex::findNearest(HashKind kind, const uint8_t *hash, size_t k) const
+{
+    return findNearestAny(kind, hash, 1, k);
+}
+
+std::vector<ImageMatch> ImageIndex::findNearestAny(HashKind kind, const uint8_t *hashes, int count, size_t k) const
+{
+    std::vector<ImageMatch> matches;
+    const HashColumn &column = this->column(kind);
+    if (!column.arena || k == 0 || count <= 0)
+    {
+        return matches;
+    }
+
+    // When k images lie within the radius the substring tables cover, they are the k nearest.
+    if (kind == HashKind::Dct)
+    {
+        for (int radius : {dctChunks - 1, 2 * dctChunks - 1, maxProbeRadius})
+        {
+            matches = findWithinAny(kind, hashes, count, radius);
+            if (matches.size() >= k)
+            {
+                matches.resize(k);
+                return matches;
+            }
+        }
+    }
+
+    if (column.lsh)
+    {
+        matches.clear();
+        for (int q = 0; q < count; ++q)
+        {
+            const std::vector<ImageMatch> found =
+                searchLsh(column, hashes + static_cast<size_t>(q) * column.arena->hash_length, k, -1);
+            matches.insert(matches.end(), found.begin(), found.end());
+        }
+        keepClosest(matches);
+        std::sort(matches.begin(), matches.end(), byDistance);
+        matches.resize(std::min(k, matches.size()));
+        return matches;
+    }
+    return nearestScan(column, hashes, count, k);
+}
+
+std::vector<ImageMatch> ImageIndex::nearestScan(const HashColumn &column, const uint8_t *hashes, int count,
+                                                size_t k) const
+{
+    // Full scan keeping the k best in a max-heap on distance
+    std::vector<ImageMatch> matches;
+    const int block = 4096;
+    std::vector<int> distances(block);
+    std::vector<int> scratch;
+    for (int start = 0; start < column.arena->count; start += block)
+    {
+        const int rows = std::min(block, column.arena->count - start);
+        closestDistances(column, hashes, count, start, rows, distances.data(), scratch);
+        for (int i = 0; i < rows; ++i)
+        {
+            if (matches.size() == k && distances[i] >= matches.front().distance)
+            {
+                continue;
+            }
+            if (matches.size() == k)
+            {
+                std::pop_heap(matches.begin(), matches.end(), byDistance);
+                matches.pop_back();
+            }
+            matches.push_back({column.owners[start + i], distances[i]});
+            std::push_heap(matches.begin(), matches.end(), byDistance);
+        }
+    }
+    std::sort_heap(matches.begin(), matches.end(), byDistance);
+    return matches;
+}
+
+std::vector<CascadeMatch> ImageIndex::findCascade(HashKind kind, const uint8_t *hash, const uint8_t *digest, size_t k,
+                                                  size_t shortlist, int radius) const
+{
+    std::vector<CascadeMatch> matches;
+    if (digestLength == 0 || !digest || k == 0)
+    {
+        return matches;
+    }
+
+    std::vector<ImageMatch> candidates = findNearest(kind, hash, shortlist);
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                    [this, radius](const ImageMatch &match) {
+                                        return match.distance > radius || digestRows[match.image] < 0;
+                                    }),
+                     candidates.end());
+
+    // Gather the shortlisted digests so the correlation runs over one contiguous batch.
+    std::vector<uint8_t> batch(candidates.size() * digestLength);
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        memcpy(&batch[i * digestLength], &digests[static_cast<size_t>(digestRows[candidates[i].image]) * digestLength],
+               digestLength);
+    }
+    std::vector<double> correlations(candidates.size());
+    ph_crosscorr_batch(digest, batch.data(), digestLength, static_cast<int>(candidates.size()), correlations.data());
+
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        matches.push_back({candidates[i].image, candidates[i].distance, correlations[i]});
+    }
+    const size_t n = std::min(k, matches.size());
+    std::partial_sort(matches.begin(), matches.begin() + n, matches.end(),
+                      [](const CascadeMatch &a, const CascadeMatch &b) {
+                          if (a.correlation != b.correlation)
+                          {
+                              return a.correlation > b.correlation;
+                          }
+                          return a.distance != b.distance ? a.distance < b.distance : a.image < b.image;
+                      });
+    matches.resize(n);
+    return matches;
+}
+
+LshBenchmark ImageIndex::measureLsh(HashKind kind, size_t queries, size_t k) const
+{
+    LshBenchmark benchmark;
+    const HashColumn &hashes = column(kind);
+    if (!hashes.lsh || hashes.owners.empty() || queries == 0 || k == 0)
+    {
+        return benchmark;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    Clock::duration lshTime(0);
+    Clock::duration scanTime(0);
+    size_t found = 0;
+    size_t expected = 0;
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    auto random = [&state] {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+
+    const uint32_t length = hashes.arena->hash_length;
+    std::vector<uint8_t> query(length);
+    for (size_t q = 0; q < queries; ++q)
+    {
+        const uint8_t *stored = ph_hash_arena_at(hashes.arena, static_cast<int>(random() % hashes.owners.size()));
+        query.assign(stored, stored + length);
+        const int flips = static_cast<int>(random() % 8);
+        for (int f = 0; f < flips; ++f)
+        {
+            const uint64_t bit = random() % (8 * length);
+            query[bit / 8] ^= static_cast<uint8_t>(1u << (bit % 8));
+        }
+
+        const auto start = Clock::now();
+        const std::vector<ImageMatch> approximate = searchLsh(hashes, query.data(), k, -1);
+        const auto middle = Clock::now();
+        const std::vector<ImageMatch> exact = nearestScan(hashes, query.data(), 1, k);
+        const auto end = Clock::now();
+        lshTime += middle - start;
+        scanTime += end - middle;
+
+        // Ties make image ids ambiguous, so compare distances: the i-th LSH result is right when it is as
+        // close as the i-th exact one.
+        for (size_t i = 0; i < exact.size(); ++i)
+        {
+            if (i < approximate.size() && approximate[i].distance <= exact[i].distance)
+            {
+                ++found;
+            }
+        }
+        expected += exact.size();
+    }
+
+    using Micros = std::chrono::duration<double, std::micro>;
+    benchmark.queries = queries;
+    benchmark.recall = expected ? static_cast<double>(found) / expected : 1.0;
+    benchmark.lshMicros = std::chrono::duration_cast<Micros>(lshTime).count() / queries;
+    benchmark.scanMicros = std::chrono::duration_cast<Micros>(scanTime).count() / queries;
+    return benchmark;
+}
+
+namespace
+{
+
+/**
+ * Union-find over arena rows that several threads update at once. Every link points to a smaller row, so
+ * a set's root is its smallest row whatever the order of the unions.
+ */
+class ConcurrentUnionFind
+{
+public:
+    explicit ConcurrentUnionFind(uint32_t size) : parent(size)
+    {
+        for (uint32_t i = 0; i < size; ++i)
+        {
+            parent[i].store(i, std::memory_order_relaxed);
+        }
+    }
+
+    uint32_t find(uint32_t x)
+    {
+        for (;;)
+        {
+            uint32_t p = parent[x].load(std::memory_order_relaxed);
+            if (p == x)
+            {
+                return x;
+            }
+            // Path halving: grandparents are ancestors too, whatever other threads did meanwhile.
+            const uint32_t grandparent = parent[p].load(std::memory_order_relaxed);
+            if (grandparent != p)
+            {
+                parent[x].compare_exchange_weak(p, grandparent, std::memory_order_relaxed);
+            }
+            x = grandparent;
+        }
+    }
+
+    void unite(uint32_t a, uint32_t b)
+    {
+        for (;;)
+        {
+            a = find(a);
+            b = find(b);
+            if (a == b)
+            {
+                return;
+            }
+            if (a < b)
+            {
+                std::swap(a, b);
+            }
+            uint32_t expected = a;
+            if (parent[a].compare_exchange_strong(expected, b, std::memory_order_relaxed))
+            {
+                return;
+            }
+        }
+    }
+
+private:
+    std::vector<std::atomic<uint32_t>> parent;
+};
+
+} // namespace
+
+std::vector<std::vector<uint32_t>> ImageIndex::clusterDct(int radius, int threads, bool orientations) const
+{
+    std::vector<std::vector<uint32_t>> groups;
+    const uint32_t rows = static_cast<uint32_t>(dct.owners.size());
+    if (rows == 0 || radius < 0 || radius > maxClusterRadius)
+    {
+        return groups;
+    }
+
+    ConcurrentUnionFind sets(rows);
+
+    // Equal hashes are joined up front and only one of them takes part in the self-join, so that
+    // thousands of identical hashes (blank images, copies) do not make a bucket quadratic.
+    std::vector<uint32_t> order(rows);
+    for (uint32_t row = 0; row < rows; ++row)
+    {
+        order[row] = row;
+    }
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+        const uint64_t ha = dctRow(a);
+        const uint64_t hb = dctRow(b);
+        return ha != hb ? ha < hb : a < b;
+    });
+    std::vector<char> representative(rows, 0);
+    for (uint32_t i = 0; i < rows; ++i)
+    {
+        if (i > 0 && dctRow(order[i]) == dctRow(order[i - 1]))
+        {
+            sets.unite(order[i], order[i - 1]);
+        }
+        else
+        {
+            representative[order[i]] = 1;
+        }
+    }
+
+    // Two hashes within radius differ by at most flips bits in one of the substrings, so they share a
+    // bucket, or sit in buckets whose values differ by such a mask, in at least one table.
+    const int flips = radius / dctChunks;
+    const uint32_t values = 1u << dctChunkBits;
+    std::vector<uint32_t> masks;
+    for (uint32_t mask = 1; mask < values; ++mask)
+    {
+        if (__builtin_popcount(mask) <= flips)
+        {
+            masks.push_back(mask);
+        }
+    }
+    auto chunkDistance = [](uint64_t x, int c) {
+        return __builtin_popcountll((x >> (c * dctChunkBits)) & ((1ull << dctChunkBits) - 1));
+    };
+
+    const uint32_t blockSize = 256;
+    const uint32_t blocksPerChunk = values / blockSize;
+    const uint32_t units = dctChunks * blocksPerChunk;
+    std::atomic<uint32_t> nextUnit(0);
+
+    // Orientation pass: the variants of chunk variantChunk, in compressed row form like the substring
+    // tables. Entry i is variant variantIds[i] % perRow of arena row variantIds[i] / perRow.
+    const uint32_t perRow = dctOrientations - 1;
+    int variantChunk = -1;
+    std::vector<uint32_t> variantStart;
+    std::vector<uint32_t> variantIds;
+    std::vector<uint32_t> probes(1, 0);
+    probes.insert(probes.end(), masks.begin(), masks.end());
+
+    auto work = [&]() {
+        std::vector<uint32_t> leftRows, rightRows;
+        std::vector<uint64_t> left, right;
+        std::vector<int> distances;
+
+        auto gather = [&](int c, uint32_t value, std::vector<uint32_t> &bucketRows, std::vector<uint64_t> &hashes) {
+            bucketRows.clear();
+            hashes.clear();
+            for (uint32_t i = dctStart[c][value]; i < dctStart[c][value + 1]; ++i)
+            {
+                const uint32_t row = dctRows[c][i];
+                if (representative[row])
+                {
+                    bucketRows.push_back(row);
+                    hashes.push_back(dctRow(row));
+                }
+            }
+        };
+
+        // Joins one hash of chunk c's bucket with right[from..]. A pair close in several substrings is
+        // only merged by the first table it shares a probe with, so each pair is verified once.
+        auto join = [&](int c, uint64_t hash, uint32_t row, size_t from) {
+            const size_t count = right.size() - from;
+            if (count == 0)
+            {
+                return;
+            }
+            distances.resize(count);
+            if (count < 16)
+            {
+                for (size_t j = 0; j < count; ++j)
+                {
+                    distances[j] = __builtin_popcountll(hash ^ right[from + j]);
+                }
+            }
+            else
+            {
+                HashArena view = {reinterpret_cast<uint8_t *>(right.data()), sizeof(uint64_t), sizeof(uint64_t),
+                                  static_cast<int>(right.size()), static_cast<int>(right.size())};
+                ph_hamming_distances(reinterpret_cast<const uint8_t *>(&hash), &view, static_cast<int>(from),
+                                     static_cast<int>(count), distances.data());
+            }
+            for (size_t j = 0; j < count; ++j)
+            {
+                if (distances[j] > radius)
+                {
+                    continue;
+                }
+                const uint64_t x = hash ^ right[from + j];
+                int first = 0;
+                while (chunkDistance(x, first) > flips)
+                {
+                    ++first;
+                }
+                if (first == c)
+                {
+                    sets.unite(row, rightRows[from + j]);
+                }
+            }
+        };
+
+        if (variantChunk >= 0)
+        {
+            // Variant hashes only meet stored hashes: the variants' own pairs are the stored pairs flipped.
+            const int c = variantChunk;
+            for (uint32_t unit = nextUnit++; unit < blocksPerChunk; unit = nextUnit++)
+            {
+                for (uint32_t value = unit * blockSize; value < (unit + 1) * blockSize; ++value)
+                {
+                    if (variantStart[value] == variantStart[value + 1])
+                    {
+                        continue;
+                    }
+                    left.clear();
+                    leftRows.clear();
+                    for (uint32_t i = variantStart[value]; i < variantStart[value + 1]; ++i)
+                    {
+                        leftRows.push_back(variantIds[i] / perRow);
+                        left.push_back(dctVariants[variantIds[i]]);
+                    }
+                    for (uint32_t mask : probes)
+                    {
+                        const uint32_t other = value ^ mask;
+                        if (dctStart[c][other] == dctStart[c][other + 1])
+                        {
+                            continue;
+                        }
+                        gather(c, other, rightRows, right);
+                        for (size_t i = 0; i < left.size(); ++i)
+                        {
+                            join(c, left[i], leftRows[i], 0);
+                        }
+                    }
+                }
+            }
+            return;
+        }
+
+        for (uint32_t unit = nextUnit++; unit < units; unit = nextUnit++)
+        {
+            const int c = static_cast<int>(unit / blocksPerChunk);
+            const uint32_t firstValue = (unit % blocksPerChunk) * blockSize;
+            for (uint32_t value = firstValue; value < firstValue + blockSize; ++value)
+            {
+                if (dctStart[c][value] == dctStart[c][value + 1])
+                {
+                    continue;
+                }
+                gather(c, value, leftRows, left);
+                right = left;
+                rightRows = leftRows;
+                for (size_t i = 0; i + 1 < left.size(); ++i)
+                {
+                    join(c, left[i], leftRows[i], i + 1);
+                }
+                for (uint32_t mask : masks)
+                {
+                    const uint32_t other = value ^ mask;
+                    if (other < value || dctStart[c][other] == dctStart[c][other + 1])
+                    {
+                        continue;
+                    }
+                    gather(c, other, rightRows, right);
+                    for (size_t i = 0; i < left.size(); ++i)
+                    {
+                        join(c, left[i], leftRows[i], 0);
+                    }
+                }
+            }
+        }
+    };
+
+    if (threads <= 0)
+    {
+        threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    auto runWorkers = [&]() {
+        std::vector<std::thread> workers;
+        for (int t = 1; t < threads; ++t)
+        {
+            workers.emplace_back(work);
+        }
+        work();
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+    };
+    runWorkers();
+
+    // Each substring table of the variants is built and joined in turn, so only one is held at a time.
+    // A variant equal to the stored hash or to an earlier variant of the same image adds no pair.
+    if (orientations && dctVariants.size() == static_cast<size_t>(rows) * perRow)
+    {
+        auto distinct = [this, perRow](uint32_t id) {
+            const uint32_t row = id / perRow;
+            const uint64_t hash = dctVariants[id];
+            if (hash == dctRow(row))
+            {
+                return false;
+            }
+            for (uint32_t other = row * perRow; other < id; ++other)
+            {
+                if (dctVariants[other] == hash)
+                {
+                    return false;
+                }
+            }
+            return true;
+        };
+        std::vector<char> useful(dctVariants.size());
+        for (uint32_t id = 0; id < useful.size(); ++id)
+        {
+            useful[id] = distinct(id);
+        }
+
+        for (int c = 0; c < dctChunks; ++c)
+        {
+            auto chunk = [this, c](uint32_t id) {
+                return static_cast<uint32_t>((dctVariants[id] >> (c * dctChunkBits)) & ((1u << dctChunkBits) - 1));
+            };
+            variantStart.assign(values + 1, 0);
+            for (uint32_t id = 0; id < useful.size(); ++id)
+            {
+                if (useful[id])
+                {
+                    ++variantStart[chunk(id) + 1];
+                }
+            }
+            for (uint32_t v = 0; v < values; ++v)
+            {
+                variantStart[v + 1] += variantStart[v];
+            }
+            variantIds.resize(variantStart[values]);
+            std::vector<uint32_t> fill(variantStart.begin(), variantStart.end() - 1);
+            for (uint32_t id = 0; id < useful.size(); ++id)
+            {
+                if (useful[id])
+                {
+                    variantIds[fill[chunk(id)]++] = id;
+                }
+            }
+
+            variantChunk = c;
+            nextUnit = 0;
+            runWorkers();
+        }
+    }
+
+    // Collect the sets of more than one image
+    std::vector<uint32_t> roots(rows);
+    std::vector<uint32_t> sizes(rows, 0);
+    for (uint32_t row = 0; row < rows; ++row)
+    {
+        roots[row] = sets.find(row);
+        ++sizes[roots[row]];
+    }
+    std::vector<uint32_t> groupOf(rows, 0);
+    for (uint32_t row = 0; row < rows; ++row)
+    {
+        if (roots[row] == row && sizes[row] > 1)
+        {
+            groupOf[row] = static_cast<uint32_t>(groups.size());
+            groups.emplace_back();
+            groups.back().reserve(sizes[row]);
+        }
+    }
+    for (uint32_t row = 0; row < rows; ++row)
+    {
+        if (sizes[roots[row]] > 1)
+        {
+            groups[groupOf[roots[row]]].push_back(dct.owners[row]);
+        }
+    }
+    for (std::vector<uint32_t> &group : groups)
+    {
+        std::sort(group.begin(), group.end());
+    }
+    std::sort(groups.begin(), groups.end(), [](const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+        return a.size() != b.size() ? a.size() > b.size() : a.front() < b.front();
+    });
+    return groups;
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <SQLiteCpp/Database.h>
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pHash.h"
+
+/**
+ * Kind of perceptual hash an index lookup compares.
+ */
+enum class HashKind
+{
+    Dct, // 64 bit DCT hash
+    Mh,  // Marr-Hildreth hash
+    Bmb  // block mean hash
+};
+
+/**
+ * Parses "dct", "mh" or "bmb". Returns false for anything else.
+ */
+bool parseHashKind(const std::string &name, HashKind &kind);
+
+/**
+ * The PH_HASH_* bit of a kind.
+ */
+int hashKindBit(HashKind kind);
+
+/**
+ * Parses a byte string given as two hex digits per byte.
+ */
+bool parseHex(const std::string &hex, std::vector<uint8_t> &bytes);
+
+/**
+ * Parses a hash given in hex on the command line or in the query protocol into the byte layout of the
+ * index. A DCT hash is a 64 bit number, as printed by the scan; MH and BMB hashes are byte strings.
+ */
+bool parseHash(HashKind kind, const std::string &hex, std::vector<uint8_t> &hash);
+
+/**
+ * Whether table has a column of that name.
+ */
+bool hasColumn(SQLite::Database &db, const std::string &table, const std::string &column);
+
+/**
+ * A stored image reranked by the radial digest: its peak cross correlation with the query digest, and the
+ * prefilter hash distance that shortlisted it.
+ */
+struct CascadeMatch
+{
+    uint32_t image;
+    int distance;
+    double correlation;
+};
+
+/**
+ * Bit-sampling LSH settings for the MH and BMB hashes, see ph_lsh_index_new. With tables = 0 these hashes
+ * are searched by an exact scan.
+ */
+struct LshParams
+{
+    int tables = 0;
+    int bits = 16;
+    int probes = 1;
+};
+
+/**
+ * Parses "<tables>,<bits>,<probes>". Returns false if malformed.
+ */
+bool parseLshParams(const std::string &text, LshParams &params);
+
+/**
+ * Recall of the LSH search against the exact scan, and the mean latency of both.
+ */
+struct LshBenchmark
+{
+    size_t queries = 0;
+    double recall = 0;
+    double lshMicros = 0;
+    double scanMicros = 0;
+};
+
+/**
+ * A stored image and its Hamming distance to a query.
+ */
+struct ImageMatch
+{
+    uint32_t image;
+    int distance;
+};
+
+/**
+ * Read-only in-memory copy of the image table with lookup structures for the file hash and the
+ * perceptual hashes. Lookups do not modify the index and can run concurrently.
+ *
+ * DCT hashes are multi-indexed: the 64 bits are cut into four 16 bit substrings, each with its own
+ * table. Two hashes within distance r agree up to r/4 bits on at least one substring, so queries up to
+ * radius 11 only verify the images found by probing the substring tables. Larger radii and the MH and
+ * BMB hashes use a SIMD scan over contiguous hash arenas.
+ */
+class ImageIndex
+{
+public:
+    /**
+     * Loads the file hashes and the perceptual hashes selected by the PH_HASH_* bits in hashes (the radial
+     * digests with PH_HASH_DIGEST, the DCT hashes of all orientations with PH_HASH_DCT_COEFFS). Loading
+     * fewer columns is faster when only one kind is queried. The MH and BMB hashes get LSH tables as set
+     * by lsh.
+     */
+    explicit ImageIndex(SQLite::Database &db, int hashes = PH_HASH_DCT | PH_HASH_MH | PH_HASH_BMB,
+                        const LshParams &lsh = LshParams());
+    ~ImageIndex();
+
+    ImageIndex(const ImageIndex &) = delete;
+    ImageIndex &operator=(const ImageIndex &) = delete;
+
+    size_t size() const { return filenames.size(); }
+    const std::string &filename(uint32_t image) const { return filenames[image]; }
+    const std::string &fileHash(uint32_t image) const { return fileHashes[image]; }
+
+    /**
+     * Length in bytes of the hashes of a kind, 0 if no image has one.
+     */
+    uint32_t hashLength(HashKind kind) const;
+
+    /**
+     * Images whose file content hash is md5.
+     */
+    std::vector<uint32_t> findFileHash(const std::string &md5) const;
+
+    /**
+     * Libraries from this size on get a Bloom filter in front of the file hash table, so that looking up a
+     * file that is not stored touches one cache line instead of the table.
+     */
+    static const size_t fileHashFilterMinImages = 1 << 16;
+
+    /**
+     * The Bloom filter lookup of findFileHash: false only if no image has the file hash md5. It is true
+     * for every stored hash and for about 0.1 % of the others, and always true without a filter.
+     */
+    bool mayHaveFileHash(const std::string &md5) const;
+
+    /**
+     * Images within radius bits of hash, by increasing distance.
+     */
+    std::vector<ImageMatch> findWithin(HashKind kind, const uint8_t *hash, int radius) const;
+
+    /**
+     * The k images closest to hash, by increasing distance.
+     */
+    std::vector<ImageMatch> findNearest(HashKind kind, const uint8_t *hash, size_t k) const;
+
+    /**
+     * Same searches for count hashes stored one after the other, each image at its distance to the closest
+     * of them. Matching all orientations of a query this way takes one pass over the hashes.
+     */
+    std::vector<ImageMatch> findWithinAny(HashKind kind, const uint8_t *hashes, int count, int radius) const;
+    std::vector<ImageMatch> findNearestAny(HashKind kind, const uint8_t *hashes, int count, size_t k) const;
+
+    /**
+     * Number of coefficients of the stored radial digests, 0 if none were loaded.
+     */
+    int digestSize() const { return digestLength; }
+
+    /**
+     * Cascade search: the shortlist images closest to hash within radius bits are reranked by the peak
+     * cross correlation of their radial digest with the query digest, and the k best returned by
+     * decreasing correlation. Images without a digest are dropped from the shortlist.
+     */
+    std::vector<CascadeMatch> findCascade(HashKind kind, const uint8_t *hash, const uint8_t *digest, size_t k,
+                                          size_t shortlist = defaultShortlist, int radius = defaultCascadeRadius) const;
+
+    /**
+     * Cascade defaults: a shortlist loose enough for the digest to recover matches the hash ranks low.
+     */
+    static const size_t defaultShortlist = 200;
+    static const int defaultCascadeRadius = 24;
+
+    /**
+     * Whether hashes of a kind are searched through LSH tables, approximately.
+     */
+    bool hasLsh(HashKind kind) const { return column(kind).lsh != nullptr; }
+
+    /**
+     * Runs k nearest queries both through the LSH tables and by exact scan and compares them. The queries
+     * are stored hashes with a few bits flipped. The recall is the share of the exact k nearest distances
+     * matched by the LSH results.
+     */
+    LshBenchmark measureLsh(HashKind kind, size_t queries, size_t k) const;
+
+    /**
+     * Largest radius clusterDct accepts.
+     */
+    static const int maxClusterRadius = 15;
+
+    /**
+     * Groups of images connected by DCT hashes within radius bits of each other (single linkage), each
+     * group sorted, largest groups first. Images without a near-duplicate are left out.
+     *
+     * Candidate pairs come from the substring tables, so the join never compares all pairs; they are
+     * verified with the SIMD Hamming kernels and merged with a concurrent union-find. Memory stays
+     * linear in the number of images. threads = 0 uses one thread per core.
+     *
+     * With orientations, an image is also linked to the images within radius of one of its flips and
+     * rotations by 90 degrees, whose hashes were derived from the stored DCT coefficients at load time.
+     * This needs PH_HASH_DCT_COEFFS, see hasDctOrientations.
+     */
+    std::vector<std::vector<uint32_t>> clusterDct(int radius, int threads = 0, bool orientations = false) const;
+
+    /**
+     * Whether the DCT hashes of the flipped and rotated images were loaded.
+     */
+    bool hasDctOrientations() const { return !dctVariants.empty(); }
+
+private:
+    static const int dctChunks = 4;
+    static const int dctChunkBits = 16;
+    static const int dctOrientations = 8;
+    static const int maxProbeRadius = 3 * dctChunks - 1;
+
+    // Hashes of one kind: arena row i belongs to image owners[i]
+    struct HashColumn
+    {
+        HashArena *arena = nullptr;
+        LSHIndex *lsh = nullptr;
+        std::vector<uint32_t> owners;
+    };
+
+    const HashColumn &column(HashKind kind) const;
+    void addHash(HashColumn &column, const void *hash, int length, uint32_t image);
+    void addDctVariants(const void *coeffs, int bytes, uint64_t hash);
+    void buildDctTables();
+    void buildLsh(HashColumn &column);
+    std::vector<ImageMatch> searchLsh(const HashColumn &column, const uint8_t *hash, size_t k, int radius) const;
+    void closestDistances(const HashColumn &column, const uint8_t *hashes, int count, int start, int rows, int *closest,
+                          std::vector<int> &scratch) const;
+    std::vector<ImageMatch> nearestScan(const HashColumn &column, const uint8_t *hashes, int count, size_t k) const;
+    std::vector<ImageMatch> probeDct(uint64_t hash, int radius) const;
+    std::vector<ImageMatch> scan(const HashColumn &column, const uint8_t *hashes, int count, int radius) const;
+    uint64_t dctRow(uint32_t row) const;
+    void buildFileHashFilter();
+
+    LshParams lshParams;
+
+    std::vector<std::string> filenames;
+    std::vector<std::string> fileHashes;
+    std::unordered_multimap<std::string, uint32_t> byFileHash;
+
+    // Blocked Bloom filter: each file hash sets fileHashFilterBits bits in one block of 8 words. Blocks are
+    // cache line aligned (C++17 allocates over-aligned types accordingly), so a lookup reads one line.
+    struct alignas(64) FilterBlock
+    {
+        uint64_t words[8];
+    };
+    static const int fileHashFilterBits = 6;
+    std::vector<FilterBlock> fileHashFilter;
+
+    HashColumn dct;
+    HashColumn mh;
+    HashColumn bmb;
+
+    // Radial digests of digestLength coefficients, one after the other; image i has the digest at
+    // digestRows[i], or -1.
+    int digestLength = 0;
+    std::vector<uint8_t> digests;
+    std::vector<int32_t> digestRows;
+
+    // Hashes of the 7 other orientations of each dct arena row, in ph_dct_dihedral_hashes order;
+    // row r has them at [7 r, 7 r + 7). Empty unless loaded.
+    std::vector<uint64_t> dctVariants;
+
+    // Substring tables over the dct arena rows, in compressed row form: rows with substring value v
+    // in chunk c are dctRows[c][dctStart[c][v] .. dctStart[c][v + 1]).
+    std::array<std::vector<uint32_t>, dctChunks> dctStart;
+    std::array<std::vector<uint32_t>, dctChunks> dctRows;
+};
@@ -0,0 +1,295 @@
+#include "ioscheduler.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <utility>
+
+namespace
+{
+
+// Readers of a device whose kind cannot be found out, e.g. a network file system
+const int defaultReaders = 4;
+const int ssdReaders = 8;
+const int nvmeReaders = 16;
+
+// A throttled read starts with this much, timed to measure how busy the device is.
+const size_t latencyProbeSize = 64 * 1024;
+
+std::string readSysfs(const std::string &path)
+{
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+    return value;
+}
+
+/**
+ * Sets the kind and readers of a device from sysfs.
+ */
+void probeDevice(dev_t id, std::string &name, bool &rotational, int &readers)
+{
+    name = "unknown";
+    rotational = false;
+    readers = defaultReaders;
+#ifdef __linux__
+    const std::string link = "/sys/dev/block/" + std::to_string(major(id)) + ":" + std::to_string(minor(id));
+    char resolved[PATH_MAX];
+    if (!realpath(link.c_str(), resolved))
+    {
+        return;
+    }
+    std::string disk = resolved;
+    // A partition shares the queue of its disk, one directory up.
+    if (access((disk + "/partition").c_str(), F_OK) == 0)
+    {
+        disk = disk.substr(0, disk.rfind('/'));
+    }
+    name = disk.substr(disk.rfind('/') + 1);
+
+    // md arrays are rotational when any member is; each member disk can serve its own reader.
+    const int raidDisks = std::atoi(readSysfs(disk + "/md/raid_disks").c_str());
+    rotational = readSysfs(disk + "/queue/rotational") == "1";
+    if (rotational)
+    {
+        readers = raidDisks > 1 ? raidDisks : 1;
+    }
+    else
+    {
+        readers = name.compare(0, 4, "nvme") == 0 ? nvmeReaders : ssdReaders;
+    }
+#endif
+}
+
+/**
+ * Physical offset of the first extent of a file. unsupported is set when the file system has no FIEMAP.
+ */
+bool firstPhysicalOffset(const std::string &path, uint64_t &offset, bool &unsupported)
+{
+#ifdef __linux__
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // Room for the header and a single extent
+    alignas(fiemap) uint8_t buffer[sizeof(fiemap) + sizeof(fiemap_extent)];
+    memset(buffer, 0, sizeof(buffer));
+    fiemap *request = reinterpret_cast<fiemap *>(buffer);
+    request->fm_start = 0;
+    request->fm_length = FIEMAP_MAX_OFFSET;
+    request->fm_extent_count = 1;
+    const int res = ioctl(fd, FS_IOC_FIEMAP, request);
+    const int error = errno;
+    close(fd);
+    if (res < 0)
+    {
+        unsupported = error == EOPNOTSUPP || error == ENOTTY;
+        return false;
+    }
+    if (request->fm_mapped_extents == 0)
+    {
+        return false;
+    }
+    offset = request->fm_extents[0].fe_physical;
+    return true;
+#else
+    unsupported = true;
+    return false;
+#endif
+}
+
+bool readWhole(ReadFile &file, Throttle *throttle, dev_t device)
+{
+    const int fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0;
+    if (ok)
+    {
+        file.lastWriteTime = info.st_mtime;
+        const size_t size = static_cast<size_t>(info.st_size);
+        if (throttle)
+        {
+            throttle->acquireBytes(size);
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        file.contents.resize(size);
+        size_t done = 0;
+        const auto started = std::chrono::steady_clock::now();
+        while (done < size)
+        {
+            const bool probe = throttle && done == 0;
+            const size_t wanted = probe ? std::min(size, latencyProbeSize) : size - done;
+            const ssize_t n = read(fd, file.contents.data() + done, wanted);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            if (probe)
+            {
+                const std::chrono::duration<double> latency = std::chrono::steady_clock::now() - started;
+                throttle->reportLatency(static_cast<uint64_t>(device), latency.count());
+            }
+            done += static_cast<size_t>(n);
+        }
+        ok = done == size;
+    }
+    close(fd);
+    if (!ok)
+    {
+        file.contents.clear();
+    }
+    return ok;
+}
+
+} // namespace
+
+IoScheduler::IoScheduler(const std::vector<std::string> &files) : fileCount(files.size())
+{
+    // Group by device, with the inode as first guess of the read order. Files that cannot be stat'ed
+    // go to device 0 and fail when read.
+    std::map<dev_t, std::vector<std::pair<uint64_t, std::string>>> byDevice;
+    for (const std::string &path : files)
+    {
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0)
+        {
+            byDevice[info.st_dev].emplace_back(static_cast<uint64_t>(info.st_ino), path);
+        }
+        else
+        {
+            byDevice[0].emplace_back(0, path);
+        }
+    }
+
+    for (auto &group : byDevice)
+    {
+        auto device = std::make_unique<Device>();
+        device->id = group.first;
+        probeDevice(device->id, device->name, device->rotational, device->readers);
+        std::vector<std::pair<uint64_t, std::string>> &keyed = group.second;
+
+        // Only seeks on rotating disks are worth an open and ioctl per file.
+        if (device->rotational)
+        {
+            std::vector<std::pair<uint64_t, std::string>> physical(keyed.size());
+            bool unsupported = false;
+            for (size_t i = 0; i < keyed.size() && !unsupported; ++i)
+            {
+                uint64_t offset = 0; // files without extents, e.g. empty or inline, go first
+                firstPhysicalOffset(keyed[i].second, offset, unsupported);
+                physical[i] = std::make_pair(offset, keyed[i].second);
+            }
+            if (!unsupported)
+            {
+                keyed.swap(physical);
+                device->physicalOrder = true;
+            }
+        }
+
+        std::sort(keyed.begin(), keyed.end());
+        device->files.reserve(keyed.size());
+        for (auto &file : keyed)
+        {
+            device->files.push_back(std::move(file.second));
+        }
+        devices.push_back(std::move(device));
+    }
+}
+
+IoScheduler::~IoScheduler()
+{
+    if (ready)
+    {
+        ready->close();
+    }
+    for (std::thread &reader : readers)
+    {
+        reader.join();
+    }
+}
+
+void IoScheduler::start(size_t buffered, Throttle *readThrottle)
+{
+    throttle = readThrottle;
+    ready = std::make_unique<BoundedQueue<ReadFile>>(buffered);
+    int total = 0;
+    for (const auto &device : devices)
+    {
+        total += std::min(device->readers, static_cast<int>(device->files.size()));
+    }
+    activeReaders = total;
+    if (total == 0)
+    {
+        ready->close();
+        return;
+    }
+    for (const auto &device : devices)
+    {
+        for (int r = 0; r < std::min(device->readers, static_cast<int>(device->files.size())); ++r)
+        {
+            readers.emplace_back(&IoScheduler::readFiles, this, std::ref(*device));
+        }
+    }
+}
+
+void IoScheduler::readFiles(Device &device)
+{
+    for (size_t i = device.nextFile++; i < device.files.size(); i = device.nextFile++)
+    {
+        if (throttle)
+        {
+            throttle->acquireFile();
+        }
+        ReadFile file;
+        file.path = device.files[i];
+        file.ok = readWhole(file, throttle, device.id);
+        if (!ready->push(std::move(file)))
+        {
+            break;
+        }
+    }
+    if (--activeReaders == 0)
+    {
+        ready->close();
+    }
+}
+
+bool IoScheduler::next(ReadFile &file)
+{
+    return ready && ready->pop(file);
+}
+
+void IoScheduler::describe(std::ostream &out) const
+{
+    for (const auto &device : devices)
+    {
+        out << device->name << ": " << (device->rotational ? "rotational" : "non-rotational") << ", "
+            << device->files.size() << " files, " << device->readers << (device->readers == 1 ? " reader" : " readers")
+            << ", " << (device->physicalOrder ? "physical" : "inode") << " order" << std::endl;
+    }
+}
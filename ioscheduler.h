@@ -0,0 +1,95 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boundedqueue.h"
+#include "throttle.h"
+
+/**
+ * A file read by the IoScheduler. ok is false if it could not be opened or read.
+ */
+struct ReadFile
+{
+    std::string path;
+    std::vector<uint8_t> contents;
+    std::time_t lastWriteTime = 0;
+    bool ok = false;
+};
+
+/**
+ * Reads many files with as few seeks as possible.
+ *
+ * Files are grouped by the device they are stored on (st_dev). Each device gets its own reader threads:
+ * one for a rotational disk, so that it reads strictly in order, one per member disk for a RAID array, and
+ * more for SSDs and NVMe drives, which need parallel requests to reach their bandwidth. On rotational
+ * devices files are read in the order of their first physical block as reported by FIEMAP, elsewhere (or
+ * where FIEMAP is not supported) by inode number, which most file systems allocate close to the data.
+ *
+ * The files read are handed out through next(), typically to hashing threads, so that reading and
+ * decoding overlap.
+ */
+class IoScheduler
+{
+public:
+    /**
+     * Stats the files and plans the reads; nothing is read before start().
+     */
+    explicit IoScheduler(const std::vector<std::string> &files);
+
+    /**
+     * Stops the readers.
+     */
+    ~IoScheduler();
+
+    IoScheduler(const IoScheduler &) = delete;
+    IoScheduler &operator=(const IoScheduler &) = delete;
+
+    /**
+     * Starts the reader threads. At most buffered files are held read but not yet taken by next(). With a
+     * throttle, every read waits for it and reports its latency to it.
+     */
+    void start(size_t buffered, Throttle *throttle = nullptr);
+
+    /**
+     * Takes the next file read, from whichever device delivers first. Returns false once all files are
+     * done. Can be called from several threads.
+     */
+    bool next(ReadFile &file);
+
+    size_t size() const { return fileCount; }
+
+    /**
+     * Prints one line per device: its kind, files, readers and read order.
+     */
+    void describe(std::ostream &out) const;
+
+private:
+    struct Device
+    {
+        dev_t id = 0;
+        std::string name;
+        bool rotational = false;
+        int readers = 1;
+        bool physicalOrder = false;
+        std::vector<std::string> files;
+        std::atomic<size_t> nextFile{0};
+    };
+
+    void readFiles(Device &device);
+
+    size_t fileCount = 0;
+    std::vector<std::unique_ptr<Device>> devices;
+    std::unique_ptr<BoundedQueue<ReadFile>> ready;
+    Throttle *throttle = nullptr;
+    std::vector<std::thread> readers;
+    std::atomic<int> activeReaders{0};
+};
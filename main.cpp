@@ -6,18 +6,34 @@
 #include <cmdparser.hpp>
 
 #include <array>
+#include <atomic>
+#include <deque>
 #include <iostream>
 #include <sstream>
+#include <chrono>
 #include <future>
+#include <iomanip>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include <poll.h>
+#include <unistd.h>
 
 #include <turbojpeg.h>
 
 #include <sqlite3.h>
 #include <SQLiteCpp/Database.h>
 #include <SQLiteCpp/Column.h>
+#include <SQLiteCpp/Statement.h>
 
-#define cimg_use_jpeg
-//#include <CImg.h>
+#include "boundedqueue.h"
+#include "imageindex.h"
+#include "ioscheduler.h"
+#include "pHash.h"
+#include "server.h"
+#include "throttle.h"
+#include "thumbnailstore.h"
 
 template <typename OnImageFile>
 void search_recursive(const boost::filesystem::path &dir, OnImageFile on_image_file)
@@ -81,8 +97,34 @@ struct ImageEntry
     std::string filename;
     std::string md5Hash;
     std::time_t lastWriteTime;
+
+    // Perceptual hashes, valid for the PH_HASH_* bits set in perceptualHashes
+    int perceptualHashes = 0;
+    uint64_t dctHash = 0;
+    std::vector<uint8_t> mhHash;
+    std::vector<uint8_t> bmbHash;
+    std::vector<uint8_t> digest;
+    std::vector<uint8_t> dctCoeffs; // 64 floats, see ph_dct_coeffs_hash
+
+    // Luma thumbnail the hashes were computed from (PH_HASH_THUMBNAIL)
+    std::vector<uint8_t> thumbnail;
+    int thumbnailWidth = 0;
+    int thumbnailHeight = 0;
 };
 
+/**
+ * Longest side of the luma thumbnail every image is reduced to before hashing. Stored images, queries and
+ * rehashes all hash the same reduced image, so the hashes stay comparable.
+ */
+const int thumbnailSize = 256;
+
+HashParams imageHashParams()
+{
+    HashParams params = ph_default_hash_params();
+    params.thumbnail_size = thumbnailSize;
+    return params;
+}
+
 std::string formatTime(std::time_t time)
 {
     tm utcTime;
@@ -92,8 +134,81 @@ std::string formatTime(std::time_t time)
     return std::string(buffer);
 }
 
+/**
+ * Copies the hashes into the image entry.
+ */
+void store_hashes(const ImageHashes &hashes, ImageEntry &image)
+{
+    image.perceptualHashes = hashes.which;
+    if (hashes.which & PH_HASH_DCT)
+    {
+        image.dctHash = hashes.dct;
+    }
+    if (hashes.which & PH_HASH_MH)
+    {
+        image.mhHash.assign(hashes.mh, hashes.mh + hashes.mh_length);
+    }
+    if (hashes.which & PH_HASH_BMB)
+    {
+        image.bmbHash.assign(hashes.bmb->hash, hashes.bmb->hash + hashes.bmb->bytelength);
+    }
+    if (hashes.which & PH_HASH_DIGEST)
+    {
+        image.digest.assign(hashes.digest.coeffs, hashes.digest.coeffs + hashes.digest.size);
+    }
+    if (hashes.which & PH_HASH_DCT_COEFFS)
+    {
+        const uint8_t *coeffs = reinterpret_cast<const uint8_t *>(hashes.dct_coeffs);
+        image.dctCoeffs.assign(coeffs, coeffs + sizeof(hashes.dct_coeffs));
+    }
+    if (hashes.which & PH_HASH_THUMBNAIL)
+    {
+        image.thumbnail.assign(hashes.thumbnail,
+                               hashes.thumbnail + static_cast<size_t>(hashes.thumbnail_width) * hashes.thumbnail_height);
+        image.thumbnailWidth = hashes.thumbnail_width;
+        image.thumbnailHeight = hashes.thumbnail_height;
+    }
+}
+
+/**
+ * Computes the perceptual hashes selected by the PH_HASH_* bits in which from the already read file so the
+ * image is not loaded a second time.
+ */
+void compute_perceptual_hashes(const std::vector<uint8_t> &file_buffer, ImageEntry &image, int which)
+{
+    const HashParams params = imageHashParams();
+    ImageHashes hashes;
+    ph_image_hashes_buffer(file_buffer.data(), file_buffer.size(), which, hashes, &params);
+    store_hashes(hashes, image);
+    ph_free_image_hashes(hashes);
+}
+
+/**
+ * Image entry of a file already read into memory.
+ */
 ImageEntry
-compute_image_hash(const boost::filesystem::path &path, bool verbose)
+hash_image_buffer(const std::vector<uint8_t> &file_buffer, const std::string &filename, std::time_t lastWriteTime,
+                  int which)
+{
+    ImageEntry image;
+    image.filename = filename;
+    image.md5Hash = calc_hash(file_buffer);
+    image.lastWriteTime = lastWriteTime;
+
+    compute_perceptual_hashes(file_buffer, image, which);
+    return image;
+}
+
+void print_image_entry(const ImageEntry &image)
+{
+    std::ostringstream line;
+    line << image.filename << " md5=" << image.md5Hash << " dct=" << std::hex << image.dctHash << std::dec
+         << " time=" << formatTime(image.lastWriteTime) << '\n';
+    std::cout << line.str() << std::flush;
+}
+
+ImageEntry
+compute_image_hash(const boost::filesystem::path &path, bool verbose, int which = PH_HASH_ALL)
 {
     std::vector<uint8_t> file_buffer;
 
@@ -123,15 +238,14 @@ compute_image_hash(const boost::filesystem::path &path, bool verbose)
 
     file.close();
 
-    auto hash = calc_hash(file_buffer);
+    ImageEntry image = hash_image_buffer(file_buffer, path.string(), lastWriteTime, which);
 
     if (verbose)
     {
-        const std::string t = formatTime(lastWriteTime);
-        std::cout << path.string() << " md5=" << hash << " time=" << t << std::endl;
+        print_image_entry(image);
     }
 
-    return {.filename = path.string(), .md5Hash = std::move(hash), .lastWriteTime = lastWriteTime};
+    return image;
 }
 
 // Code to compute the image hash opposed to the file hash
@@ -163,11 +277,50 @@ compute_image_hash(const boost::filesystem::path &path, bool verbose)
 //    std::wcout << filename << L" md5 sum = " << hashes.back() << std::endl;
 //}
 
-void createImageTable(SQLite::Database &db)
+/**
+ * How a connection is going to use the database.
+ */
+enum class DatabaseMode
+{
+    Ingest, // bulk writes by a scan
+    Query   // reads, possibly while a scan is running
+};
+
+/**
+ * Opens the image database and configures the connection for mode.
+ *
+ * The database is switched to WAL so that queries read a consistent snapshot while a scan keeps
+ * writing, and neither blocks the other. synchronous=NORMAL is safe in WAL mode: a power loss can only
+ * drop the last commits, never corrupt the file.
+ */
+std::unique_ptr<SQLite::Database> openDatabase(const std::string &filename, DatabaseMode mode)
+{
+    const int flags = mode == DatabaseMode::Ingest ? SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE
+                                                   : SQLite::OPEN_READONLY;
+    auto db = std::make_unique<SQLite::Database>(filename, flags, 5000);
+
+    if (mode == DatabaseMode::Ingest)
+    {
+        db->exec("PRAGMA journal_mode = WAL");
+        db->exec("PRAGMA synchronous = NORMAL");
+        db->exec("PRAGMA temp_store = MEMORY");
+    }
+    else
+    {
+        db->exec("PRAGMA query_only = ON");
+    }
+    db->exec("PRAGMA cache_size = -65536");     // 64 MiB
+    db->exec("PRAGMA mmap_size = 1073741824");  // 1 GiB
+
+    return db;
+}
+
+void createImageTable(SQLite::Database &db, const std::string &table)
 {
     try
     {
-        db.exec("CREATE TABLE images (id INTEGER PRIMARY KEY, filename TEXT, time TEXT, fileHash TEXT)");
+        db.exec("CREATE TABLE " + table + " (id INTEGER PRIMARY KEY, filename TEXT, time TEXT, fileHash TEXT, "
+                "dctHash INTEGER, mhHash BLOB, bmbHash BLOB, digest BLOB, dctCoeffs BLOB, thumbOffset INTEGER)");
     }
     catch (const std::exception &e)
     {
@@ -175,19 +328,74 @@ void createImageTable(SQLite::Database &db)
     }
 }
 
-void addImageToTable(SQLite::Database &db, const ImageEntry &image)
+/**
+ * Creates the lookup indexes. A scan calls this after its bulk insert, which is faster than
+ * maintaining the indexes row by row.
+ *
+ * The perceptual hashes get no index: B-trees only serve equality, and every Hamming search runs on the
+ * ImageIndex in memory. Indexes on them from older databases are dropped.
+ */
+void createImageIndexes(SQLite::Database &db)
+{
+    db.exec("CREATE INDEX IF NOT EXISTS images_fileHash ON images (fileHash)");
+    db.exec("CREATE INDEX IF NOT EXISTS images_filename ON images (filename)");
+    db.exec("DROP INDEX IF EXISTS images_dctHash");
+    db.exec("DROP INDEX IF EXISTS images_mhHash");
+    db.exec("DROP INDEX IF EXISTS images_bmbHash");
+}
+
+void bindBlob(SQLite::Statement &statement, int index, const std::vector<uint8_t> &blob)
+{
+    if (blob.empty())
+    {
+        statement.bind(index);
+    }
+    else
+    {
+        statement.bind(index, blob.data(), static_cast<int>(blob.size()));
+    }
+}
+
+/**
+ * Binds the perceptual hash columns dctHash, mhHash, bmbHash, digest and dctCoeffs from index first on.
+ */
+void bindHashes(SQLite::Statement &statement, int first, const ImageEntry &image)
 {
-    std::stringstream insertCmd;
-    insertCmd << "INSERT INTO images VALUES (";
-    insertCmd << "NULL, ";
-    insertCmd << "\"" << image.filename << "\", ";
-    insertCmd << "\"" << formatTime(image.lastWriteTime) << "\", ";
-    insertCmd << "\"" << image.md5Hash << "\"";
-    insertCmd << ")";
+    if (image.perceptualHashes & PH_HASH_DCT)
+    {
+        statement.bind(first, static_cast<long long>(image.dctHash));
+    }
+    else
+    {
+        statement.bind(first);
+    }
+    bindBlob(statement, first + 1, image.mhHash);
+    bindBlob(statement, first + 2, image.bmbHash);
+    bindBlob(statement, first + 3, image.digest);
+    bindBlob(statement, first + 4, image.dctCoeffs);
+}
 
+/**
+ * Inserts an image; thumbOffset locates its thumbnail in the thumbnail store, -1 for none.
+ */
+void addImageToTable(SQLite::Statement &insert, const ImageEntry &image, int64_t thumbOffset)
+{
     try
     {
-        int nb = db.exec(insertCmd.str());
+        insert.reset();
+        insert.bind(1, image.filename);
+        insert.bind(2, formatTime(image.lastWriteTime));
+        insert.bind(3, image.md5Hash);
+        bindHashes(insert, 4, image);
+        if (thumbOffset >= 0)
+        {
+            insert.bind(9, static_cast<long long>(thumbOffset));
+        }
+        else
+        {
+            insert.bind(9);
+        }
+        insert.exec();
     }
     catch (const std::exception &e)
     {
@@ -195,7 +403,63 @@ void addImageToTable(SQLite::Database &db, const ImageEntry &image)
     }
 }
 
-void updateDB(bool rescan, bool verbose, const boost::filesystem::path &imageFolder)
+/**
+ * Nice level of a background scan: the lowest priority.
+ */
+const int backgroundNice = 19;
+
+/**
+ * A scan fills this table, next to images, and replaces images with it once complete. Its progress is in
+ * the one row of table scanState.
+ */
+const std::string scanTable = "images_scan";
+
+/**
+ * The thumbnails of the scan in progress, renamed to the thumbnail store after the tables are swapped.
+ */
+std::string scanThumbnailPath(const std::string &database)
+{
+    return ThumbnailStore::pathFor(database) + ".scan";
+}
+
+/**
+ * Puts the thumbnails of a scan in place if the scan swapped its table in but stopped before renaming them.
+ */
+void finishThumbnailSwap(SQLite::Database &db, const std::string &database)
+{
+    const std::string scanThumbnails = scanThumbnailPath(database);
+    if (!db.tableExists(scanTable) && boost::filesystem::exists(scanThumbnails))
+    {
+        boost::filesystem::rename(scanThumbnails, ThumbnailStore::pathFor(database));
+    }
+}
+
+/**
+ * Starts the transaction of the next batch after committing the current one, together with the progress
+ * of the scan. Rows only refer to thumbnails already on disk.
+ */
+void commitCheckpoint(SQLite::Database &db, ThumbnailStore &thumbnails, size_t doneCount)
+{
+    thumbnails.sync();
+    SQLite::Statement progress(db, "UPDATE scanState SET checkpoint = ?, done = ?");
+    progress.bind(1, formatTime(std::time(nullptr)));
+    progress.bind(2, static_cast<long long>(doneCount));
+    progress.exec();
+    db.exec("COMMIT");
+    db.exec("BEGIN");
+}
+
+/**
+ * Scans imageFolder into the database if rescan is set or the table is missing or outdated. threads is the
+ * number of hashing threads, 0 for one per core. With a throttle the scan runs in the background: at idle
+ * I/O priority and lowest CPU priority, with reads paced by the throttle, and by default with a quarter of
+ * the cores.
+ *
+ * The scan commits its rows in checkpoints to a table of its own and replaces the images table only when it
+ * is complete. A scan of the same folder that was interrupted is resumed, skipping the files it has done.
+ */
+void updateDB(bool rescan, bool verbose, const boost::filesystem::path &imageFolder, const std::string &database,
+              int threads, Throttle *throttle)
 {
     using namespace boost::filesystem;
     if (!is_directory(imageFolder))
@@ -204,55 +468,756 @@ void updateDB(bool rescan, bool verbose, const boost::filesystem::path &imageFol
         exit(1);
     }
 
-    SQLite::Database db("imgdb.sqlite", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE);
+    auto connection = openDatabase(database, DatabaseMode::Ingest);
+    SQLite::Database &db = *connection;
+    finishThumbnailSwap(db, database);
+
+    bool resume = false;
+    if (db.tableExists(scanTable) && db.tableExists("scanState"))
+    {
+        SQLite::Statement state(db, "SELECT folder, started FROM scanState");
+        if (state.executeStep() && state.getColumn(0).getString() == imageFolder.string())
+        {
+            std::clog << "Resuming the scan of " << imageFolder.string() << " started "
+                      << state.getColumn(1).getString() << "." << std::endl;
+            resume = true;
+            rescan = true;
+        }
+    }
 
     if (!rescan && !db.tableExists("images"))
     {
         std::clog << "Database does not contain images... creating it." << std::endl;
         rescan = true;
     }
+    else if (!rescan && !hasColumn(db, "images", "dctHash"))
+    {
+        std::clog << "Database does not contain perceptual hashes... recreating it." << std::endl;
+        rescan = true;
+    }
+    else if (!rescan && !hasColumn(db, "images", "dctCoeffs"))
+    {
+        std::clog << "Database does not contain DCT coefficients... recreating it." << std::endl;
+        rescan = true;
+    }
+    else if (!rescan && !hasColumn(db, "images", "thumbOffset"))
+    {
+        std::clog << "Database does not contain thumbnails... recreating it." << std::endl;
+        rescan = true;
+    }
 
     if (rescan)
     {
-        db.exec("DROP TABLE IF EXISTS images");
-        createImageTable(db);
+        if (!resume)
+        {
+            // Replaces the table of any earlier scan that was interrupted, e.g. of another folder.
+            db.exec("BEGIN");
+            db.exec("DROP TABLE IF EXISTS " + scanTable);
+            db.exec("DROP TABLE IF EXISTS scanState");
+            createImageTable(db, scanTable);
+            db.exec("CREATE TABLE scanState (folder TEXT, started TEXT, checkpoint TEXT, done INTEGER)");
+            SQLite::Statement state(db, "INSERT INTO scanState VALUES (?, ?, ?, 0)");
+            const std::string now = formatTime(std::time(nullptr));
+            state.bind(1, imageFolder.string());
+            state.bind(2, now);
+            state.bind(3, now);
+            state.exec();
+            db.exec("COMMIT");
+        }
+        SQLite::Statement insert(db, "INSERT INTO " + scanTable + " VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+        ThumbnailStore thumbnails(scanThumbnailPath(database),
+                                  resume ? ThumbnailStore::Append : ThumbnailStore::Truncate);
 
         std::cout << "Scanning " << imageFolder.string() << std::endl;
 
-        std::vector<std::future<ImageEntry>> handles;
-        auto &&on_image_file = [&handles, verbose](const path &path) {
-            auto handle = std::async(std::launch::async, compute_image_hash, path, verbose);
+        std::vector<std::string> files;
+        search_recursive(imageFolder, [&files](const path &path) { files.push_back(path.string()); });
+        const size_t fileCount = files.size();
 
-            handles.emplace_back(std::move(handle));
-        };
+        // The checkpoints are the set of files done rather than a position: reads complete out of order.
+        // Rows of files changed or removed since are dropped and the changed files hashed again.
+        size_t doneCount = 0;
+        if (resume)
+        {
+            std::unordered_map<std::string, std::string> done; // filename, time
+            {
+                SQLite::Statement select(db, "SELECT filename, time FROM " + scanTable);
+                while (select.executeStep())
+                {
+                    done.emplace(select.getColumn(0).getString(), select.getColumn(1).getString());
+                }
+            }
+            std::vector<std::string> remaining;
+            std::vector<std::string> stale;
+            for (std::string &file : files)
+            {
+                const auto found = done.find(file);
+                if (found == done.end())
+                {
+                    remaining.push_back(std::move(file));
+                    continue;
+                }
+                boost::system::error_code error;
+                const std::time_t lastWriteTime = last_write_time(file, error);
+                if (!error && formatTime(lastWriteTime) == found->second)
+                {
+                    ++doneCount;
+                }
+                else
+                {
+                    stale.push_back(file);
+                    remaining.push_back(std::move(file));
+                }
+                done.erase(found);
+            }
+            for (const auto &removed : done)
+            {
+                stale.push_back(removed.first);
+            }
 
-        search_recursive(imageFolder, on_image_file);
+            SQLite::Statement remove(db, "DELETE FROM " + scanTable + " WHERE filename = ?");
+            db.exec("BEGIN");
+            for (const std::string &file : stale)
+            {
+                remove.reset();
+                remove.bind(1, file);
+                remove.exec();
+            }
+            db.exec("COMMIT");
+            files.swap(remaining);
+            std::cout << doneCount << " of " << fileCount << " files already done." << std::endl;
+        }
 
-        size_t doneCount = 0;
-        for (auto &handle : handles)
+        // Files are read per device in disk order, hashed on all cores, and written from this thread.
+        const int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        const int hashThreads = threads > 0 ? threads : throttle ? std::max(1, cores / 4) : cores;
+        if (throttle && !Throttle::enterBackground(backgroundNice))
         {
-            auto img = handle.get();
+            std::cerr << "Could not lower the I/O and CPU priority of the scan." << std::endl;
+        }
+        IoScheduler reads(files);
+        if (verbose)
+        {
+            reads.describe(std::clog);
+        }
+        reads.start(2 * hashThreads, throttle);
+
+        BoundedQueue<ImageEntry> hashed(2 * hashThreads);
+        std::atomic<int> hashing(hashThreads);
+        std::vector<std::thread> hashers;
+        for (int t = 0; t < hashThreads; ++t)
+        {
+            hashers.emplace_back([&reads, &hashed, &hashing, verbose] {
+                ReadFile file;
+                while (reads.next(file))
+                {
+                    if (!file.ok)
+                    {
+                        std::cerr << "Could not read " << file.path << std::endl;
+                        continue;
+                    }
+                    ImageEntry image = hash_image_buffer(file.contents, file.path, file.lastWriteTime, PH_HASH_ALL);
+                    if (verbose)
+                    {
+                        print_image_entry(image);
+                    }
+                    hashed.push(std::move(image));
+                }
+                if (--hashing == 0)
+                {
+                    hashed.close();
+                }
+            });
+        }
 
+        // Commit in batches, at least once a minute: an interrupted scan loses little, and no row waits
+        // for its own fsync.
+        const size_t batchSize = 1000;
+        const auto checkpointInterval = std::chrono::minutes(1);
+        auto lastCheckpoint = std::chrono::steady_clock::now();
+        size_t batchCount = 0;
+        db.exec("BEGIN");
+
+        ImageEntry img;
+        while (hashed.pop(img))
+        {
             if (img.filename.empty() || img.md5Hash.empty())
             {
                 std::cerr << "Invalid image entry" << std::endl;
                 continue;
             }
 
-            addImageToTable(db, img);
+            const int64_t thumbOffset =
+                thumbnails.append(img.thumbnail.data(), img.thumbnailWidth, img.thumbnailHeight);
+            addImageToTable(insert, img, thumbOffset);
 
             ++doneCount;
+            ++batchCount;
+            if (batchCount == batchSize || std::chrono::steady_clock::now() - lastCheckpoint > checkpointInterval)
+            {
+                commitCheckpoint(db, thumbnails, doneCount);
+                lastCheckpoint = std::chrono::steady_clock::now();
+                batchCount = 0;
+            }
             if (!verbose)
             {
-                std::cout << static_cast<size_t>(100.0 * doneCount / handles.size() + 0.5) << "%" << std::endl;
+                std::cout << static_cast<size_t>(100.0 * doneCount / fileCount + 0.5) << "%" << std::endl;
             }
         }
+        for (std::thread &hasher : hashers)
+        {
+            hasher.join();
+        }
+        commitCheckpoint(db, thumbnails, doneCount);
+
+        // Readers see the old table until the new one is complete and indexed.
+        db.exec("DROP TABLE IF EXISTS images");
+        db.exec("ALTER TABLE " + scanTable + " RENAME TO images");
+        db.exec("DROP TABLE scanState");
+        createImageIndexes(db);
+        db.exec("COMMIT");
+        finishThumbnailSwap(db, database);
+        db.exec("ANALYZE images");
         std::cout << "done." << std::endl;
     }
+    else
+    {
+        createImageIndexes(db);
+    }
+}
+
+/**
+ * Recomputes the perceptual hashes of all images from their stored thumbnails, after a change to the
+ * hash functions or their parameters. The original files are not read. Images without a thumbnail keep
+ * their hashes.
+ */
+int rehash(const std::string &database, int threads, bool verbose)
+{
+    auto connection = openDatabase(database, DatabaseMode::Ingest);
+    SQLite::Database &db = *connection;
+    finishThumbnailSwap(db, database);
+    if (!db.tableExists("images") || !hasColumn(db, "images", "thumbOffset"))
+    {
+        std::cerr << database << " has no thumbnails, run a scan first." << std::endl;
+        return 1;
+    }
+    const ThumbnailStore thumbnails(ThumbnailStore::pathFor(database), ThumbnailStore::Read);
+
+    std::vector<std::pair<int64_t, int64_t>> rows; // id, thumbnail offset
+    {
+        SQLite::Statement select(db, "SELECT id, thumbOffset FROM images WHERE thumbOffset IS NOT NULL ORDER BY id");
+        while (select.executeStep())
+        {
+            rows.emplace_back(select.getColumn(0).getInt64(), select.getColumn(1).getInt64());
+        }
+    }
+
+    if (threads <= 0)
+    {
+        threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const HashParams params = imageHashParams();
+    SQLite::Statement update(db, "UPDATE images SET dctHash = ?, mhHash = ?, bmbHash = ?, digest = ?, dctCoeffs = ? "
+                                 "WHERE id = ?");
+
+    // Hash a batch on all threads, then write it in one transaction.
+    const size_t batchSize = 1000;
+    std::vector<ImageEntry> entries(batchSize);
+    std::vector<char> hashed(batchSize);
+    size_t failed = 0;
+    for (size_t first = 0; first < rows.size(); first += batchSize)
+    {
+        const size_t count = std::min(batchSize, rows.size() - first);
+        std::atomic<size_t> next(0);
+        auto work = [&] {
+            for (size_t i = next++; i < count; i = next++)
+            {
+                entries[i] = ImageEntry();
+                hashed[i] = 0;
+                const uint8_t *pixels;
+                int width;
+                int height;
+                LumaImage luma;
+                if (!thumbnails.read(rows[first + i].second, pixels, width, height) ||
+                    ph_luma_pixels(pixels, width, height, luma) < 0)
+                {
+                    continue;
+                }
+                ImageHashes hashes;
+                hashed[i] = _ph_image_hashes(luma, PH_HASH_ALL & ~PH_HASH_THUMBNAIL, hashes, &params) == 0;
+                store_hashes(hashes, entries[i]);
+                ph_free_image_hashes(hashes);
+                ph_luma_free(luma);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int t = 1; t < threads; ++t)
+        {
+            workers.emplace_back(work);
+        }
+        work();
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+
+        db.exec("BEGIN");
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!hashed[i])
+            {
+                ++failed;
+                continue;
+            }
+            update.reset();
+            bindHashes(update, 1, entries[i]);
+            update.bind(6, static_cast<long long>(rows[first + i].first));
+            update.exec();
+        }
+        db.exec("COMMIT");
+        if (verbose)
+        {
+            std::clog << first + count << " of " << rows.size() << " images rehashed" << std::endl;
+        }
+    }
+
+    const auto seconds =
+        std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Rehashed " << rows.size() - failed << " images in " << seconds << " s";
+    if (failed > 0)
+    {
+        std::cout << ", " << failed << " thumbnails unreadable";
+    }
+    std::cout << "." << std::endl;
+    return failed > 0 ? 1 : 0;
+}
+
+/**
+ * Loads the image table into memory and answers queries on a Unix socket.
+ */
+int serve(const std::string &database, const std::string &socketPath, int threads, const LshParams &lsh, bool verbose)
+{
+    auto connection = openDatabase(database, DatabaseMode::Query);
+    if (!connection->tableExists("images"))
+    {
+        std::cerr << database << " contains no images, run a scan first." << std::endl;
+        return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    // The hashes of other orientations only serve clustering; queries bring their own.
+    const ImageIndex index(*connection, PH_HASH_ALL & ~PH_HASH_DCT_COEFFS, lsh);
+    connection.reset();
+    const auto millis =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::clog << "Loaded " << index.size() << " images in " << millis << " ms" << std::endl;
+
+    if (verbose)
+    {
+        for (HashKind kind : {HashKind::Mh, HashKind::Bmb})
+        {
+            if (!index.hasLsh(kind))
+            {
+                continue;
+            }
+            const LshBenchmark benchmark = index.measureLsh(kind, 200, 10);
+            std::clog << (kind == HashKind::Mh ? "mh" : "bmb") << " LSH: recall@10 " << benchmark.recall << ", "
+                      << benchmark.lshMicros << " us per query against " << benchmark.scanMicros << " us for a scan"
+                      << std::endl;
+        }
+    }
+
+    return serveQueries(index, socketPath, threads, verbose);
+}
+
+/**
+ * Prints the k stored images whose hash of the given kind is closest to the one of file. With cascade, a
+ * loose shortlist by that hash is reranked by radial digest correlation instead. With orientations, the
+ * DCT hashes of the 8 flips and rotations of file are derived from its coefficients and searched together.
+ *
+ * A server running on socketPath answers from memory; without one, the needed columns are loaded from
+ * the database and searched.
+ */
+int queryImage(const std::string &database, const std::string &socketPath, const std::string &file, int k,
+               HashKind kind, bool cascade, bool orientations, bool verbose)
+{
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&start] {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto toHex = [](const uint8_t *bytes, int length) {
+        std::stringstream hex;
+        hex << std::hex << std::setfill('0');
+        for (int i = 0; i < length; ++i)
+        {
+            hex << std::setw(2) << static_cast<int>(bytes[i]);
+        }
+        return hex.str();
+    };
+
+    const int which = hashKindBit(kind) | (cascade ? PH_HASH_DIGEST : 0) | (orientations ? PH_HASH_DCT_COEFFS : 0);
+    ImageHashes hashes;
+    const HashParams params = imageHashParams();
+    if (ph_image_hashes(file.c_str(), which, hashes, &params) < 0 || (hashes.which & which) != which)
+    {
+        std::cerr << "Could not hash " << file << std::endl;
+        ph_free_image_hashes(hashes);
+        return 1;
+    }
+    std::vector<uint8_t> hash;
+    std::string hex;
+    int count = 1;
+    if (orientations)
+    {
+        ulong64 variants[8];
+        ph_dct_dihedral_hashes(hashes.dct_coeffs, variants);
+        hash.resize(sizeof(variants));
+        memcpy(hash.data(), variants, sizeof(variants));
+        count = 8;
+        std::stringstream numbers;
+        numbers << std::hex << variants[0];
+        for (int i = 1; i < count; ++i)
+        {
+            numbers << ',' << variants[i];
+        }
+        hex = numbers.str();
+    }
+    else if (kind == HashKind::Dct)
+    {
+        hash.resize(sizeof(hashes.dct));
+        memcpy(hash.data(), &hashes.dct, sizeof(hashes.dct));
+        std::stringstream number;
+        number << std::hex << hashes.dct;
+        hex = number.str();
+    }
+    else
+    {
+        const uint8_t *bytes = kind == HashKind::Mh ? hashes.mh : hashes.bmb->hash;
+        const int length = kind == HashKind::Mh ? hashes.mh_length : hashes.bmb->bytelength;
+        hash.assign(bytes, bytes + length);
+        hex = toHex(bytes, length);
+    }
+    std::vector<uint8_t> digest;
+    if (cascade)
+    {
+        digest.assign(hashes.digest.coeffs, hashes.digest.coeffs + hashes.digest.size);
+    }
+    ph_free_image_hashes(hashes);
+
+    static const char *const kindNames[] = {"dct", "mh", "bmb"};
+    const std::string request = (cascade ? "cascade " : "nearest ") + std::string(kindNames[static_cast<int>(kind)]) +
+                                " " + hex + (cascade ? " " + toHex(digest.data(), static_cast<int>(digest.size())) : "") +
+                                " " + std::to_string(k);
+
+    std::string header;
+    std::vector<std::string> lines;
+    if (requestServer(socketPath, request, header, lines))
+    {
+        if (header.compare(0, 3, "ok ") != 0)
+        {
+            std::cerr << header << std::endl;
+            return 1;
+        }
+        // The header announces the number of result lines that follow.
+        size_t announced = 0;
+        std::istringstream(header.substr(3)) >> announced;
+        if (announced != lines.size())
+        {
+            std::cerr << "The server announced " << announced << " results but sent " << lines.size() << "."
+                      << std::endl;
+            return 1;
+        }
+        for (const std::string &line : lines)
+        {
+            std::cout << line << std::endl;
+        }
+        if (verbose)
+        {
+            std::clog << "Answered by the server on " << socketPath << " in " << elapsed() << " ms" << std::endl;
+        }
+        return 0;
+    }
+
+    auto connection = openDatabase(database, DatabaseMode::Query);
+    if (!connection->tableExists("images"))
+    {
+        std::cerr << database << " contains no images, run a scan first." << std::endl;
+        return 1;
+    }
+    const ImageIndex index(*connection, which);
+    if (index.hashLength(kind) * count != hash.size() ||
+        (cascade && index.digestSize() != static_cast<int>(digest.size())))
+    {
+        std::cerr << "The database contains no comparable " << (cascade ? "digests or " : "")
+                  << kindNames[static_cast<int>(kind)] << " hashes." << std::endl;
+        return 1;
+    }
+    if (cascade)
+    {
+        for (const CascadeMatch &match : index.findCascade(kind, hash.data(), digest.data(), static_cast<size_t>(k)))
+        {
+            std::cout << std::fixed << std::setprecision(4) << match.correlation << ' ' << match.distance << ' '
+                      << index.filename(match.image) << std::endl;
+        }
+    }
+    else
+    {
+        for (const ImageMatch &match : index.findNearestAny(kind, hash.data(), count, static_cast<size_t>(k)))
+        {
+            std::cout << match.distance << ' ' << index.filename(match.image) << std::endl;
+        }
+    }
+    if (verbose)
+    {
+        std::clog << "Searched " << index.size() << " images in " << elapsed() << " ms" << std::endl;
+    }
+    return 0;
+}
+
+/**
+ * Prints every group of near-duplicate images: images whose DCT hashes are within radius bits of another
+ * image of the group, in any orientation with orientations. Groups are separated by an empty line, largest
+ * first.
+ */
+int clusterImages(const std::string &database, int radius, int threads, bool orientations, bool verbose)
+{
+    if (radius < 0 || radius > ImageIndex::maxClusterRadius)
+    {
+        std::cerr << "--distance must be between 0 and " << ImageIndex::maxClusterRadius << "." << std::endl;
+        return 1;
+    }
+
+    auto connection = openDatabase(database, DatabaseMode::Query);
+    if (!connection->tableExists("images"))
+    {
+        std::cerr << database << " contains no images, run a scan first." << std::endl;
+        return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const ImageIndex index(*connection, orientations ? PH_HASH_DCT_COEFFS : PH_HASH_DCT);
+    connection.reset();
+    if (orientations && !index.hasDctOrientations())
+    {
+        std::cerr << database << " contains no DCT coefficients, rescan it to match other orientations." << std::endl;
+        return 1;
+    }
+    const auto loaded = std::chrono::steady_clock::now();
+    const auto groups = index.clusterDct(radius, threads, orientations);
+    const auto clustered = std::chrono::steady_clock::now();
+
+    size_t grouped = 0;
+    for (size_t g = 0; g < groups.size(); ++g)
+    {
+        if (g > 0)
+        {
+            std::cout << '\n';
+        }
+        for (uint32_t image : groups[g])
+        {
+            std::cout << index.filename(image) << '\n';
+        }
+        grouped += groups[g].size();
+    }
+    std::cout << std::flush;
+
+    if (verbose)
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::milliseconds;
+        std::clog << groups.size() << " groups of " << grouped << " images out of " << index.size() << "; loaded in "
+                  << duration_cast<milliseconds>(loaded - start).count() << " ms, clustered in "
+                  << duration_cast<milliseconds>(clustered - loaded).count() << " ms" << std::endl;
+    }
+    return 0;
+}
+
+/**
+ * Reports for each incoming image whether the library already has it, one tab separated line of status,
+ * distance, incoming file and stored file:
+ *
+ *   exact    a stored file has the same content
+ *   similar  a stored DCT hash is within radius bits (of one of the 8 orientations with orientations)
+ *   new      neither
+ *   error    the file could not be read or decoded
+ *
+ * Only the file hashes and DCT hashes of the library are loaded. Files are hashed on up to threads
+ * threads and reported in input order as soon as their turn comes. "-" reads standard input: either an
+ * image piped in as is, or file paths one per line, checked as they arrive.
+ */
+int checkImages(const std::string &database, const std::vector<std::string> &files, int radius, bool orientations,
+                int threads, bool verbose)
+{
+    auto connection = openDatabase(database, DatabaseMode::Query);
+    if (!connection->tableExists("images"))
+    {
+        std::cerr << database << " contains no images, run a scan first." << std::endl;
+        return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const ImageIndex index(*connection, PH_HASH_DCT);
+    connection.reset();
+    const auto loaded = std::chrono::steady_clock::now();
+
+    const int which = PH_HASH_DCT | (orientations ? PH_HASH_DCT_COEFFS : 0);
+    if (threads <= 0)
+    {
+        threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    enum Status
+    {
+        New,
+        Exact,
+        Similar,
+        Error
+    };
+    static const char *const statusNames[] = {"new", "exact", "similar", "error"};
+    size_t counts[4] = {0, 0, 0, 0};
+
+    auto report = [&](const std::string &file, const ImageEntry &image) {
+        Status status = New;
+        int distance = -1;
+        std::string stored;
+        const std::vector<uint32_t> same = image.md5Hash.empty() ? std::vector<uint32_t>()
+                                                                 : index.findFileHash(image.md5Hash);
+        if (!same.empty())
+        {
+            status = Exact;
+            distance = 0;
+            stored = index.filename(same.front());
+        }
+        else if ((image.perceptualHashes & which) != which)
+        {
+            status = Error;
+        }
+        else
+        {
+            std::vector<ImageMatch> matches;
+            if (orientations)
+            {
+                float coeffs[64];
+                memcpy(coeffs, image.dctCoeffs.data(), sizeof(coeffs));
+                ulong64 variants[8];
+                ph_dct_dihedral_hashes(coeffs, variants);
+                matches = index.findWithinAny(HashKind::Dct, reinterpret_cast<const uint8_t *>(variants), 8, radius);
+            }
+            else
+            {
+                const uint64_t hash = image.dctHash;
+                matches = index.findWithin(HashKind::Dct, reinterpret_cast<const uint8_t *>(&hash), radius);
+            }
+            if (!matches.empty())
+            {
+                status = Similar;
+                distance = matches.front().distance;
+                stored = index.filename(matches.front().image);
+            }
+        }
+        ++counts[status];
+        std::cout << statusNames[status] << '\t' << (distance < 0 ? "-" : std::to_string(distance)) << '\t' << file
+                  << '\t' << stored << std::endl;
+    };
+
+    // Files being hashed, oldest first. A few more than threads are in flight so that one slow file
+    // does not leave the other threads idle.
+    std::deque<std::pair<std::string, std::future<ImageEntry>>> pending;
+    auto reportOldest = [&] {
+        ImageEntry image;
+        try
+        {
+            image = pending.front().second.get();
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << pending.front().first << ": " << e.what() << std::endl;
+        }
+        report(pending.front().first, image);
+        pending.pop_front();
+    };
+    auto submit = [&](const std::string &file, std::future<ImageEntry> hashing) {
+        while (pending.size() >= 2 * static_cast<size_t>(threads))
+        {
+            reportOldest();
+        }
+        pending.emplace_back(file, std::move(hashing));
+    };
+    auto checkFile = [&](const std::string &file) {
+        submit(file, std::async(std::launch::async, compute_image_hash, boost::filesystem::path(file), false, which));
+    };
+
+    for (const std::string &file : files)
+    {
+        if (file != "-")
+        {
+            checkFile(file);
+            continue;
+        }
+
+        // A JPEG starts with 0xFF; anything else is taken for a list of paths.
+        if (std::cin.peek() == 0xFF)
+        {
+            std::vector<uint8_t> buffer((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+            submit(file, std::async(std::launch::async, [buffer = std::move(buffer), which] {
+                       return hash_image_buffer(buffer, "-", std::time(nullptr), which);
+                   }));
+            continue;
+        }
+        std::string line;
+        while (std::getline(std::cin, line))
+        {
+            if (!line.empty())
+            {
+                checkFile(line);
+            }
+            // Before waiting for more paths, finish the ones given so far. Paths already read into the
+            // stream buffer do not show in poll(), so both must be empty.
+            pollfd input = {STDIN_FILENO, POLLIN, 0};
+            if (std::cin.rdbuf()->in_avail() <= 0 && poll(&input, 1, 0) == 0)
+            {
+                while (!pending.empty())
+                {
+                    reportOldest();
+                }
+            }
+        }
+    }
+    while (!pending.empty())
+    {
+        reportOldest();
+    }
+
+    if (verbose)
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::milliseconds;
+        const auto checked = std::chrono::steady_clock::now();
+        const size_t total = counts[New] + counts[Exact] + counts[Similar] + counts[Error];
+        const auto millis = duration_cast<milliseconds>(checked - loaded).count();
+        std::clog << total << " files: " << counts[New] << " new, " << counts[Exact] << " exact, " << counts[Similar]
+                  << " similar, " << counts[Error] << " errors; index of " << index.size() << " images loaded in "
+                  << duration_cast<milliseconds>(loaded - start).count() << " ms, checked in " << millis << " ms"
+                  << std::endl;
+    }
+    return counts[Error] > 0 ? 1 : 0;
 }
 
 int main(int argc, char *argv[])
 {
+    // Nothing uses stdio, and an unsynchronised std::cin buffers its input and reports it in in_avail().
+    std::ios::sync_with_stdio(false);
+
+    // "imgcmp serve [options]" runs the query server; the remaining arguments are parsed as usual.
+    const bool serving = argc > 1 && std::string(argv[1]) == "serve";
+    if (serving)
+    {
+        argv[1] = argv[0];
+        --argc;
+        ++argv;
+    }
+
     cli::Parser parser(argc, argv);
 
     const char *user = std::getenv("USER");
@@ -275,11 +1240,93 @@ int main(int argc, char *argv[])
     bool verbose = false;
 
     parser.set_optional<std::string>("f", "filename", "imgdb.sqlite", "Database filename");
-    parser.set_callback<bool>("r", "rescan", [&rescan](cli::CallbackArgs &args) -> bool { rescan = true; }, "Rescan whole image folder and recreate database");
-    parser.set_callback<bool>("v", "verbose", [&verbose](cli::CallbackArgs &args) -> bool { verbose = true; }, "Print log messages");
+    parser.set_callback<bool>("r", "rescan", [&rescan](cli::CallbackArgs &args) -> bool { rescan = true; return true; }, "Rescan whole image folder and recreate database");
+    parser.set_callback<bool>("v", "verbose", [&verbose](cli::CallbackArgs &args) -> bool { verbose = true; return true; }, "Print log messages");
     parser.set_optional<std::string>("i", "input", imageFolder.string(), "Image folder.");
+    parser.set_optional<std::string>("s", "socket", "imgdb.sock", "Unix socket of the query server (serve)");
+    parser.set_optional<int>("t", "threads", 0, "Threads of the query server, clustering and hashing, 0 for one per core");
+    parser.set_optional<std::string>("q", "query", "", "Image to find similar images of");
+    parser.set_optional<int>("k", "k", 10, "Number of similar images listed (query)");
+    parser.set_optional<std::string>("m", "method", "dct", "Hash compared: dct, mh, bmb, or cascade for DCT then radial digest (query)");
+    parser.set_optional<std::string>("l", "lsh", "", "LSH for MH and BMB hashes as tables,bits,probes, e.g. 16,16,1 (serve)");
+    parser.set_optional<bool>("c", "cluster", false, "List all groups of near-duplicate images");
+    parser.set_optional<int>("d", "distance", 8, "Largest DCT hash distance of near-duplicates (cluster, check)");
+    parser.set_optional<bool>("o", "orientations", false, "Also match flipped and rotated images (dct query, cluster, check)");
+    parser.set_optional<bool>("R", "rehash", false, "Recompute all hashes from the stored thumbnails");
+    parser.set_optional<std::vector<std::string>>("x", "check", {}, "Report which images are already in the library, - reads paths or an image from stdin");
+    parser.set_optional<std::string>("b", "background", "", "Scan in the background, reading at most <bytes/s>[K|M|G],<files/s>; 0 is unlimited");
+    parser.set_optional<std::string>("L", "limits", "", "File with the background limits, read again when it changes");
 
     parser.run_and_exit_if_error();
 
-    updateDB(rescan, verbose, imageFolder);
+    const std::string database = parser.get<std::string>("f");
+    if (serving)
+    {
+        LshParams lsh;
+        const std::string lshText = parser.get<std::string>("l");
+        if (!lshText.empty() && !parseLshParams(lshText, lsh))
+        {
+            std::cerr << "--lsh must be <tables>,<bits>,<probes>." << std::endl;
+            return 1;
+        }
+        return serve(database, parser.get<std::string>("s"), parser.get<int>("t"), lsh, verbose);
+    }
+
+    const std::string queryFile = parser.get<std::string>("q");
+    if (!queryFile.empty())
+    {
+        const std::string method = parser.get<std::string>("m");
+        const bool cascade = method == "cascade";
+        HashKind kind = HashKind::Dct;
+        const bool orientations = parser.get<bool>("o");
+        if ((!cascade && !parseHashKind(method, kind)) || parser.get<int>("k") <= 0)
+        {
+            std::cerr << "--method must be dct, mh, bmb or cascade and --k positive." << std::endl;
+            return 1;
+        }
+        if (orientations && (cascade || kind != HashKind::Dct))
+        {
+            std::cerr << "--orientations needs --method dct." << std::endl;
+            return 1;
+        }
+        return queryImage(database, parser.get<std::string>("s"), queryFile, parser.get<int>("k"), kind, cascade,
+                          orientations, verbose);
+    }
+
+    if (parser.get<bool>("R"))
+    {
+        return rehash(database, parser.get<int>("t"), verbose);
+    }
+
+    const std::vector<std::string> checkFiles = parser.get<std::vector<std::string>>("x");
+    if (!checkFiles.empty())
+    {
+        if (parser.get<int>("d") < 0)
+        {
+            std::cerr << "--distance must not be negative." << std::endl;
+            return 1;
+        }
+        return checkImages(database, checkFiles, parser.get<int>("d"), parser.get<bool>("o"), parser.get<int>("t"),
+                           verbose);
+    }
+
+    if (parser.get<bool>("c"))
+    {
+        return clusterImages(database, parser.get<int>("d"), parser.get<int>("t"), parser.get<bool>("o"), verbose);
+    }
+
+    std::unique_ptr<Throttle> throttle;
+    const std::string background = parser.get<std::string>("b");
+    const std::string limitsFile = parser.get<std::string>("L");
+    if (!background.empty() || !limitsFile.empty())
+    {
+        ScanLimits limits;
+        if (!background.empty() && !parseScanLimits(background, limits))
+        {
+            std::cerr << "--background must be <bytes/s>,<files/s>, e.g. 20M,50." << std::endl;
+            return 1;
+        }
+        throttle = std::make_unique<Throttle>(limits, limitsFile, verbose);
+    }
+    updateDB(rescan, verbose, path(parser.get<std::string>("i")), database, parser.get<int>("t"), throttle.get());
 }
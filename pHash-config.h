@@ -0,0 +1,12 @@
+/* pHash configuration used by imgcmp */
+
+#ifndef _PHASH_CONFIG_H
+#define _PHASH_CONFIG_H
+
+#define HAVE_IMAGE_HASH 1
+#define HAVE_PTHREAD 1
+
+/* decode JPEG files and buffers through libjpeg */
+#define cimg_use_jpeg 1
+
+#endif
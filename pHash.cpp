@@ -23,9 +23,11 @@ D Grant Starkweather - dstarkweather@phash.org
 */
 
 #include "pHash.h"
-#ifndef _WIN32
-#include "config.h"
-#else
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#ifdef _WIN32
 #define snprintf _snprintf
 #endif
 #ifdef HAVE_VIDEO_HASH
@@ -63,6 +65,164 @@ int ph_num_threads()
 #endif
     return numCPU;
 }
+
+/* one deque of task indices per worker; the owner takes from the head,
+ * thieves take from the tail
+ */
+typedef struct ph_task_deque {
+    int *items;
+    int head;
+    int tail;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+typedef struct ph_task_pool {
+    TaskDeque *deques;
+    int nb_deques;
+    ph_task_func func;
+    void *arg;
+} TaskPool;
+
+typedef struct ph_task_worker {
+    TaskPool *pool;
+    int id;
+} TaskWorker;
+
+static int _ph_deque_pop(TaskDeque *dq, int from_tail){
+    int index = -1;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail){
+        index = from_tail ? dq->items[--dq->tail] : dq->items[dq->head++];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return index;
+}
+
+static void *_ph_task_worker(void *p){
+    TaskWorker *worker = (TaskWorker*)p;
+    TaskPool *pool = worker->pool;
+    for (;;){
+        int index = _ph_deque_pop(&pool->deques[worker->id],0);
+        /* nothing left locally: steal. No task is ever added, so a full
+         * round over empty deques means all work has been taken. */
+        for (int i=1;(index < 0) && (i < pool->nb_deques);i++){
+            index = _ph_deque_pop(&pool->deques[(worker->id + i) % pool->nb_deques],1);
+        }
+        if (index < 0)
+            break;
+        pool->func(index,pool->arg);
+    }
+    return NULL;
+}
+
+static int _ph_thread_count(int threads, int count){
+    int num_threads = (threads > 0) ? threads : ph_num_threads();
+    if (num_threads > count)
+        num_threads = count;
+    return (num_threads < 1) ? 1 : num_threads;
+}
+
+int ph_run_tasks(int count, const double *costs, int threads, ph_task_func func, void *arg){
+    if (count <= 0 || !func)
+        return -1;
+
+    int num_threads = _ph_thread_count(threads,count);
+
+    int *order = (int*)malloc(count*sizeof(int));
+    if (!order)
+        return -1;
+    for (int i = 0; i < count; ++i)
+        order[i] = i;
+    if (costs){
+        std::stable_sort(order,order+count,[costs](int a, int b){ return costs[a] > costs[b]; });
+    }
+
+    /* deal the sorted tasks round robin so every deque starts with its largest */
+    TaskPool pool;
+    pool.deques = new TaskDeque[num_threads];
+    pool.nb_deques = num_threads;
+    pool.func = func;
+    pool.arg = arg;
+    int per_deque = (count + num_threads - 1)/num_threads;
+    int *items = (int*)malloc((size_t)per_deque*num_threads*sizeof(int));
+    if (!items){
+        delete[] pool.deques;
+        free(order);
+        return -1;
+    }
+    for (int n = 0; n < num_threads; ++n){
+        pool.deques[n].items = items + n*per_deque;
+        pool.deques[n].head = 0;
+        pool.deques[n].tail = 0;
+        pthread_mutex_init(&pool.deques[n].lock,NULL);
+    }
+    for (int i = 0; i < count; ++i){
+        TaskDeque *dq = &pool.deques[i % num_threads];
+        dq->items[dq->tail++] = order[i];
+    }
+    free(order);
+
+    pthread_t *thds = new pthread_t[num_threads];
+    TaskWorker *workers = new TaskWorker[num_threads];
+    int started = 0;
+    for (int n = 0; n < num_threads; ++n){
+        workers[n].pool = &pool;
+        workers[n].id = n;
+        if (pthread_create(&thds[n],NULL,_ph_task_worker,&workers[n]) != 0)
+            break;
+        started++;
+    }
+    /* if threads could not be created the remaining deques get stolen
+     * by the running workers, or run here when none started */
+    if (started == 0){
+        _ph_task_worker(&workers[0]);
+    }
+    for (int i = 0; i < started; ++i){
+        pthread_join(thds[i],NULL);
+    }
+
+    for (int n = 0; n < num_threads; ++n)
+        pthread_mutex_destroy(&pool.deques[n].lock);
+    delete[] workers;
+    delete[] thds;
+    delete[] pool.deques;
+    free(items);
+    return 0;
+}
+
+/* batch of hashes shared by the batch hash tasks */
+typedef struct ph_hash_batch {
+    DP **hashes;
+    ph_hash_callback callback;
+    void *cookie;
+} HashBatch;
+
+/* alloc the DP list of a batch and the file size of each entry as its cost;
+ * NULL, with nothing left allocated, if memory runs out
+ */
+static DP** _ph_batch_datapoints(char *files[], int count, double *costs){
+    DP **hashes = (DP**)malloc(count*sizeof(DP*));
+    if (!hashes)
+        return NULL;
+    for(int i = 0; i < count; ++i)
+    {
+        hashes[i] = (DP *)calloc(1,sizeof(DP));
+        if (hashes[i])
+            hashes[i]->id = strdup(files[i]);
+        if (!hashes[i] || !hashes[i]->id){
+            free(hashes[i]);
+            for (int j=0;j<i;j++){
+                free(hashes[j]->id);
+                free(hashes[j]);
+            }
+            free(hashes);
+            return NULL;
+        }
+        struct stat fileinfo;
+        costs[i] = (stat(files[i],&fileinfo) == 0) ? (double)fileinfo.st_size : 0.0;
+    }
+    return hashes;
+}
 #endif
 
 const char phash_project[] = "%s. Copyright 2008-2010 Aetilius, Inc.";
@@ -303,14 +463,21 @@ cleanup:
 
 int ph_image_digest(const char *file, double sigma, double gamma, Digest &digest, int N){
 
-    CImg<uint8_t> *src = new CImg<uint8_t>(file);
-    int res = -1;
-    if(src)
-    {
-        int result = _ph_image_digest(*src,sigma,gamma,digest,N);
-        delete src;
-        res = result;
-    }
+    LumaImage luma;
+    if (ph_luma_load(file,luma) < 0)
+        return -1;
+    int res = _ph_image_digest(*luma.luma,sigma,gamma,digest,N);
+    ph_luma_free(luma);
+    return res;
+}
+
+int ph_image_digest_buffer(const uint8_t *buffer, size_t length, double sigma, double gamma, Digest &digest, int N){
+
+    LumaImage luma;
+    if (ph_luma_load_buffer(buffer,length,luma) < 0)
+        return -1;
+    int res = _ph_image_digest(*luma.luma,sigma,gamma,digest,N);
+    ph_luma_free(luma);
     return res;
 }
 
@@ -360,6 +527,157 @@ CImg<float>* ph_dct_matrix(const int N){
     }
     return ptr_matrix;
 }
+/* convert img in place to its luma channel; channels beyond the third (alpha, CMYK's K) are dropped */
+static void _ph_to_luma(CImg<uint8_t> &img){
+    if (img.spectrum() > 3){
+        img.crop(0,0,0,0,img.width()-1,img.height()-1,img.depth()-1,2);
+    }
+    if (img.spectrum() == 3){
+        img.RGBtoYCbCr().channel(0);
+    } else if (img.spectrum() > 1){
+        img.channel(0);
+    }
+}
+
+static void _ph_luma_init(LumaImage &luma){
+    luma.luma = NULL;
+    luma.dct32 = NULL;
+    luma.mh512 = NULL;
+    luma.bmb256 = NULL;
+}
+
+int ph_luma_image(const CImg<uint8_t> &img, LumaImage &luma){
+    _ph_luma_init(luma);
+    if (img.is_empty())
+        return -1;
+    luma.luma = new CImg<uint8_t>(img);
+    _ph_to_luma(*luma.luma);
+    return 0;
+}
+
+int ph_luma_load(const char *file, LumaImage &luma){
+    _ph_luma_init(luma);
+    if (!file)
+        return -1;
+    CImg<uint8_t> *src = new CImg<uint8_t>();
+    try {
+        src->load(file);
+    } catch (CImgIOException ex){
+        delete src;
+        return -1;
+    }
+    _ph_to_luma(*src);
+    luma.luma = src;
+    return 0;
+}
+
+int ph_luma_load_buffer(const uint8_t *buffer, size_t length, LumaImage &luma){
+    _ph_luma_init(luma);
+    if (!buffer || length == 0)
+        return -1;
+#ifdef cimg_use_jpeg
+    CImg<uint8_t> *src = new CImg<uint8_t>();
+    try {
+        src->load_jpeg_buffer(buffer,(unsigned)length);
+    } catch (CImgIOException ex){
+        delete src;
+        return -1;
+    }
+    _ph_to_luma(*src);
+    luma.luma = src;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int ph_luma_pixels(const uint8_t *pixels, int width, int height, LumaImage &luma){
+    _ph_luma_init(luma);
+    if (!pixels || width <= 0 || height <= 0)
+        return -1;
+    luma.luma = new CImg<uint8_t>(pixels,width,height,1,1);
+    return 0;
+}
+
+int ph_luma_thumbnail(LumaImage &luma, int size){
+    if (!luma.luma || size <= 0)
+        return -1;
+    int width = luma.luma->width();
+    int height = luma.luma->height();
+    if (width <= size && height <= size)
+        return 0;
+    int longer = (width > height) ? width : height;
+    int w = (int)((double)width*size/longer + 0.5);
+    int h = (int)((double)height*size/longer + 0.5);
+    luma.luma->resize((w > 0) ? w : 1,(h > 0) ? h : 1,1,1,2);
+
+    /* the scaled variants were made from the full image */
+    CImg<uint8_t> *reduced = luma.luma;
+    luma.luma = NULL;
+    ph_luma_free(luma);
+    luma.luma = reduced;
+    return 0;
+}
+
+void ph_luma_free(LumaImage &luma){
+    delete luma.luma;
+    delete luma.dct32;
+    delete luma.mh512;
+    delete luma.bmb256;
+    _ph_luma_init(luma);
+}
+
+/* 7x7 mean filtered luma scaled to 32x32, input of the dct hash */
+static const CImg<float>* _ph_luma_dct32(LumaImage &luma){
+    if (!luma.dct32){
+        CImg<float> meanfilter(7,7,1,1,1);
+        luma.dct32 = new CImg<float>(luma.luma->get_convolve(meanfilter));
+        luma.dct32->resize(32,32);
+    }
+    return luma.dct32;
+}
+
+/* blurred, equalized luma scaled to 512x512, input of the mh hash */
+static const CImg<uint8_t>* _ph_luma_mh512(LumaImage &luma){
+    if (!luma.mh512){
+        luma.mh512 = new CImg<uint8_t>(luma.luma->get_blur(1.0).resize(512,512,1,1,5).get_equalize(256));
+    }
+    return luma.mh512;
+}
+
+/* luma scaled to 256x256, input of the bmb hash */
+static const CImg<uint8_t>* _ph_luma_bmb256(LumaImage &luma){
+    if (!luma.bmb256){
+        luma.bmb256 = new CImg<uint8_t>(luma.luma->get_resize(256,256));
+    }
+    return luma.bmb256;
+}
+
+/* summed area table of img: sat(x,y) is the sum of img over [0,x)x[0,y),
+ * so sat has one extra zero row and column.
+ */
+template<typename T>
+static void _ph_integral_image(const CImg<T> &img, CImg<double> &sat){
+    const int width = img.width();
+    const int height = img.height();
+    sat.assign(width+1,height+1,1,1,0);
+    for (int y=0;y<height;y++){
+        const T *row = img.data(0,y);
+        const double *above = sat.data(0,y);
+        double *cur = sat.data(0,y+1);
+        double line_sum = 0.0;
+        for (int x=0;x<width;x++){
+            line_sum += row[x];
+            cur[x+1] = above[x+1] + line_sum;
+        }
+    }
+}
+
+/* sum of the w x h block at (x,y), in O(1) from a summed area table */
+static inline double _ph_block_sum(const CImg<double> &sat, int x, int y, int w, int h){
+    return sat(x+w,y+h) - sat(x,y+h) - sat(x+w,y) + sat(x,y);
+}
+
 BinHash* _ph_bmb_new(uint32_t bytelength)
 {
     BinHash* bh = (BinHash*)malloc(sizeof(BinHash));
@@ -378,11 +696,9 @@ void ph_bmb_free(BinHash *bh)
         free(bh);
     }
 }
-int ph_bmb_imagehash(const char *file, uint8_t method, BinHash **ret_hash)
+int _ph_bmb_imagehash(LumaImage &luma, uint8_t method, BinHash **ret_hash)
 {
-    CImg<uint8_t> img;
-    const uint8_t *ptrsrc;  // source pointer (img)
-    uint8_t *block;
+    CImg<double> sat;
     int pcol;  // "pointer" to pixel col (x)
     int prow;  // "pointer" to pixel row (y)
     int blockidx = 0;  //current idx of block begin processed.
@@ -399,35 +715,14 @@ int ph_bmb_imagehash(const char *file, uint8_t method, BinHash **ret_hash)
     // number of bytes needed to store bitsize bits.
     uint32_t bytesize;
 
-    if (!file || !ret_hash){
-        return -1;
-    }
-    try {
-        img.load(file);
-    } catch (CImgIOException ex){
+    if (!luma.luma || !ret_hash){
         return -1;
     }
 
     const int blk_size = blk_size_x * blk_size_y;
-    block = (uint8_t*)malloc(sizeof(uint8_t) * blk_size);
-
-    if(!block)
-        return -1;
-
-    switch (img.spectrum()) {
-    case 3: // from RGB
-        img.RGBtoYCbCr().channel(0);
-        break;
-    default:
-        *ret_hash = NULL;
-        free(block);
-        return -1;
-    }
-
-    img.resize(preset_size_x, preset_size_y);
 
     // ~step b
-    ptrsrc = img.data();  // set pointer to beginning of pixel buffer
+    _ph_integral_image(*_ph_luma_bmb256(luma), sat);
 
     if(method == 2) 
     {
@@ -449,14 +744,12 @@ int ph_bmb_imagehash(const char *file, uint8_t method, BinHash **ret_hash)
     double *mean_vals = new double[number_of_blocks];
 
     /*
-    * pixel row < block < block row < image
+    * block < block row < image
     * 
-    * The pixel rows of a block are copied consecutively
-    * into the block buffer (using memcpy). When a block is
-    * finished, the next block in the block row is processed.
-    * After finishing a block row, the processing of the next
-    * block row is started. An image consists of an arbitrary
-    * number of block rows.
+    * Block means are read from the summed area table, so
+    * the overlapping blocks of method 2 cost the same as
+    * the disjoint ones. After finishing a block row, the
+    * processing of the next block row is started.
     */
 
     /* image (multiple rows of blocks) */
@@ -466,24 +759,8 @@ int ph_bmb_imagehash(const char *file, uint8_t method, BinHash **ret_hash)
         /* block row */
         for(pcol = 0;pcol<=preset_size_x-blk_size_x;pcol += pixcolstep)
         {
-
-            // idx for array holding one block.
-            int blockpos = 0;
-
-            /* block */
-
-            // i is used to address the different 
-            // pixel rows of a block
-            for(int i=0 ; i < blk_size_y; i++)
-            {
-                ptrsrc = img.data(pcol, prow + i);
-                memcpy(block + blockpos, ptrsrc, blk_size_x);
-                blockpos += blk_size_x;
-            }
-
-            mean_vals[blockidx] = CImg<uint8_t>(block,blk_size).mean();
+            mean_vals[blockidx] = _ph_block_sum(sat, pcol, prow, blk_size_x, blk_size_y) / blk_size;
             blockidx++;
-
         }
     }
 
@@ -496,6 +773,7 @@ int ph_bmb_imagehash(const char *file, uint8_t method, BinHash **ret_hash)
     if(!hash)
     {
         *ret_hash = NULL;
+        delete[] mean_vals;
         return -1;
     }
 
@@ -510,50 +788,53 @@ int ph_bmb_imagehash(const char *file, uint8_t method, BinHash **ret_hash)
         }
     }	
     delete[] mean_vals;
-    free(block);
     return 0;
 }
 
-int ph_dct_imagehash(const char* file,ulong64 &hash){
-
-    if (!file){
+int ph_bmb_imagehash(const char *file, uint8_t method, BinHash **ret_hash)
+{
+    if (!file || !ret_hash){
         return -1;
     }
-    CImg<uint8_t> src;
-    try {
-        src.load(file);
-    } catch (CImgIOException ex){
+    LumaImage luma;
+    if (ph_luma_load(file,luma) < 0){
+        *ret_hash = NULL;
         return -1;
     }
-    CImg<float> meanfilter(7,7,1,1,1);
-    CImg<float> img;
-    if (src.spectrum() == 3){
-        img = src.RGBtoYCbCr().channel(0).get_convolve(meanfilter);
-    } else if (src.spectrum() == 4){
-        int width = img.width();
-        int height = img.height();
-        int depth = img.depth();
-        img = src.crop(0,0,0,0,width-1,height-1,depth-1,2).RGBtoYCbCr().channel(0).get_convolve(meanfilter);
-    } else {
-        img = src.channel(0).get_convolve(meanfilter);
+    int res = _ph_bmb_imagehash(luma,method,ret_hash);
+    ph_luma_free(luma);
+    return res;
+}
+
+int ph_bmb_imagehash_buffer(const uint8_t *buffer, size_t length, uint8_t method, BinHash **ret_hash)
+{
+    if (!buffer || !ret_hash){
+        return -1;
+    }
+    LumaImage luma;
+    if (ph_luma_load_buffer(buffer,length,luma) < 0){
+        *ret_hash = NULL;
+        return -1;
     }
+    int res = _ph_bmb_imagehash(luma,method,ret_hash);
+    ph_luma_free(luma);
+    return res;
+}
 
-    img.resize(32,32);
+int _ph_dct_coeffs(LumaImage &luma, float *coeffs){
+
+    if (!luma.luma){
+        return -1;
+    }
+    const CImg<float> &img = *_ph_luma_dct32(luma);
     CImg<float> *C  = ph_dct_matrix(32);
     CImg<float> Ctransp = C->get_transpose();
 
     CImg<float> dctImage = (*C)*img*Ctransp;
 
-    CImg<float> subsec = dctImage.crop(1,1,8,8).unroll('x');;
-
-    float median = subsec.median();
-    ulong64 one = 0x0000000000000001;
-    hash = 0x0000000000000000;
+    CImg<float> subsec = dctImage.crop(1,1,8,8).unroll('x');
     for (int i=0;i< 64;i++){
-        float current = subsec(i);
-        if (current > median)
-            hash |= one;
-        one = one << 1;
+        coeffs[i] = subsec(i);
     }
 
     delete C;
@@ -561,76 +842,332 @@ int ph_dct_imagehash(const char* file,ulong64 &hash){
     return 0;
 }
 
+int _ph_dct_imagehash(LumaImage &luma,ulong64 &hash){
+
+    float coeffs[64];
+    if (_ph_dct_coeffs(luma,coeffs) < 0){
+        return -1;
+    }
+    hash = ph_dct_coeffs_hash(coeffs);
+    return 0;
+}
+
+int ph_dct_imagehash(const char* file,ulong64 &hash){
+
+    if (!file){
+        return -1;
+    }
+    LumaImage luma;
+    if (ph_luma_load(file,luma) < 0){
+        return -1;
+    }
+    int res = _ph_dct_imagehash(luma,hash);
+    ph_luma_free(luma);
+    return res;
+}
+
+int ph_dct_imagehash_buffer(const uint8_t *buffer, size_t length, ulong64 &hash){
+
+    LumaImage luma;
+    if (ph_luma_load_buffer(buffer,length,luma) < 0){
+        return -1;
+    }
+    int res = _ph_dct_imagehash(luma,hash);
+    ph_luma_free(luma);
+    return res;
+}
+
 #ifdef HAVE_PTHREAD
-void *ph_image_thread(void *p)
+static void ph_image_task(int index, void *p)
 {
-    slice *s = (slice *)p;
-    for(int i = 0; i < s->n; ++i)
+    HashBatch *batch = (HashBatch *)p;
+    DP *dp = batch->hashes[index];
+    ulong64 hash;
+    if (ph_dct_imagehash(dp->id, hash) == 0)
     {
-        DP *dp = (DP *)s->hash_p[i];
-        ulong64 hash;
-        int ret = ph_dct_imagehash(dp->id, hash);
         dp->hash = (ulong64*)malloc(sizeof(hash));
         memcpy(dp->hash, &hash, sizeof(hash));
         dp->hash_length = 1;
     }
+    if (batch->callback)
+        batch->callback(dp, batch->cookie);
 }
 
-DP** ph_dct_image_hashes(char *files[], int count, int threads)
+DP** ph_dct_image_hashes(char *files[], int count, int threads, ph_hash_callback callback, void *cookie)
 {
     if(!files || count <= 0)
         return NULL;
 
-    int num_threads;
-    if(threads > count)
+    double *costs = (double*)malloc(count*sizeof(double));
+    if (!costs)
+        return NULL;
+    DP **hashes = _ph_batch_datapoints(files, count, costs);
+
+    if (hashes)
     {
-        num_threads = count;
+        HashBatch batch = { hashes, callback, cookie };
+        ph_run_tasks(count, costs, threads, ph_image_task, &batch);
     }
-    else if(threads > 0)
-    {
-        num_threads = threads;
+    free(costs);
+
+    return hashes;
+
+}
+#endif
+
+/* dct hash of a 32x32 luma frame, as used for video keyframes */
+static ulong64 _ph_dct_frame_hash(const CImg<uint8_t> &frame, const CImg<float> &C, const CImg<float> &Ctransp){
+    CImg<float> currentframe = frame;
+    currentframe.blur(1.0);
+    CImg<float> dctImage = C*currentframe*Ctransp;
+    CImg<float> subsec = dctImage.crop(1,1,8,8).unroll('x');
+    float med = subsec.median();
+    ulong64 hash = 0x0000000000000000;
+    ulong64 one = 0x0000000000000001;
+    for (int j=0;j<64;j++){
+        if (subsec(j) > med)
+            hash |= one;
+        one = one << 1;
     }
-    else
-    {
-        num_threads = ph_num_threads();
+    return hash;
+}
+
+void ph_frame_source_close(FrameSource *src){
+    if (src){
+        if (src->close)
+            src->close(src);
+        free(src);
     }
+}
 
-    DP **hashes = (DP**)malloc(count*sizeof(DP*));
+/* frames of an image sequence directory, in file name order */
+typedef struct ph_image_sequence {
+    char **files;
+    int count;
+    int pos;
+    int step;
+} ImageSequence;
 
-    for(int i = 0; i < count; ++i)
-    {
-        hashes[i] = (DP *)malloc(sizeof(DP));
-        hashes[i]->id = strdup(files[i]);
+static int _ph_cmp_names(const void *a, const void *b){
+    return strcmp(*(char* const*)a,*(char* const*)b);
+}
+
+static int _ph_image_sequence_next(FrameSource *src, CImg<uint8_t> &frame){
+    ImageSequence *seq = (ImageSequence*)src->state;
+    while (seq->pos < seq->count){
+        const char *file = seq->files[seq->pos];
+        seq->pos += seq->step;
+        try {
+            frame.load(file);
+            return 1;
+        } catch (CImgIOException ex){
+            /* not an image, skip it */
+        }
     }
+    return 0;
+}
 
-    pthread_t thds[num_threads];
+static void _ph_image_sequence_close(FrameSource *src){
+    ImageSequence *seq = (ImageSequence*)src->state;
+    if (seq){
+        for (int i=0;i<seq->count;i++)
+            free(seq->files[i]);
+        free(seq->files);
+        free(seq);
+    }
+}
 
-    int rem = count % num_threads;
-    int start = 0;
-    int off = 0;
-    slice *s = new slice[num_threads];
-    for(int n = 0; n < num_threads; ++n)
-    {
-        off = (int)floor((count/(float)num_threads) + (rem>0?num_threads-(count % num_threads):0));
+FrameSource* ph_image_sequence_source(const char *dirname, int step){
+    int count = 0;
+    char **files = ph_readfilenames(dirname,count);
+    if (!files)
+        return NULL;
+    qsort(files,count,sizeof(char*),_ph_cmp_names);
+
+    FrameSource *src = (FrameSource*)malloc(sizeof(FrameSource));
+    ImageSequence *seq = (ImageSequence*)malloc(sizeof(ImageSequence));
+    if (!src || !seq){
+        for (int i=0;i<count;i++)
+            free(files[i]);
+        free(files);
+        free(src);
+        free(seq);
+        return NULL;
+    }
+    seq->files = files;
+    seq->count = count;
+    seq->pos = 0;
+    seq->step = (step > 0) ? step : 1;
+    src->next_frame = _ph_image_sequence_next;
+    src->close = _ph_image_sequence_close;
+    src->state = seq;
+    return src;
+}
+
+/* Streaming form of the keyframe selection of ph_getKeyFramesFromVideo.
+ * A frame k is a shot boundary when its histogram distance is the maximum
+ * of [k-S,k+S] and above both the mean+deviation threshold of [k-L,k+L] and
+ * alpha2 times the second local maximum. Within each shot the frame with the
+ * smallest distance is the keyframe. Deciding k needs L frames of lookahead,
+ * so only the last 2L+2 distances and 32x32 frames are kept.
+ */
+int ph_dct_videohash_stream(FrameSource *src, ph_frame_hash_callback callback, void *cookie){
+    if (!src || !src->next_frame || !callback)
+        return -1;
+
+    const int S = 10;
+    const int L = 50;
+    const int alpha1 = 3;
+    const int alpha2 = 2;
+    const int R = 2*L + 2;
+
+    float *dist = (float*)malloc(R*sizeof(float));
+    if (!dist)
+        return -1;
+    CImgList<uint8_t> thumbs(R);
+
+    CImg<float> prev(64,1,1,1,0);
+    CImg<float> *C = ph_dct_matrix(32);
+    CImg<float> Ctransp = C->get_transpose();
+    CImg<uint8_t> frame;
+    CImg<uint8_t> best;
+    float best_dist = 0;
+    int best_index = -1;
+
+    int count = 0;       // frames read so far
+    int next = 1;        // next frame to classify
+    int nbhashes = 0;
+    int res = 0;
+    bool ended = false;
+
+    while (!ended){
+        int nbread = src->next_frame(src,frame);
+        if (nbread < 0){
+            res = -1;
+            break;
+        }
+        if (nbread == 0){
+            ended = true;
+        } else {
+            /* downsampled luma: 64x64 for the histogram, 32x32 for the hash */
+            _ph_to_luma(frame);
+            frame.resize(64,64,1,1,2);
+            CImg<float> hist = frame.get_histogram(64,0,255);
+            float d = 0.0;
+            cimg_forX(hist,X){
+                float diff = hist(X) - prev(X);
+                d += (diff >= 0) ? diff : -diff;
+                prev(X) = hist(X);
+            }
+            dist[count % R] = d;
+            thumbs[count % R] = frame.resize(32,32,1,1,2);
+            count++;
+        }
+
+        /* classify every frame whose [k-L,k+L] window is complete */
+        while ((next < count-1) && (ended || next + L <= count-1)){
+            int k = next++;
+            int s_begin = (k-S >= 0) ? k-S : 0;
+            int s_end   = (k+S < count) ? k+S : count-1;
+            int l_begin = (k-L >= 0) ? k-L : 0;
+            int l_end   = (k+L < count) ? k+L : count-1;
+
+            float sum_global = 0.0, dev_global = 0.0;
+            for (int i=l_begin;i<=l_end;i++){
+                sum_global += dist[i % R];
+            }
+            float ave_global = sum_global/((float)(l_end-l_begin+1));
+            for (int i=l_begin;i<=l_end;i++){
+                float dev = ave_global - dist[i % R];
+                dev_global += (dev >= 0) ? dev : -dev;
+            }
+            dev_global = dev_global/((float)(l_end-l_begin+1));
+            float T_global = ave_global + alpha1*dev_global;
 
-        s[n].hash_p = &hashes[start];
-        s[n].n = off;
-        s[n].hash_params = NULL;
-        start += off;
-        --rem;
-        pthread_create(&thds[n], NULL, ph_image_thread, &s[n]);
+            int localmaxpos = s_begin;
+            for (int i=s_begin;i<=s_end;i++){
+                if (dist[i % R] > dist[localmaxpos % R])
+                    localmaxpos = i;
+            }
+            float localmax2 = 0;
+            int localmaxpos2 = s_begin;
+            for (int i=s_begin;i<=s_end;i++){
+                if (i == localmaxpos)
+                    continue;
+                if (dist[i % R] > localmax2){
+                    localmaxpos2 = i;
+                    localmax2 = dist[i % R];
+                }
+            }
+            float T_local = alpha2*dist[localmaxpos2 % R];
+            float Thresh = (T_global >= T_local) ? T_global : T_local;
+
+            if ((dist[k % R] == dist[localmaxpos % R]) && (dist[k % R] > Thresh)){
+                /* boundary: emit the keyframe of the shot it closes */
+                if (best_index >= 0)
+                    callback(_ph_dct_frame_hash(best,*C,Ctransp),best_index,cookie);
+                else
+                    callback(_ph_dct_frame_hash(thumbs[k % R],*C,Ctransp),k,cookie);
+                nbhashes++;
+                best_index = -1;
+            } else if ((best_index < 0) || (dist[k % R] < best_dist)){
+                best = thumbs[k % R];
+                best_dist = dist[k % R];
+                best_index = k;
+            }
+        }
     }
-    for(int i = 0; i < num_threads; ++i)
-    {
-        pthread_join(thds[i], NULL);
+
+    /* the last frame closes the final shot */
+    if ((res == 0) && (count > 0)){
+        int last = count-1;
+        if ((best_index >= 0) && (count > 1))
+            callback(_ph_dct_frame_hash(best,*C,Ctransp),best_index,cookie);
+        else
+            callback(_ph_dct_frame_hash(thumbs[last % R],*C,Ctransp),last,cookie);
+        nbhashes++;
     }
-    delete[] s;
 
-    return hashes;
+    free(dist);
+    delete C;
+    return (res < 0) ? res : nbhashes;
+}
 
+/* collects streamed hashes into a growing array */
+typedef struct ph_hash_list {
+    ulong64 *hashes;
+    int length;
+    int capacity;
+    int failed;
+} HashList;
+
+static void _ph_hash_list_add(ulong64 hash, int frame_index, void *cookie){
+    HashList *list = (HashList*)cookie;
+    if (list->failed)
+        return;
+    if (list->length == list->capacity){
+        int capacity = (list->capacity > 0) ? 2*list->capacity : 64;
+        ulong64 *hashes = (ulong64*)realloc(list->hashes,capacity*sizeof(ulong64));
+        if (!hashes){
+            list->failed = 1;
+            return;
+        }
+        list->hashes = hashes;
+        list->capacity = capacity;
+    }
+    list->hashes[list->length++] = hash;
 }
-#endif
 
+ulong64* ph_dct_videohash_source(FrameSource *src, int &Length){
+    HashList list = { NULL, 0, 0, 0 };
+    Length = 0;
+    if ((ph_dct_videohash_stream(src,_ph_hash_list_add,&list) < 0) || list.failed || (list.length == 0)){
+        free(list.hashes);
+        return NULL;
+    }
+    Length = list.length;
+    return list.hashes;
+}
 
 #endif
 
@@ -814,160 +1351,601 @@ CImgList<uint8_t>* ph_getKeyFramesFromVideo(const char *filename){
 }
 
 
-ulong64* ph_dct_videohash(const char *filename, int &Length){
+/* frames of a video file, decoded a few at a time */
+typedef struct ph_video_frames {
+    VFInfo st_info;
+    CImgList<uint8_t> *framelist;
+    unsigned int pos;
+    int done;
+} VideoFrames;
+
+static int _ph_video_next(FrameSource *src, CImg<uint8_t> &frame){
+    VideoFrames *vf = (VideoFrames*)src->state;
+    if (vf->pos >= vf->framelist->size()){
+        if (vf->done)
+            return 0;
+        vf->framelist->clear();
+        vf->pos = 0;
+        int nbread = NextFrames(&vf->st_info, vf->framelist);
+        if (nbread < 0)
+            return -1;
+        if (nbread < vf->st_info.nb_retrieval)
+            vf->done = 1;
+        if (vf->framelist->size() == 0)
+            return 0;
+    }
+    frame = vf->framelist->at(vf->pos++);
+    return 1;
+}
+
+static void _ph_video_close(FrameSource *src){
+    VideoFrames *vf = (VideoFrames*)src->state;
+    if (vf){
+        vfinfo_close(&vf->st_info);
+        delete vf->framelist;
+        free(vf);
+    }
+}
 
-    CImgList<uint8_t> *keyframes = ph_getKeyFramesFromVideo(filename);
-    if (keyframes == NULL)
+FrameSource* ph_video_source(const char *filename){
+    float frames_per_sec = 0.5*fps(filename);
+    if (frames_per_sec < 0){
         return NULL;
+    }
+    int step = (int)(frames_per_sec + ROUNDING_FACTOR(frames_per_sec));
 
-    Length = keyframes->size();
+    FrameSource *src = (FrameSource*)malloc(sizeof(FrameSource));
+    VideoFrames *vf = (VideoFrames*)malloc(sizeof(VideoFrames));
+    if (!src || !vf){
+        free(src);
+        free(vf);
+        return NULL;
+    }
+    vf->st_info.filename = filename;
+    vf->st_info.nb_retrieval = 10;
+    vf->st_info.step = (step > 0) ? step : 1;
+    vf->st_info.pixelformat = 0;
+    vf->st_info.pFormatCtx = NULL;
+    vf->st_info.width = -1;
+    vf->st_info.height = -1;
+    vf->framelist = new CImgList<uint8_t>();
+    vf->pos = 0;
+    vf->done = 0;
+    src->next_frame = _ph_video_next;
+    src->close = _ph_video_close;
+    src->state = vf;
+    return src;
+}
 
-    ulong64 *hash = (ulong64*)malloc(sizeof(ulong64)*Length);
-    CImg<float> *C = ph_dct_matrix(32);
-    CImg<float> Ctransp = C->get_transpose();
-    CImg<float> dctImage;
-    CImg<float> subsec;
-    CImg<uint8_t> currentframe;
-
-    for (unsigned int i=0;i < keyframes->size(); i++){
-        currentframe = keyframes->at(i);
-        currentframe.blur(1.0);
-        dctImage = (*C)*(currentframe)*Ctransp;
-        subsec = dctImage.crop(1,1,8,8).unroll('x');
-        float med = subsec.median();
-        hash[i] =     0x0000000000000000;
-        ulong64 one = 0x0000000000000001;
-        for (int j=0;j<64;j++){
-            if (subsec(j) > med)
-                hash[i] |= one;
-            one = one << 1;
-        }
-    }
-
-    keyframes->clear();
-    delete keyframes;
-    keyframes = NULL;
-    delete C;
-    C = NULL;
+ulong64* ph_dct_videohash(const char *filename, int &Length){
+
+    FrameSource *src = ph_video_source(filename);
+    if (src == NULL)
+        return NULL;
+
+    ulong64 *hash = ph_dct_videohash_source(src,Length);
+    ph_frame_source_close(src);
     return hash;
 }
 
 #ifdef HAVE_PTHREAD
-void *ph_video_thread(void *p)
+static void ph_video_task(int index, void *p)
 {
-    slice *s = (slice *)p;
-    for(int i = 0; i < s->n; ++i)
+    HashBatch *batch = (HashBatch *)p;
+    DP *dp = batch->hashes[index];
+    int N;
+    ulong64 *hash = ph_dct_videohash(dp->id, N);
+    if(hash)
     {
-        DP *dp = (DP *)s->hash_p[i];
-        int N;
-        ulong64 *hash = ph_dct_videohash(dp->id, N);
-        if(hash)
-        {
-            dp->hash = hash;
-            dp->hash_length = N;
-        }
-        else
-        {
-            dp->hash = NULL;
-            dp->hash_length = 0;
-        }
+        dp->hash = hash;
+        dp->hash_length = N;
     }
+    else
+    {
+        dp->hash = NULL;
+        dp->hash_length = 0;
+    }
+    if (batch->callback)
+        batch->callback(dp, batch->cookie);
 }
 
-DP** ph_dct_video_hashes(char *files[], int count, int threads)
+DP** ph_dct_video_hashes(char *files[], int count, int threads, ph_hash_callback callback, void *cookie)
 {
     if(!files || count <= 0)
         return NULL;
 
-    int num_threads;
-    if(threads > count)
+    double *costs = (double*)malloc(count*sizeof(double));
+    if (!costs)
+        return NULL;
+    DP **hashes = _ph_batch_datapoints(files, count, costs);
+
+    if (hashes)
     {
-        num_threads = count;
+        HashBatch batch = { hashes, callback, cookie };
+        ph_run_tasks(count, costs, threads, ph_video_task, &batch);
     }
-    else if(threads > 0)
-    {
-        num_threads = threads;
+    free(costs);
+
+    return hashes;
+
+}
+#endif
+
+
+#endif
+
+int ph_hamming_distance(const ulong64 hash1,const ulong64 hash2){
+    ulong64 x = hash1^hash2;
+    const ulong64 m1  = 0x5555555555555555ULL;
+    const ulong64 m2  = 0x3333333333333333ULL;
+    const ulong64 h01 = 0x0101010101010101ULL;
+    const ulong64 m4  = 0x0f0f0f0f0f0f0f0fULL;
+    x -= (x >> 1) & m1;
+    x = (x & m2) + ((x >> 2) & m2);
+    x = (x + (x >> 4)) & m4;
+    return (x * h01)>>56;
+}
+
+/* Longest common subsequence of the two keyframe sequences, where two frames
+ * match when their hamming distance is within threshold. Bit-parallel over
+ * hashA (Allison-Dix/Hyyro): V holds the row differences of the LCS table,
+ * one bit per frame of hashA, and each frame of hashB updates it with
+ * V = (V + (V & M)) | (V - (V & M)), M being the frames of hashA it matches.
+ * The LCS length is the number of zero bits left in V.
+ */
+double ph_dct_videohash_dist(ulong64 *hashA, int N1, ulong64 *hashB, int N2, int threshold){
+
+    if (!hashA || !hashB || N1 <= 0 || N2 <= 0)
+        return -1.0;
+
+    int den = (N1 <= N2) ? N1 : N2;
+    int words = (N1 + 63)/64;
+
+    HashArena *arena = ph_hash_arena_new(sizeof(ulong64),N1);
+    ulong64 *V = (ulong64*)malloc(words*sizeof(ulong64));
+    ulong64 *M = (ulong64*)malloc(words*sizeof(ulong64));
+    int *dists = (int*)malloc(N1*sizeof(int));
+    double result = -1.0;
+    if (!arena || !V || !M || !dists)
+        goto cleanup;
+
+    for (int i=0;i<N1;i++){
+        ph_hash_arena_add(arena,(const uint8_t*)&hashA[i]);
     }
-    else
-    {
-        num_threads = ph_num_threads();
+    for (int w=0;w<words;w++){
+        V[w] = ~0ULL;
     }
 
-    DP **hashes = (DP**)malloc(count*sizeof(DP*));
+    for (int j=0;j<N2;j++){
+        ph_hamming_distances((const uint8_t*)&hashB[j],arena,0,N1,dists);
+        memset(M,0,words*sizeof(ulong64));
+        for (int i=0;i<N1;i++){
+            if (dists[i] <= threshold)
+                M[i >> 6] |= 1ULL << (i & 63);
+        }
 
-    for(int i = 0; i < count; ++i)
-    {
-        hashes[i] = (DP *)malloc(sizeof(DP));
-        hashes[i]->id = strdup(files[i]);
-    }
+        ulong64 carry = 0, borrow = 0;
+        for (int w=0;w<words;w++){
+            ulong64 v = V[w];
+            ulong64 u = v & M[w];
 
-    pthread_t thds[num_threads];
+            ulong64 sum = v + u;
+            ulong64 c = (sum < v);
+            sum += carry;
+            carry = c | (sum < carry);
 
-    int rem = count % num_threads;
-    int start = 0;
-    int off = 0;
-    slice *s = new slice[num_threads];
-    for(int n = 0; n < num_threads; ++n)
-    {
-        off = (int)floor((count/(float)num_threads) + (rem>0?num_threads-(count % num_threads):0));
+            ulong64 diff = v - u;
+            ulong64 b = (v < u);
+            ulong64 diff2 = diff - borrow;
+            borrow = b | (diff < borrow);
 
-        s[n].hash_p = &hashes[start];
-        s[n].n = off;
-        s[n].hash_params = NULL;
-        start += off;
-        --rem;
-        pthread_create(&thds[n], NULL, ph_video_thread, &s[n]);
+            V[w] = sum | diff2;
+        }
     }
-    for(int i = 0; i < num_threads; ++i)
+
     {
-        pthread_join(thds[i], NULL);
+        int lcs = 0;
+        for (int i=0;i<N1;i++){
+            if (!((V[i >> 6] >> (i & 63)) & 1ULL))
+                lcs++;
+        }
+        result = (double)lcs/(double)den;
     }
-    delete[] s;
 
-    return hashes;
+cleanup:
+    ph_hash_arena_free(arena);
+    free(V);
+    free(M);
+    free(dists);
+    return result;
+}
 
+/* Multi-index over the keyframe hashes of many videos: every 64-bit hash is
+ * cut into nb_chunks substrings and each substring has its own table of
+ * postings. A clip frame within hamming distance r of a stored frame agrees
+ * with it on at least one substring up to r/nb_chunks bits, so probing the
+ * substrings of the clip frames finds the stored frames to vote for.
+ */
+struct ph_video_index {
+    int nb_chunks;
+    int chunk_bits;
+    vector<ulong64> frames;             //keyframe hashes of all videos
+    vector<int> frame_video;            //video of each frame
+    vector<int> video_start;            //first frame of each video, plus end
+    vector<string> ids;
+    vector< unordered_map<ulong64, vector<uint32_t> > > postings;
+};
+
+VideoIndex* ph_video_index_new(int nb_chunks){
+    if (nb_chunks != 1 && nb_chunks != 2 && nb_chunks != 4 && nb_chunks != 8)
+        return NULL;
+    VideoIndex *index = new VideoIndex;
+    index->nb_chunks = nb_chunks;
+    index->chunk_bits = 64/nb_chunks;
+    index->video_start.push_back(0);
+    index->postings.resize(nb_chunks);
+    return index;
 }
-#endif
 
-double ph_dct_videohash_dist(ulong64 *hashA, int N1, ulong64 *hashB, int N2, int threshold){
+void ph_video_index_free(VideoIndex *index){
+    delete index;
+}
 
-    int den = (N1 <= N2) ? N1 : N2;
-    int C[N1+1][N2+1];
+static inline ulong64 _ph_chunk(const VideoIndex *index, ulong64 hash, int c){
+    if (index->chunk_bits == 64)
+        return hash;
+    return (hash >> (c*index->chunk_bits)) & ((1ULL << index->chunk_bits) - 1);
+}
 
-    for (int i=0;i<N1+1;i++){
-        C[i][0] = 0;
+int ph_video_index_add(VideoIndex *index, const char *id, const ulong64 *hashes, int N){
+    if (!index || !hashes || N <= 0)
+        return -1;
+    int video = (int)index->ids.size();
+    index->ids.push_back(id ? id : "");
+    for (int i=0;i<N;i++){
+        uint32_t frame = (uint32_t)index->frames.size();
+        index->frames.push_back(hashes[i]);
+        index->frame_video.push_back(video);
+        for (int c=0;c<index->nb_chunks;c++)
+            index->postings[c][_ph_chunk(index,hashes[i],c)].push_back(frame);
+    }
+    index->video_start.push_back((int)index->frames.size());
+    return video;
+}
+
+int ph_video_index_size(const VideoIndex *index){
+    return index ? (int)index->ids.size() : 0;
+}
+
+/* all values within radius bits of key in a chunk of nbits */
+static void _ph_chunk_probes(ulong64 key, int nbits, int radius, vector<ulong64> &probes){
+    probes.clear();
+    probes.push_back(key);
+    if (radius >= 1){
+        for (int i=0;i<nbits;i++){
+            probes.push_back(key ^ (1ULL << i));
+            if (radius >= 2){
+                for (int j=i+1;j<nbits;j++)
+                    probes.push_back(key ^ (1ULL << i) ^ (1ULL << j));
+            }
+        }
     }
-    for (int j=0;j<N2+1;j++){
-        C[0][j] = 0;
+}
+
+VideoMatch* ph_video_index_query(const VideoIndex *index, const ulong64 *clip, int N, int *nbmatches,
+                                 int max_results, int threshold, int probe_radius, int candidates){
+    if (!nbmatches)
+        return NULL;
+    *nbmatches = 0;
+    if (!index || !clip || N <= 0 || max_results <= 0)
+        return NULL;
+
+    /* votes per (video, offset of clip start within the video) */
+    unordered_map<ulong64, int> votes;
+    vector<ulong64> probes;
+    vector<uint32_t> matched;
+    for (int qi=0;qi<N;qi++){
+        /* a frame found through several chunks or probes votes once */
+        matched.clear();
+        for (int c=0;c<index->nb_chunks;c++){
+            _ph_chunk_probes(_ph_chunk(index,clip[qi],c),index->chunk_bits,probe_radius,probes);
+            for (size_t p=0;p<probes.size();p++){
+                unordered_map<ulong64, vector<uint32_t> >::const_iterator bucket = index->postings[c].find(probes[p]);
+                if (bucket == index->postings[c].end())
+                    continue;
+                const vector<uint32_t> &frames = bucket->second;
+                for (size_t f=0;f<frames.size();f++){
+                    uint32_t frame = frames[f];
+                    if (ph_hamming_distance(clip[qi],index->frames[frame]) <= threshold)
+                        matched.push_back(frame);
+                }
+            }
+        }
+        std::sort(matched.begin(),matched.end());
+        matched.erase(std::unique(matched.begin(),matched.end()),matched.end());
+        for (size_t m=0;m<matched.size();m++){
+            uint32_t frame = matched[m];
+            int video = index->frame_video[frame];
+            long64 offset = (long64)(frame - index->video_start[video]) - qi;
+            votes[((ulong64)video << 32) | (uint32_t)(offset + N)]++;
+        }
     }
-    for (int i=1;i<N1+1;i++){
-        for (int j=1;j<N2+1;j++){
-            int d = ph_hamming_distance(hashA[i-1],hashB[j-1]);
-            if (d <= threshold){
-                C[i][j] = C[i-1][j-1] + 1;
-            } else {
-                C[i][j] = ((C[i-1][j] >= C[i][j-1])) ? C[i-1][j] : C[i][j-1];
+
+    /* best aligned offset per video, then the videos with most votes */
+    unordered_map<int, pair<int,int> > best;   //video -> (votes, offset)
+    for (unordered_map<ulong64,int>::const_iterator it = votes.begin();it != votes.end();++it){
+        int video = (int)(it->first >> 32);
+        int offset = (int)(uint32_t)it->first - N;
+        pair<int,int> &b = best[video];
+        if (it->second > b.first || (it->second == b.first && offset < b.second)){
+            b.first = it->second;
+            b.second = offset;
+        }
+    }
+    vector< pair<int,int> > ranked;         //(votes, video)
+    for (unordered_map<int, pair<int,int> >::const_iterator it = best.begin();it != best.end();++it)
+        ranked.push_back(make_pair(it->second.first,it->first));
+    std::sort(ranked.begin(),ranked.end(),[](const pair<int,int> &a, const pair<int,int> &b){
+        return (a.first != b.first) ? a.first > b.first : a.second < b.second;
+    });
+    if (candidates > 0 && (int)ranked.size() > candidates)
+        ranked.resize(candidates);
+
+    /* full sequence distance on the shortlist only */
+    vector<VideoMatch> matches;
+    for (size_t i=0;i<ranked.size();i++){
+        int video = ranked[i].second;
+        int start = index->video_start[video];
+        int length = index->video_start[video+1] - start;
+        VideoMatch m;
+        m.video = video;
+        m.id = index->ids[video].c_str();
+        m.offset = best[video].second;
+        m.votes = ranked[i].first;
+        m.similarity = ph_dct_videohash_dist((ulong64*)clip,N,(ulong64*)&index->frames[start],length,threshold);
+        matches.push_back(m);
+    }
+    std::stable_sort(matches.begin(),matches.end(),[](const VideoMatch &a, const VideoMatch &b){
+        return a.similarity > b.similarity;
+    });
+    if ((int)matches.size() > max_results)
+        matches.resize(max_results);
+    if (matches.empty())
+        return NULL;
+
+    VideoMatch *result = (VideoMatch*)malloc(matches.size()*sizeof(VideoMatch));
+    if (!result)
+        return NULL;
+    memcpy(result,matches.data(),matches.size()*sizeof(VideoMatch));
+    *nbmatches = (int)matches.size();
+    return result;
+}
+
+/* Bit-sampling LSH over binary hashes: every table keys a hash by bits_per_table
+ * of its bits, picked at random. Hashes within a small hamming distance agree
+ * on all sampled bits of some table with high probability; multi-probing the
+ * buckets whose keys differ in a few sampled bits raises that probability
+ * without more tables. Each table keeps its rows sorted by key, so a bucket is
+ * one contiguous run found by binary search.
+ */
+struct ph_lsh_index {
+    HashArena *arena;
+    int nb_tables;
+    int bits_per_table;
+    int built;                          //rows covered by the tables
+    vector<uint32_t> positions;         //sampled bit positions, bits_per_table per table
+    vector< vector<uint32_t> > keys;    //distinct keys of each table, increasing
+    vector< vector<uint32_t> > starts;  //first row of each key in rows, plus end
+    vector< vector<uint32_t> > rows;    //rows of each table ordered by key
+    vector<uint32_t> probes;            //key masks in probing order
+};
+
+static inline ulong64 _ph_splitmix64(ulong64 &state){
+    ulong64 z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+LSHIndex* ph_lsh_index_new(uint32_t hash_length, int nb_tables, int bits_per_table, unsigned int seed){
+    if (hash_length == 0 || nb_tables <= 0 || bits_per_table <= 0 || bits_per_table > 32
+        || (uint32_t)bits_per_table > 8*hash_length)
+        return NULL;
+    LSHIndex *index = new LSHIndex;
+    index->arena = ph_hash_arena_new(hash_length,1024);
+    if (!index->arena){
+        delete index;
+        return NULL;
+    }
+    index->nb_tables = nb_tables;
+    index->bits_per_table = bits_per_table;
+    index->built = 0;
+
+    /* distinct positions within a table, by a partial Fisher-Yates shuffle */
+    ulong64 state = seed;
+    vector<uint32_t> bits(8*hash_length);
+    for (int t=0;t<nb_tables;t++){
+        for (uint32_t i=0;i<bits.size();i++)
+            bits[i] = i;
+        for (int i=0;i<bits_per_table;i++){
+            uint32_t j = i + (uint32_t)(_ph_splitmix64(state) % (bits.size() - i));
+            std::swap(bits[i],bits[j]);
+            index->positions.push_back(bits[i]);
+        }
+    }
+    index->keys.resize(nb_tables);
+    index->starts.resize(nb_tables);
+    index->rows.resize(nb_tables);
+
+    /* the exact key first, then keys one, two, ... sampled bits away */
+    int probe_bits = (bits_per_table < 3) ? bits_per_table : 3;
+    for (int flips=0;flips<=probe_bits;flips++){
+        if (flips == 0){
+            index->probes.push_back(0);
+            continue;
+        }
+        for (int a=0;a<bits_per_table;a++){
+            if (flips == 1){
+                index->probes.push_back(1u << a);
+                continue;
+            }
+            for (int b=a+1;b<bits_per_table;b++){
+                if (flips == 2){
+                    index->probes.push_back((1u << a)|(1u << b));
+                    continue;
+                }
+                for (int c=b+1;c<bits_per_table;c++)
+                    index->probes.push_back((1u << a)|(1u << b)|(1u << c));
             }
         }
     }
+    return index;
+}
+
+void ph_lsh_index_free(LSHIndex *index){
+    if (!index)
+        return;
+    ph_hash_arena_free(index->arena);
+    delete index;
+}
 
-    double result = (double)(C[N1][N2])/(double)(den);
+int ph_lsh_index_add(LSHIndex *index, const uint8_t *hash){
+    if (!index || !hash)
+        return -1;
+    return ph_hash_arena_add(index->arena,hash);
+}
 
+int ph_lsh_index_size(const LSHIndex *index){
+    return index ? index->arena->count : 0;
+}
+
+static inline uint32_t _ph_lsh_key(const LSHIndex *index, int table, const uint8_t *hash){
+    const uint32_t *positions = &index->positions[table*index->bits_per_table];
+    uint32_t key = 0;
+    for (int i=0;i<index->bits_per_table;i++)
+        key |= (uint32_t)((hash[positions[i] >> 3] >> (positions[i] & 7)) & 1) << i;
+    return key;
+}
+
+int ph_lsh_index_build(LSHIndex *index){
+    if (!index)
+        return -1;
+    int count = index->arena->count;
+    vector< std::pair<uint32_t,uint32_t> > entries(count);
+    for (int t=0;t<index->nb_tables;t++){
+        for (int i=0;i<count;i++)
+            entries[i] = std::make_pair(_ph_lsh_key(index,t,ph_hash_arena_at(index->arena,i)),(uint32_t)i);
+        std::sort(entries.begin(),entries.end());
+
+        vector<uint32_t> &keys = index->keys[t];
+        vector<uint32_t> &starts = index->starts[t];
+        vector<uint32_t> &rows = index->rows[t];
+        keys.clear();
+        starts.clear();
+        rows.resize(count);
+        for (int i=0;i<count;i++){
+            if (i == 0 || entries[i].first != entries[i-1].first){
+                keys.push_back(entries[i].first);
+                starts.push_back((uint32_t)i);
+            }
+            rows[i] = entries[i].second;
+        }
+        starts.push_back((uint32_t)count);
+        keys.shrink_to_fit();
+        starts.shrink_to_fit();
+    }
+    index->built = count;
+    return 0;
+}
+
+LSHMatch* ph_lsh_index_query(const LSHIndex *index, const uint8_t *hash, int k, int probes, int max_distance,
+                             int *nbmatches){
+    if (!nbmatches)
+        return NULL;
+    *nbmatches = 0;
+    if (!index || !hash || k <= 0 || probes <= 0 || index->built == 0)
+        return NULL;
+    if (probes > (int)index->probes.size())
+        probes = (int)index->probes.size();
+
+    vector<uint32_t> candidates;
+    for (int t=0;t<index->nb_tables;t++){
+        const vector<uint32_t> &keys = index->keys[t];
+        uint32_t key = _ph_lsh_key(index,t,hash);
+        for (int p=0;p<probes;p++){
+            uint32_t probe = key ^ index->probes[p];
+            vector<uint32_t>::const_iterator it = std::lower_bound(keys.begin(),keys.end(),probe);
+            if (it == keys.end() || *it != probe)
+                continue;
+            size_t bucket = it - keys.begin();
+            candidates.insert(candidates.end(),
+                              index->rows[t].begin() + index->starts[t][bucket],
+                              index->rows[t].begin() + index->starts[t][bucket+1]);
+        }
+    }
+    std::sort(candidates.begin(),candidates.end());
+    candidates.erase(std::unique(candidates.begin(),candidates.end()),candidates.end());
+
+    vector<LSHMatch> matches;
+    uint32_t length = index->arena->hash_length;
+    for (size_t i=0;i<candidates.size();i++){
+        int distance = ph_hamming_distance_bytes(hash,ph_hash_arena_at(index->arena,(int)candidates[i]),length);
+        if (max_distance >= 0 && distance > max_distance)
+            continue;
+        LSHMatch m;
+        m.id = (int)candidates[i];
+        m.distance = distance;
+        matches.push_back(m);
+    }
+    size_t n = (matches.size() < (size_t)k) ? matches.size() : (size_t)k;
+    std::partial_sort(matches.begin(),matches.begin() + n,matches.end(),[](const LSHMatch &a, const LSHMatch &b){
+        return (a.distance != b.distance) ? a.distance < b.distance : a.id < b.id;
+    });
+    if (n == 0)
+        return NULL;
+    LSHMatch *result = (LSHMatch*)malloc(n*sizeof(LSHMatch));
+    if (!result)
+        return NULL;
+    memcpy(result,matches.data(),n*sizeof(LSHMatch));
+    *nbmatches = (int)n;
     return result;
 }
 
-#endif
+ulong64 ph_dct_coeffs_hash(const float *coeffs){
+    /* median of the 64 values, the mean of the two middle ones as CImg's median() */
+    float sorted[64];
+    memcpy(sorted,coeffs,sizeof(sorted));
+    std::nth_element(sorted,sorted + 32,sorted + 64);
+    float upper = sorted[32];
+    float lower = *std::max_element(sorted,sorted + 32);
+    float median = (upper + lower)/2;
 
-int ph_hamming_distance(const ulong64 hash1,const ulong64 hash2){
-    ulong64 x = hash1^hash2;
-    const ulong64 m1  = 0x5555555555555555ULL;
-    const ulong64 m2  = 0x3333333333333333ULL;
-    const ulong64 h01 = 0x0101010101010101ULL;
-    const ulong64 m4  = 0x0f0f0f0f0f0f0f0fULL;
-    x -= (x >> 1) & m1;
-    x = (x & m2) + ((x >> 2) & m2);
-    x = (x + (x >> 4)) & m4;
-    return (x * h01)>>56;
+    ulong64 hash = 0;
+    for (int i=0;i<64;i++){
+        if (coeffs[i] > median)
+            hash |= (ulong64)1 << i;
+    }
+    return hash;
+}
+
+void ph_dct_dihedral_hashes(const float *coeffs, ulong64 *hashes){
+    /* coefficient (u,v) of the mirrored image is the original one times (-1)^u, u the
+       frequency across the mirror axis; the stored block starts at frequency 1 */
+    float variant[64];
+    for (int k=0;k<8;k++){
+        int transpose = k >> 2;
+        int hflip = k & 1;
+        int vflip = (k >> 1) & 1;
+        for (int y=0;y<8;y++){
+            for (int x=0;x<8;x++){
+                float c = transpose ? coeffs[8*x + y] : coeffs[8*y + x];
+                if ((hflip && (x & 1) == 0) != (vflip && (y & 1) == 0))
+                    c = -c;
+                variant[8*y + x] = c;
+            }
+        }
+        hashes[k] = ph_dct_coeffs_hash(variant);
+    }
 }
 
 
@@ -1024,47 +2002,140 @@ return hashlist;
 
 }
 */
+/* Marr-Hildreth kernels, cached per (alpha, level).
+ * The kernel (2-A)exp(-A/2) with A = x^2+y^2 splits exactly into
+ * g1(x)g0(y) + g0(x)g1(y) with g0(t) = exp(-t^2/2), g1(t) = (1-t^2)exp(-t^2/2),
+ * so the 2D correlation is done as four 1D passes.
+ */
+typedef struct ph_mh_kernel {
+    float alpha;
+    float level;
+    int sigma;
+    CImg<float> *kernel;        //dense (2*sigma+1)x(2*sigma+1) kernel
+    float *g0;                  //separable taps, length 2*sigma+1
+    float *g1;
+    struct ph_mh_kernel *next;
+} MHKernel;
+
+static MHKernel *mh_kernels = NULL;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t mh_kernels_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static MHKernel* ph_mh_kernel(float alpha, float level){
+    MHKernel *k;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&mh_kernels_lock);
+#endif
+    for (k = mh_kernels; k != NULL; k = k->next){
+        if (k->alpha == alpha && k->level == level)
+            break;
+    }
+    if (k == NULL){
+        int sigma = (int)(4*pow((float)alpha,(float)level));
+        int size = 2*sigma+1;
+        float scale = pow(alpha,-level);
+        k = (MHKernel*)malloc(sizeof(MHKernel));
+        k->alpha = alpha;
+        k->level = level;
+        k->sigma = sigma;
+        k->g0 = (float*)malloc(size*sizeof(float));
+        k->g1 = (float*)malloc(size*sizeof(float));
+        for (int i=0;i<size;i++){
+            float t = scale*(i-sigma);
+            k->g0[i] = exp(-t*t/2);
+            k->g1[i] = (1-t*t)*k->g0[i];
+        }
+        k->kernel = new CImg<float>(size,size,1,1,0);
+        cimg_forXY(*k->kernel,X,Y){
+            float xpos = scale*(X-sigma);
+            float ypos = scale*(Y-sigma);
+            float A = xpos*xpos + ypos*ypos;
+            k->kernel->atXY(X,Y) = (2-A)*exp(-A/2);
+        }
+        k->next = mh_kernels;
+        mh_kernels = k;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&mh_kernels_lock);
+#endif
+    return k;
+}
+
 CImg<float>* GetMHKernel(float alpha, float level){
-    int sigma = (int)(4*pow((float)alpha,(float)level));
-    static CImg<float> *pkernel = NULL;
-    float xpos, ypos, A;
-    if (!pkernel){
-        pkernel = new CImg<float>(2*sigma+1,2*sigma+1,1,1,0);
-        cimg_forXY(*pkernel,X,Y){
-            xpos = pow(alpha,-level)*(X-sigma);
-            ypos = pow(alpha,-level)*(Y-sigma);
-            A = xpos*xpos + ypos*ypos;
-            pkernel->atXY(X,Y) = (2-A)*exp(-A/2);
+    return ph_mh_kernel(alpha,level)->kernel;
+}
+
+/* 1D correlation along x (dir 0) or y (dir 1) with clamped borders,
+ * matching the Neumann boundary of CImg::get_correlate.
+ */
+template<typename T>
+static void _ph_correlate1d(const CImg<T> &src, const float *taps, int r, int dir, CImg<float> &dst){
+    const int width = src.width();
+    const int height = src.height();
+    dst.assign(width,height,1,1);
+    if (dir == 0){
+        for (int y=0;y<height;y++){
+            const T *row = src.data(0,y);
+            float *out = dst.data(0,y);
+            for (int x=0;x<width;x++){
+                float sum = 0.0f;
+                for (int i=-r;i<=r;i++){
+                    int xx = x + i;
+                    xx = (xx < 0) ? 0 : ((xx >= width) ? width-1 : xx);
+                    sum += taps[i+r]*row[xx];
+                }
+                out[x] = sum;
+            }
+        }
+    } else {
+        for (int y=0;y<height;y++){
+            float *out = dst.data(0,y);
+            for (int x=0;x<width;x++)
+                out[x] = 0.0f;
+            for (int i=-r;i<=r;i++){
+                int yy = y + i;
+                yy = (yy < 0) ? 0 : ((yy >= height) ? height-1 : yy);
+                const T *row = src.data(0,yy);
+                const float w = taps[i+r];
+                for (int x=0;x<width;x++)
+                    out[x] += w*row[x];
+            }
         }
     }
-    return pkernel;
 }
 
-uint8_t* ph_mh_imagehash(const char *filename, int &N,float alpha, float lvl){
-    if (filename == NULL){
+/* Marr-Hildreth filter response of img, equal to img.get_correlate(*GetMHKernel(alpha,level)) */
+static void _ph_mh_correlate(const CImg<uint8_t> &img, float alpha, float level, CImg<float> &fresp){
+    MHKernel *k = ph_mh_kernel(alpha,level);
+    CImg<float> h0, h1, tmp;
+    _ph_correlate1d(img,k->g0,k->sigma,0,h0);
+    _ph_correlate1d(img,k->g1,k->sigma,0,h1);
+    _ph_correlate1d(h1,k->g0,k->sigma,1,fresp);
+    _ph_correlate1d(h0,k->g1,k->sigma,1,tmp);
+    fresp += tmp;
+}
+
+uint8_t* _ph_mh_imagehash(LumaImage &luma, int &N,float alpha, float lvl){
+    if (!luma.luma){
         return NULL;
     }
     uint8_t *hash = (unsigned char*)malloc(72*sizeof(uint8_t));
-    N = 72;
-
-    CImg<uint8_t> src(filename);
-    CImg<uint8_t> img;
-
-    if (src.spectrum() == 3){
-        img = src.get_RGBtoYCbCr().channel(0).blur(1.0).resize(512,512,1,1,5).get_equalize(256);
-    } else{
-        img = src.channel(0).get_blur(1.0).resize(512,512,1,1,5).get_equalize(256);
+    if (!hash){
+        return NULL;
     }
-    src.clear();
+    N = 72;
 
-    CImg<float> *pkernel = GetMHKernel(alpha,lvl);
-    CImg<float> fresp =  img.get_correlate(*pkernel);
-    img.clear();
+    CImg<float> fresp;
+    _ph_mh_correlate(*_ph_luma_mh512(luma),alpha,lvl,fresp);
     fresp.normalize(0,1.0);
+    CImg<double> sat;
+    _ph_integral_image(fresp,sat);
+    fresp.clear();
     CImg<float> blocks(31,31,1,1,0);
     for (int rindex=0;rindex < 31;rindex++){
         for (int cindex=0;cindex < 31;cindex++){
-            blocks(rindex,cindex) = (float)fresp.get_crop(rindex*16,cindex*16,rindex*16+16-1,cindex*16+16-1).sum();
+            blocks(rindex,cindex) = (float)_ph_block_sum(sat,rindex*16,cindex*16,16,16);
         }
     }
     int hash_index;
@@ -1096,6 +2167,142 @@ uint8_t* ph_mh_imagehash(const char *filename, int &N,float alpha, float lvl){
 
     return hash;
 }
+
+uint8_t* ph_mh_imagehash(const char *filename, int &N,float alpha, float lvl){
+    if (filename == NULL){
+        return NULL;
+    }
+    LumaImage luma;
+    if (ph_luma_load(filename,luma) < 0){
+        return NULL;
+    }
+    uint8_t *hash = _ph_mh_imagehash(luma,N,alpha,lvl);
+    ph_luma_free(luma);
+    return hash;
+}
+
+uint8_t* ph_mh_imagehash_buffer(const uint8_t *buffer, size_t length, int &N,float alpha, float lvl){
+    LumaImage luma;
+    if (ph_luma_load_buffer(buffer,length,luma) < 0){
+        return NULL;
+    }
+    uint8_t *hash = _ph_mh_imagehash(luma,N,alpha,lvl);
+    ph_luma_free(luma);
+    return hash;
+}
+
+HashParams ph_default_hash_params(){
+    HashParams params;
+    params.mh_alpha = 2.0f;
+    params.mh_level = 1.0f;
+    params.bmb_method = 1;
+    params.sigma = 3.5;
+    params.gamma = 1.0;
+    params.N = 180;
+    params.thumbnail_size = 0;
+    return params;
+}
+
+static void _ph_image_hashes_init(ImageHashes &hashes){
+    hashes.which = 0;
+    hashes.dct = 0;
+    memset(hashes.dct_coeffs,0,sizeof(hashes.dct_coeffs));
+    hashes.mh = NULL;
+    hashes.mh_length = 0;
+    hashes.bmb = NULL;
+    hashes.digest.id = NULL;
+    hashes.digest.coeffs = NULL;
+    hashes.digest.size = 0;
+    hashes.thumbnail = NULL;
+    hashes.thumbnail_width = 0;
+    hashes.thumbnail_height = 0;
+}
+
+int _ph_image_hashes(LumaImage &luma, int which, ImageHashes &hashes, const HashParams *params){
+    HashParams defaults = ph_default_hash_params();
+    if (!params)
+        params = &defaults;
+
+    _ph_image_hashes_init(hashes);
+    if (!luma.luma)
+        return -1;
+    if (params->thumbnail_size > 0 && ph_luma_thumbnail(luma,params->thumbnail_size) < 0)
+        return -1;
+
+    int res = 0;
+    if (which & (PH_HASH_DCT | PH_HASH_DCT_COEFFS)){
+        if (_ph_dct_coeffs(luma,hashes.dct_coeffs) == 0){
+            hashes.dct = ph_dct_coeffs_hash(hashes.dct_coeffs);
+            hashes.which |= which & (PH_HASH_DCT | PH_HASH_DCT_COEFFS);
+        } else
+            res = -1;
+    }
+    if (which & PH_HASH_MH){
+        hashes.mh = _ph_mh_imagehash(luma,hashes.mh_length,params->mh_alpha,params->mh_level);
+        if (hashes.mh)
+            hashes.which |= PH_HASH_MH;
+        else
+            res = -1;
+    }
+    if (which & PH_HASH_BMB){
+        if (_ph_bmb_imagehash(luma,params->bmb_method,&hashes.bmb) == 0)
+            hashes.which |= PH_HASH_BMB;
+        else
+            res = -1;
+    }
+    if (which & PH_HASH_DIGEST){
+        if (_ph_image_digest(*luma.luma,params->sigma,params->gamma,hashes.digest,params->N) == EXIT_SUCCESS)
+            hashes.which |= PH_HASH_DIGEST;
+        else
+            res = -1;
+    }
+    if (which & PH_HASH_THUMBNAIL){
+        size_t size = luma.luma->size();
+        hashes.thumbnail = (uint8_t*)malloc(size);
+        if (hashes.thumbnail){
+            memcpy(hashes.thumbnail,luma.luma->data(),size);
+            hashes.thumbnail_width = luma.luma->width();
+            hashes.thumbnail_height = luma.luma->height();
+            hashes.which |= PH_HASH_THUMBNAIL;
+        } else
+            res = -1;
+    }
+    return res;
+}
+
+int ph_image_hashes(const char *file, int which, ImageHashes &hashes, const HashParams *params){
+    LumaImage luma;
+    if (ph_luma_load(file,luma) < 0){
+        _ph_image_hashes_init(hashes);
+        return -1;
+    }
+    int res = _ph_image_hashes(luma,which,hashes,params);
+    ph_luma_free(luma);
+    return res;
+}
+
+int ph_image_hashes_buffer(const uint8_t *buffer, size_t length, int which, ImageHashes &hashes, const HashParams *params){
+    LumaImage luma;
+    if (ph_luma_load_buffer(buffer,length,luma) < 0){
+        _ph_image_hashes_init(hashes);
+        return -1;
+    }
+    int res = _ph_image_hashes(luma,which,hashes,params);
+    ph_luma_free(luma);
+    return res;
+}
+
+void ph_free_image_hashes(ImageHashes &hashes){
+    free(hashes.mh);
+    hashes.mh = NULL;
+    ph_bmb_free(hashes.bmb);
+    hashes.bmb = NULL;
+    free(hashes.digest.coeffs);
+    hashes.digest.coeffs = NULL;
+    free(hashes.thumbnail);
+    hashes.thumbnail = NULL;
+    hashes.which = 0;
+}
 #endif
 
 char** ph_readfilenames(const char *dirname,int &count){
@@ -1155,150 +2362,1152 @@ double ph_hammingdistance2(uint8_t *hashA, int lenA, uint8_t *hashB, int lenB){
     if ((hashA == NULL) || (hashB == NULL) || (lenA <= 0)){
         return -1.0;
     }
-    double dist = 0;
-    uint8_t D = 0;
-    for (int i=0;i<lenA;i++){
-        D = hashA[i]^hashB[i];
-        dist = dist + (double)ph_bitcount8(D);
-    }
+    double dist = (double)ph_hamming_distance_bytes(hashA,hashB,lenA);
     double bits = (double)lenA*8;
     return dist/bits;
 
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PH_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+static inline ulong64 _ph_load64(const uint8_t *p){
+    ulong64 x;
+    memcpy(&x,p,sizeof(x));
+    return x;
+}
+
+int ph_hamming_distance_bytes(const uint8_t *hashA, const uint8_t *hashB, uint32_t len){
+    int dist = 0;
+    uint32_t i = 0;
+    for (;i+8 <= len;i+=8){
+        dist += ph_hamming_distance(_ph_load64(hashA+i),_ph_load64(hashB+i));
+    }
+    for (;i < len;i++){
+        dist += ph_bitcount8(hashA[i]^hashB[i]);
+    }
+    return dist;
+}
+
+typedef void (*ph_hamming_kernel)(const uint8_t *query, const uint8_t *hashes, uint32_t stride, int count, int *dists);
+
+static void _ph_hamming_generic(const uint8_t *query, const uint8_t *hashes, uint32_t stride, int count, int *dists){
+    for (int n=0;n<count;n++){
+        const uint8_t *h = hashes + (size_t)n*stride;
+        int d = 0;
+        for (uint32_t i=0;i<stride;i+=8){
+            d += ph_hamming_distance(_ph_load64(query+i),_ph_load64(h+i));
+        }
+        dists[n] = d;
+    }
+}
+
+#ifdef PH_X86_DISPATCH
+__attribute__((target("popcnt")))
+static void _ph_hamming_popcnt(const uint8_t *query, const uint8_t *hashes, uint32_t stride, int count, int *dists){
+    for (int n=0;n<count;n++){
+        const uint8_t *h = hashes + (size_t)n*stride;
+        int d = 0;
+        for (uint32_t i=0;i<stride;i+=8){
+            d += __builtin_popcountll(_ph_load64(query+i)^_ph_load64(h+i));
+        }
+        dists[n] = d;
+    }
+}
+
+/* nibble lookup popcount, 32 bytes per step */
+__attribute__((target("avx2,popcnt")))
+static void _ph_hamming_avx2(const uint8_t *query, const uint8_t *hashes, uint32_t stride, int count, int *dists){
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    const uint32_t vec_end = stride & ~31u;
+    for (int n=0;n<count;n++){
+        const uint8_t *h = hashes + (size_t)n*stride;
+        __m256i acc = zero;
+        for (uint32_t i=0;i<vec_end;i+=32){
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(query+i)),
+                                         _mm256_loadu_si256((const __m256i*)(h+i)));
+            __m256i lo = _mm256_and_si256(x,low_mask);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x,4),low_mask);
+            __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut,lo),_mm256_shuffle_epi8(lut,hi));
+            acc = _mm256_add_epi64(acc,_mm256_sad_epu8(cnt,zero));
+        }
+        int d = (int)(_mm256_extract_epi64(acc,0) + _mm256_extract_epi64(acc,1) +
+                      _mm256_extract_epi64(acc,2) + _mm256_extract_epi64(acc,3));
+        for (uint32_t i=vec_end;i<stride;i+=8){
+            d += __builtin_popcountll(_ph_load64(query+i)^_ph_load64(h+i));
+        }
+        dists[n] = d;
+    }
+}
+#endif
+
+static ph_hamming_kernel _ph_select_hamming_kernel(uint32_t stride){
+#ifdef PH_X86_DISPATCH
+    __builtin_cpu_init();
+    if (stride >= 32 && __builtin_cpu_supports("avx2"))
+        return _ph_hamming_avx2;
+    if (__builtin_cpu_supports("popcnt"))
+        return _ph_hamming_popcnt;
+#endif
+    return _ph_hamming_generic;
+}
+
+static void* _ph_aligned_alloc(size_t size){
+#ifdef _WIN32
+    return _aligned_malloc(size,64);
+#else
+    void *p = NULL;
+    if (posix_memalign(&p,64,size) != 0)
+        return NULL;
+    return p;
+#endif
+}
+
+static void _ph_aligned_free(void *p){
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+HashArena* ph_hash_arena_new(uint32_t hash_length, int capacity){
+    if (hash_length == 0)
+        return NULL;
+    if (capacity < 1)
+        capacity = 1;
+    HashArena *arena = (HashArena*)malloc(sizeof(HashArena));
+    if (!arena)
+        return NULL;
+    arena->hash_length = hash_length;
+    arena->stride = (hash_length + 7) & ~7u;
+    arena->count = 0;
+    arena->capacity = capacity;
+    arena->data = (uint8_t*)_ph_aligned_alloc((size_t)capacity*arena->stride);
+    if (!arena->data){
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void ph_hash_arena_free(HashArena *arena){
+    if (arena){
+        _ph_aligned_free(arena->data);
+        free(arena);
+    }
+}
+
+int ph_hash_arena_add(HashArena *arena, const uint8_t *hash){
+    if (!arena || !hash)
+        return -1;
+    if (arena->count == arena->capacity){
+        int capacity = 2*arena->capacity;
+        uint8_t *data = (uint8_t*)_ph_aligned_alloc((size_t)capacity*arena->stride);
+        if (!data)
+            return -1;
+        memcpy(data,arena->data,(size_t)arena->count*arena->stride);
+        _ph_aligned_free(arena->data);
+        arena->data = data;
+        arena->capacity = capacity;
+    }
+    uint8_t *dst = arena->data + (size_t)arena->count*arena->stride;
+    memcpy(dst,hash,arena->hash_length);
+    memset(dst+arena->hash_length,0,arena->stride-arena->hash_length);
+    return arena->count++;
+}
+
+const uint8_t* ph_hash_arena_at(const HashArena *arena, int i){
+    return arena->data + (size_t)i*arena->stride;
+}
+
+int ph_hamming_distances(const uint8_t *query, const HashArena *arena, int start, int count, int *dists){
+    if (!query || !arena || !dists || start < 0 || count < 0)
+        return -1;
+    if (start + count > arena->count)
+        count = arena->count - start;
+    if (count <= 0)
+        return 0;
+
+    /* resolved once; the choice only depends on whether the stride fits AVX2 */
+    static const ph_hamming_kernel wide_kernel = _ph_select_hamming_kernel(32);
+    static const ph_hamming_kernel narrow_kernel = _ph_select_hamming_kernel(8);
+    ph_hamming_kernel kernel = (arena->stride >= 32) ? wide_kernel : narrow_kernel;
+
+    /* a query whose length is a multiple of 8 is already laid out like the
+     * arena entries; others are zero padded, on the stack unless very long
+     */
+    if (arena->hash_length == arena->stride){
+        kernel(query,ph_hash_arena_at(arena,start),arena->stride,count,dists);
+        return count;
+    }
+    uint8_t stack_padded[256];
+    uint8_t *padded = stack_padded;
+    if (arena->stride > sizeof(stack_padded)){
+        padded = (uint8_t*)malloc(arena->stride);
+        if (!padded)
+            return -1;
+    }
+    memcpy(padded,query,arena->hash_length);
+    memset(padded + arena->hash_length,0,arena->stride - arena->hash_length);
+    kernel(padded,ph_hash_arena_at(arena,start),arena->stride,count,dists);
+    if (padded != stack_padded)
+        free(padded);
+    return count;
+}
+
+int ph_crosscorr_batch(const uint8_t *query, const uint8_t *digests, int size, int count, double *pcc){
+    if (!query || !digests || !pcc || size <= 0 || count < 0)
+        return -1;
+
+    /* the centered query and its energy are shared by all candidates; the
+       candidate is written twice so every circular shift is a plain slice */
+    vector<double> x(size);
+    vector<double> y(2*size);
+    double sumx = 0.0;
+    for (int i=0;i<size;i++)
+        sumx += query[i];
+    double denx = 0.0;
+    for (int i=0;i<size;i++){
+        x[i] = query[i] - sumx/size;
+        denx += x[i]*x[i];
+    }
+
+    for (int c=0;c<count;c++){
+        const uint8_t *coeffs = digests + (size_t)c*size;
+        double sumy = 0.0;
+        for (int i=0;i<size;i++)
+            sumy += coeffs[i];
+        double deny = 0.0;
+        for (int i=0;i<size;i++){
+            y[i] = y[i+size] = coeffs[i] - sumy/size;
+            deny += y[i]*y[i];
+        }
+        double den = sqrt(denx*deny);
+        double peak = 0.0;
+        if (den > 0.0){
+            for (int shift=0;shift<size;shift++){
+                const double *ys = &y[shift];
+                double num = 0.0;
+                for (int i=0;i<size;i++)
+                    num += x[i]*ys[i];
+                if (num/den > peak)
+                    peak = num/den;
+            }
+        }
+        pcc[c] = peak;
+    }
+    return count;
+}
+
+int ph_bmb_distance(const BinHash *bh1, const BinHash *bh2){
+    if (!bh1 || !bh2 || bh1->bytelength != bh2->bytelength)
+        return -1;
+    return ph_hamming_distance_bytes(bh1->hash,bh2->hash,bh1->bytelength);
+}
+
+/* character classes for the text hash: 0 for skipped characters (control,
+ * punctuation, non ascii), otherwise the lower case character
+ */
+typedef struct ph_text_class_table {
+    uint8_t classes[256];
+} TextClassTable;
+
+static const uint8_t* _ph_text_classes(){
+    /* built once under the static initialization guard, so concurrent hashers are safe */
+    static const TextClassTable table = []{
+        TextClassTable t;
+        for (int d=0;d<256;d++){
+            if ((d >= '0' && d <= '9') || (d >= 'a' && d <= 'z'))
+                t.classes[d] = (uint8_t)d;
+            else if (d >= 'A' && d <= 'Z')
+                t.classes[d] = (uint8_t)(d + 32);
+            else
+                t.classes[d] = 0;
+        }
+        return t;
+    }();
+    return table.classes;
+}
+
+/* accepted characters are gathered per chunk of input before being hashed */
+static const int TextChunk = 4096;
+
+/* Winnowing state: rolling hash over the last KgramLength accepted
+ * characters, and the last WindowLength kgram hashes with the position of
+ * their rightmost minimum. The window is only searched again when that
+ * minimum slides out of it, about once every WindowLength kgrams.
+ */
+typedef struct ph_text_hasher {
+    ulong64 hashword;
+    long64 nbchars;                 //accepted characters so far
+    off_t offset;                   //file offset of the next input byte
+
+    /* key and file offset of the accepted characters of a chunk, after the
+     * last KgramLength of the previous chunks
+     */
+    ulong64 keys[KgramLength + TextChunk];
+    off_t key_pos[KgramLength + TextChunk];
+
+    TxtHashPoint window[WindowLength];  //ring of the last kgrams
+    int window_slot;                    //slot of the next kgram
+    TxtHashPoint minhash;               //rightmost minimum of the window
+    long64 min_kgram;                   //kgram number of minhash
+    long64 nbkgrams;
+    off_t last_index;               //index of the last fingerprint
+
+    TxtHashPoint *points;
+    size_t nbpoints;
+    size_t capacity;
+    int failed;
+} TextHasher;
+
+static void _ph_text_hasher_init(TextHasher *th){
+    th->hashword = 0ULL;
+    th->nbchars = 0;
+    th->offset = 0;
+    /* the kgrams of the first characters xor out these */
+    memset(th->keys,0,KgramLength*sizeof(ulong64));
+    th->window_slot = 0;
+    th->minhash.hash = ULLONG_MAX;
+    th->minhash.index = -1;
+    th->min_kgram = 0;
+    th->nbkgrams = 0;
+    th->last_index = -1;
+    th->points = NULL;
+    th->nbpoints = 0;
+    th->capacity = 0;
+    th->failed = 0;
+}
+
+static void _ph_text_emit(TextHasher *th, const TxtHashPoint &point){
+    if (th->nbpoints == th->capacity){
+        size_t capacity = (th->capacity > 0) ? 2*th->capacity : 1024;
+        if (capacity > (size_t)INT_MAX || capacity > SIZE_MAX/sizeof(TxtHashPoint)){
+            th->failed = 1;
+            return;
+        }
+        TxtHashPoint *points = (TxtHashPoint*)realloc(th->points,capacity*sizeof(TxtHashPoint));
+        if (!points){
+            th->failed = 1;
+            return;
+        }
+        th->points = points;
+        th->capacity = capacity;
+    }
+    th->points[th->nbpoints++] = point;
+    th->last_index = point.index;
+}
+
+/* slot of the rightmost minimum of the window, whose oldest kgram is at oldest */
+static int _ph_text_window_min(const TxtHashPoint *window, int oldest){
+    int best = oldest;
+    ulong64 best_hash = window[oldest].hash;
+    for (int n=1;n<WindowLength;n++){
+        const int i = (oldest + n < WindowLength) ? oldest + n : oldest + n - WindowLength;
+        const ulong64 hash = window[i].hash;
+        best = (hash <= best_hash) ? i : best;
+        best_hash = (hash <= best_hash) ? hash : best_hash;
+    }
+    return best;
+}
+
+static void _ph_text_hasher_chunk(TextHasher *th, const uint8_t *buffer, size_t length){
+    const uint8_t *classes = _ph_text_classes();
+    ulong64 *keys = th->keys;
+    off_t *key_pos = th->key_pos;
+
+    /* a branch per byte on the character class mispredicts on text, so
+     * every byte is stored and only accepted ones advance the end
+     */
+    const off_t offset = th->offset;
+    size_t end = KgramLength;
+    for (size_t n=0;n<length;n++){
+        uint8_t d = classes[buffer[n]];
+        keys[end] = textkeys[d];
+        key_pos[end] = offset + (off_t)n;
+        end += (d != 0);
+    }
+    th->offset = offset + (off_t)length;
+
+    /* the state is kept in locals, as stores into th could alias it */
+    TxtHashPoint *window = th->window;
+    ulong64 hashword = th->hashword;
+    long64 nbchars = th->nbchars;
+    long64 nbkgrams = th->nbkgrams;
+    int slot = th->window_slot;
+    TxtHashPoint minhash = th->minhash;
+    long64 min_kgram = th->min_kgram;
+    off_t last_index = th->last_index;
+    for (size_t j=KgramLength;j<end;j++){
+        /* rotate or left shift ??? */
+        /* right now, rotate breaks it */
+        /* before the text the keys are 0, so that the first kgram needs no special case */
+        hashword = (hashword << delta)^(keys[j]^(keys[j-KgramLength] << delta*KgramLength));
+        if (++nbchars < KgramLength)
+            continue;
+
+        /* the kgram starts at its oldest character */
+        const long64 kgram = nbkgrams++;
+        window[slot].hash = hashword;
+        window[slot].index = key_pos[j-KgramLength+1];
+        if (hashword <= minhash.hash){
+            minhash = window[slot];
+            min_kgram = kgram;
+        } else if (min_kgram + WindowLength <= kgram){
+            /* the minimum left the window */
+            const int best = _ph_text_window_min(window,(slot + 1 == WindowLength) ? 0 : slot + 1);
+            minhash = window[best];
+            min_kgram = kgram - (slot >= best ? slot - best : slot + WindowLength - best);
+        }
+        if (kgram + 1 >= WindowLength && minhash.index != last_index){
+            _ph_text_emit(th,minhash);
+            last_index = minhash.index;
+        }
+        slot = (slot + 1 == WindowLength) ? 0 : slot + 1;
+    }
+    th->hashword = hashword;
+    th->nbchars = nbchars;
+    th->nbkgrams = nbkgrams;
+    th->window_slot = slot;
+    th->minhash = minhash;
+    th->min_kgram = min_kgram;
+
+    /* keep the last KgramLength characters for the kgrams of the next chunk */
+    memmove(keys,keys + end - KgramLength,KgramLength*sizeof(ulong64));
+    memmove(key_pos,key_pos + end - KgramLength,KgramLength*sizeof(off_t));
+}
+
+static void _ph_text_hasher_update(TextHasher *th, const uint8_t *buffer, size_t length){
+    for (size_t n=0;n<length;n+=TextChunk)
+        _ph_text_hasher_chunk(th,buffer + n,(length - n < (size_t)TextChunk) ? length - n : (size_t)TextChunk);
+}
+
+static TxtHashPoint* _ph_text_hasher_final(TextHasher *th, int *nbpoints){
+    /* documents shorter than one window still get their minimum */
+    if (th->nbkgrams > 0 && th->nbkgrams < WindowLength)
+        _ph_text_emit(th,th->minhash);
+    if (th->failed || th->nbkgrams == 0){
+        free(th->points);
+        *nbpoints = 0;
+        return NULL;
+    }
+    *nbpoints = (int)th->nbpoints;
+    return th->points;
+}
+
+TxtHashPoint* ph_texthash_buffer(const char *buffer, size_t length, int *nbpoints){
+    if (!nbpoints)
+        return NULL;
+    *nbpoints = 0;
+    if (!buffer)
+        return NULL;
+    TextHasher *th = (TextHasher*)malloc(sizeof(TextHasher));
+    if (!th)
+        return NULL;
+    _ph_text_hasher_init(th);
+    _ph_text_hasher_update(th,(const uint8_t*)buffer,length);
+    TxtHashPoint *points = _ph_text_hasher_final(th,nbpoints);
+    free(th);
+    return points;
+}
+
 TxtHashPoint* ph_texthash(const char *filename,int *nbpoints){
-    int count;
-    TxtHashPoint *TxtHash = NULL;
-    TxtHashPoint WinHash[WindowLength];
-    char kgram[KgramLength];
+    if (!filename || !nbpoints)
+        return NULL;
+    *nbpoints = 0;
 
-    FILE *pfile = fopen(filename,"r");
+    FILE *pfile = fopen(filename,"rb");
     if (!pfile){
         return NULL;
     }
+    TextHasher *th = (TextHasher*)malloc(sizeof(TextHasher));
+    if (!th){
+        fclose(pfile);
+        return NULL;
+    }
+    _ph_text_hasher_init(th);
+
+    bool done = false;
+#ifndef _WIN32
     struct stat fileinfo;
-    fstat(fileno(pfile),&fileinfo);
-    count = fileinfo.st_size - WindowLength + 1;
-    count = (int)(0.01*count);
-    int d;
-    ulong64 hashword = 0ULL;
-
-    TxtHash = (TxtHashPoint*)malloc(count*sizeof(struct ph_hash_point));
-    if (!TxtHash){
-        return NULL;
-    }
-    *nbpoints=0;
-    int i, first=0, last=KgramLength-1;
-    int text_index = 0;
-    int win_index = 0;
-    for (i=0;i < KgramLength;i++){    /* calc first kgram */
-        d = fgetc(pfile);
-        if (d == EOF){
-            free(TxtHash);
+    if (fstat(fileno(pfile),&fileinfo) == 0 && S_ISREG(fileinfo.st_mode) && fileinfo.st_size > 0){
+        void *data = mmap(NULL,(size_t)fileinfo.st_size,PROT_READ,MAP_PRIVATE,fileno(pfile),0);
+        if (data != MAP_FAILED){
+            madvise(data,(size_t)fileinfo.st_size,MADV_SEQUENTIAL);
+            _ph_text_hasher_update(th,(const uint8_t*)data,(size_t)fileinfo.st_size);
+            munmap(data,(size_t)fileinfo.st_size);
+            done = true;
+        }
+    }
+#endif
+    if (!done){
+        const size_t chunk = 1 << 20;
+        uint8_t *buffer = (uint8_t*)malloc(chunk);
+        if (!buffer){
+            free(th);
+            fclose(pfile);
             return NULL;
         }
-        if (d <= 47)         /*skip cntrl chars*/
-            continue;
-        if ( ((d >= 58)&&(d <= 64)) || ((d >= 91)&&(d <= 96)) || (d >= 123) ) /*skip punct*/
+        size_t nbread;
+        while ((nbread = fread(buffer,1,chunk,pfile)) > 0){
+            _ph_text_hasher_update(th,buffer,nbread);
+        }
+        free(buffer);
+    }
+    fclose(pfile);
+
+    TxtHashPoint *points = _ph_text_hasher_final(th,nbpoints);
+    free(th);
+    return points;
+}
+
+static int _ph_text_add_match(TxtMatch **matches, int *nbmatches, int *capacity, off_t first, off_t second, uint32_t length){
+    if (*nbmatches == *capacity){
+        if (*capacity > INT_MAX/2)
+            return -1;
+        int new_capacity = (*capacity) ? 2*(*capacity) : 64;
+        TxtMatch *grown = (TxtMatch*)realloc(*matches,new_capacity*sizeof(TxtMatch));
+        if (!grown)
+            return -1;
+        *matches = grown;
+        *capacity = new_capacity;
+    }
+    TxtMatch &match = (*matches)[(*nbmatches)++];
+    match.first_index = first;
+    match.second_index = second;
+    match.length = length;
+    return 0;
+}
+
+TxtMatch* ph_compare_text_hashes(TxtHashPoint *hash1, int N1, TxtHashPoint *hash2,int N2, int *nbmatches){
+    if (!nbmatches || N1 < 0 || N2 < 0 || (N1 > 0 && !hash1) || (N2 > 0 && !hash2))
+        return NULL;
+    *nbmatches = 0;
+    int capacity = 0;
+    TxtMatch *found_matches = NULL;
+
+    /* build on the smaller document, probe with the larger one */
+    bool swapped = N2 < N1;
+    TxtHashPoint *build = swapped ? hash2 : hash1;
+    TxtHashPoint *probe = swapped ? hash1 : hash2;
+    int Nb = swapped ? N2 : N1;
+    int Np = swapped ? N1 : N2;
+
+    /* fingerprint -> first position, positions chained in increasing order */
+    unordered_map<ulong64,int> heads;
+    heads.reserve(Nb);
+    int *next = (int*)malloc((Nb ? Nb : 1)*sizeof(int));
+    if (!next)
+        return NULL;
+    for (int i=Nb-1;i>=0;i--){
+        auto slot = heads.emplace(build[i].hash,i);
+        next[i] = slot.second ? -1 : slot.first->second;
+        slot.first->second = i;
+    }
+
+    /* a matching pair whose predecessors also match lies inside a run
+       started earlier, so each run is extended once from its start */
+    for (int j=0;j<Np;j++){
+        auto head = heads.find(probe[j].hash);
+        if (head == heads.end())
             continue;
-        if ((d >= 65)&&(d<=90))       /*convert upper to lower case */
-            d = d + 32;
-
-        kgram[i] = (char)d;
-        hashword = hashword << delta;   /* rotate left or shift left ??? */
-        hashword = hashword^textkeys[d];/* right now, rotate breaks it */
-    }
-
-    WinHash[win_index].hash = hashword;
-    WinHash[win_index++].index = text_index;
-    struct ph_hash_point minhash;
-    minhash.hash = ULLONG_MAX;
-    minhash.index = 0;
-    struct ph_hash_point prev_minhash;
-    prev_minhash.hash = ULLONG_MAX;
-    prev_minhash.index = 0;
-
-    while ((d=fgetc(pfile)) != EOF){    /*remaining kgrams */
-        text_index++;
-        if (d == EOF){
-            free(TxtHash);
+        for (int i=head->second;i>=0;i=next[i]){
+            if (i > 0 && j > 0 && build[i-1].hash == probe[j-1].hash)
+                continue;
+            int m = i + 1;
+            int n = j + 1;
+            uint32_t cnt = 1;
+            while (m < Nb && n < Np && build[m].hash == probe[n].hash){
+                m++;
+                n++;
+                cnt++;
+            }
+            int first = swapped ? j : i;
+            int second = swapped ? i : j;
+            if (_ph_text_add_match(&found_matches,nbmatches,&capacity,first,second,cnt) < 0){
+                free(next);
+                free(found_matches);
+                *nbmatches = 0;
+                return NULL;
+            }
+        }
+    }
+    free(next);
+
+    std::sort(found_matches,found_matches + *nbmatches,[](const TxtMatch &a, const TxtMatch &b){
+        return (a.first_index != b.first_index) ? a.first_index < b.first_index
+                                                : a.second_index < b.second_index;
+    });
+    if (!found_matches)
+        found_matches = (TxtMatch*)malloc(sizeof(TxtMatch));
+    return found_matches;
+}
+
+#ifndef _WIN32
+/* Text index file, native byte order, every section 8-byte aligned:
+ *   header
+ *   uint32_t docs[nb_postings]         document of each posting (+ padding)
+ *   uint64_t offsets[nb_postings]      byte offset of each posting in its document
+ *   ulong64  terms[nb_terms]           distinct fingerprints, increasing
+ *   uint64_t term_start[nb_terms+1]    first posting of each term
+ *   uint64_t name_offsets[nb_docs]     start of each document id in names
+ *   char     names[names_size]         nul terminated document ids
+ * Postings of a term are ordered by document, then offset. Documents and
+ * offsets live in separate arrays so counting reads only the former.
+ */
+static const char text_index_magic[8] = {'P','H','T','X','I','D','X','1'};
+
+typedef struct ph_text_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_docs;
+    uint64_t nb_terms;
+    uint64_t nb_postings;
+    uint64_t names_size;
+} TextIndexHeader;
+
+struct ph_text_index {
+    void *map;
+    size_t size;
+    uint32_t nb_docs;
+    uint64_t nb_terms;
+    uint64_t nb_postings;
+    uint64_t names_size;
+    const uint32_t *docs;
+    const uint64_t *offsets;
+    const ulong64 *terms;
+    const uint64_t *term_start;
+    const uint64_t *name_offsets;
+    const char *names;
+};
+
+static inline uint64_t _ph_align8(uint64_t n){
+    return (n + 7) & ~(uint64_t)7;
+}
+
+/* byte offsets of the sections of an index file, plus its total size;
+ * -1 if the counts are too large for the offsets to fit in 64 bits
+ */
+static int _ph_text_index_layout(const TextIndexHeader &header, uint64_t sections[7]){
+    /* below 2^56 every section is under 2^60 bytes and their sum cannot overflow */
+    const uint64_t max_count = (uint64_t)1 << 56;
+    if (header.nb_postings >= max_count || header.nb_terms >= max_count || header.names_size >= max_count)
+        return -1;
+    sections[0] = sizeof(TextIndexHeader);
+    sections[1] = sections[0] + _ph_align8(header.nb_postings*sizeof(uint32_t));
+    sections[2] = sections[1] + header.nb_postings*sizeof(uint64_t);
+    sections[3] = sections[2] + header.nb_terms*sizeof(ulong64);
+    sections[4] = sections[3] + (header.nb_terms + 1)*sizeof(uint64_t);
+    sections[5] = sections[4] + (uint64_t)header.nb_docs*sizeof(uint64_t);
+    sections[6] = sections[5] + header.names_size;
+    return 0;
+}
+
+TextIndex* ph_text_index_open(const char *filename){
+    if (!filename)
+        return NULL;
+    int fd = open(filename,O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat fileinfo;
+    if (fstat(fd,&fileinfo) < 0 || (size_t)fileinfo.st_size < sizeof(TextIndexHeader)){
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)fileinfo.st_size;
+    void *map = mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const TextIndexHeader *header = (const TextIndexHeader*)map;
+    uint64_t sections[7];
+    if (memcmp(header->magic,text_index_magic,sizeof(text_index_magic)) != 0 || header->version != 1
+        || header->nb_postings > size || header->nb_terms > header->nb_postings
+        || header->names_size > size || _ph_text_index_layout(*header,sections) < 0 || sections[6] != size){
+        munmap(map,size);
+        return NULL;
+    }
+    TextIndex *index = (TextIndex*)malloc(sizeof(TextIndex));
+    if (!index){
+        munmap(map,size);
+        return NULL;
+    }
+    const char *base = (const char*)map;
+    index->map = map;
+    index->size = size;
+    index->nb_docs = header->nb_docs;
+    index->nb_terms = header->nb_terms;
+    index->nb_postings = header->nb_postings;
+    index->names_size = header->names_size;
+    index->docs = (const uint32_t*)(base + sections[0]);
+    index->offsets = (const uint64_t*)(base + sections[1]);
+    index->terms = (const ulong64*)(base + sections[2]);
+    index->term_start = (const uint64_t*)(base + sections[3]);
+    index->name_offsets = (const uint64_t*)(base + sections[4]);
+    index->names = base + sections[5];
+    /* the other sections are checked where they are used, so that opening does not read them */
+    if (index->nb_docs > 0 && (index->names_size == 0 || index->names[index->names_size-1] != '\0')){
+        ph_text_index_close(index);
+        return NULL;
+    }
+    madvise(map,size,MADV_RANDOM);
+    return index;
+}
+
+void ph_text_index_close(TextIndex *index){
+    if (!index)
+        return;
+    munmap(index->map,index->size);
+    free(index);
+}
+
+int ph_text_index_size(const TextIndex *index){
+    return index ? (int)index->nb_docs : 0;
+}
+
+const char* ph_text_index_id(const TextIndex *index, int doc){
+    if (!index || doc < 0 || (uint32_t)doc >= index->nb_docs || index->name_offsets[doc] >= index->names_size)
+        return NULL;
+    return index->names + index->name_offsets[doc];
+}
+
+int ph_text_index_postings(const TextIndex *index, ulong64 hash, const uint32_t **docs, const uint64_t **offsets){
+    if (!index)
+        return -1;
+    const ulong64 *term = std::lower_bound(index->terms,index->terms + index->nb_terms,hash);
+    if (term == index->terms + index->nb_terms || *term != hash)
+        return 0;
+    uint64_t t = term - index->terms;
+    uint64_t start = index->term_start[t];
+    uint64_t end = index->term_start[t+1];
+    if (start > end || end > index->nb_postings || end - start > INT_MAX)
+        return -1;
+    /* a corrupt file must not send callers outside their per-document arrays */
+    for (uint64_t p=start;p<end;p++){
+        if (index->docs[p] >= index->nb_docs)
+            return -1;
+    }
+    if (docs)
+        *docs = index->docs + start;
+    if (offsets)
+        *offsets = index->offsets + start;
+    return (int)(end - start);
+}
+
+TextHit* ph_text_index_query(const TextIndex *index, const TxtHashPoint *hashes, int N, int *nbhits,
+                             int max_results, int min_shared){
+    if (!nbhits)
+        return NULL;
+    *nbhits = 0;
+    if (!index || !hashes || N <= 0 || max_results <= 0)
+        return NULL;
+
+    vector<ulong64> query(N);
+    for (int i=0;i<N;i++)
+        query[i] = hashes[i].hash;
+    std::sort(query.begin(),query.end());
+    query.erase(std::unique(query.begin(),query.end()),query.end());
+
+    /* distinct query fingerprints found in each document */
+    vector<int> shared(index->nb_docs,0);
+    vector<uint32_t> touched;
+    for (size_t q=0;q<query.size();q++){
+        const uint32_t *docs;
+        int count = ph_text_index_postings(index,query[q],&docs,NULL);
+        if (count < 0)
             return NULL;
+        for (int p=0;p<count;p++){
+            if (p > 0 && docs[p] == docs[p-1])
+                continue;
+            if (shared[docs[p]]++ == 0)
+                touched.push_back(docs[p]);
         }
-        if (d <= 47)         /*skip cntrl chars*/
-            continue;
-        if ( ((d >= 58)&&(d <= 64)) || ((d >= 91)&&(d <= 96)) || (d >= 123) ) /*skip punct*/
+    }
+
+    vector<TextHit> hits;
+    for (size_t i=0;i<touched.size();i++){
+        uint32_t doc = touched[i];
+        if (shared[doc] < min_shared)
             continue;
-        if ((d >= 65)&&(d<=90))       /*convert upper to lower case */
-            d = d + 32;
+        TextHit hit;
+        hit.doc = (int)doc;
+        hit.id = ph_text_index_id(index,(int)doc);
+        hit.shared = shared[doc];
+        hit.score = (double)shared[doc]/(double)query.size();
+        hits.push_back(hit);
+    }
+    auto better = [](const TextHit &a, const TextHit &b){
+        return (a.shared != b.shared) ? a.shared > b.shared : a.doc < b.doc;
+    };
+    size_t nb = (hits.size() < (size_t)max_results) ? hits.size() : (size_t)max_results;
+    std::partial_sort(hits.begin(),hits.begin() + nb,hits.end(),better);
+    if (nb == 0)
+        return NULL;
+    TextHit *results = (TextHit*)malloc(nb*sizeof(TextHit));
+    if (!results)
+        return NULL;
+    memcpy(results,hits.data(),nb*sizeof(TextHit));
+    *nbhits = (int)nb;
+    return results;
+}
 
-        ulong64 oldsym = textkeys[kgram[first%KgramLength]];
+#ifdef HAVE_PTHREAD
+/* buffered writes into one section of the index file */
+typedef struct ph_section_writer {
+    int fd;
+    off_t pos;
+    vector<char> buffer;
+} SectionWriter;
+
+static int _ph_section_flush(SectionWriter &writer){
+    size_t done = 0;
+    while (done < writer.buffer.size()){
+        ssize_t n = pwrite(writer.fd,writer.buffer.data() + done,writer.buffer.size() - done,writer.pos);
+        if (n < 0){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+        writer.pos += n;
+    }
+    writer.buffer.clear();
+    return 0;
+}
 
-        /* rotate or left shift ??? */
-        /* right now, rotate breaks it */
-        oldsym = oldsym << delta*KgramLength;
-        hashword = hashword << delta;
-        hashword = hashword^textkeys[d];
-        hashword = hashword^oldsym;
-        kgram[last%KgramLength] = (char)d;
-        first++;
-        last++;
-
-        WinHash[win_index%WindowLength].hash = hashword;
-        WinHash[win_index%WindowLength].index = text_index;
-        win_index++;
-
-        if (win_index >= WindowLength){
-            minhash.hash = ULLONG_MAX;
-            for (i=win_index;i<win_index+WindowLength;i++){
-                if (WinHash[i%WindowLength].hash <= minhash.hash){
-                    minhash.hash = WinHash[i%WindowLength].hash;
-                    minhash.index = WinHash[i%WindowLength].index;
-                }
+static inline int _ph_section_write(SectionWriter &writer, const void *data, size_t length){
+    const char *bytes = (const char*)data;
+    writer.buffer.insert(writer.buffer.end(),bytes,bytes + length);
+    if (writer.buffer.size() >= (1 << 20))
+        return _ph_section_flush(writer);
+    return 0;
+}
+
+typedef struct ph_text_index_batch {
+    char **files;
+    TxtHashPoint **points;
+    int *nbpoints;
+} TextIndexBatch;
+
+static bool _ph_point_less(const TxtHashPoint &a, const TxtHashPoint &b){
+    return (a.hash != b.hash) ? a.hash < b.hash : a.index < b.index;
+}
+
+static void ph_text_index_task(int index, void *p){
+    TextIndexBatch *batch = (TextIndexBatch*)p;
+    int N = 0;
+    TxtHashPoint *points = ph_texthash(batch->files[index],&N);
+    if (points)
+        std::sort(points,points + N,_ph_point_less);
+    batch->points[index] = points;
+    batch->nbpoints[index] = points ? N : 0;
+}
+
+int ph_text_index_build(char *files[], int count, const char *filename, int threads){
+    if (!files || count <= 0 || !filename)
+        return -1;
+
+    TextIndexBatch batch;
+    batch.files = files;
+    batch.points = (TxtHashPoint**)calloc(count,sizeof(TxtHashPoint*));
+    batch.nbpoints = (int*)calloc(count,sizeof(int));
+    double *costs = (double*)malloc(count*sizeof(double));
+    if (!batch.points || !batch.nbpoints || !costs){
+        free(batch.points);
+        free(batch.nbpoints);
+        free(costs);
+        return -1;
+    }
+    for (int i=0;i<count;i++){
+        struct stat fileinfo;
+        costs[i] = (stat(files[i],&fileinfo) == 0) ? (double)fileinfo.st_size : 0.0;
+    }
+    ph_run_tasks(count,costs,threads,ph_text_index_task,&batch);
+    free(costs);
+
+    TextIndexHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,text_index_magic,sizeof(text_index_magic));
+    header.version = 1;
+    header.nb_docs = (uint32_t)count;
+    for (int i=0;i<count;i++){
+        header.nb_postings += batch.nbpoints[i];
+        header.names_size += strlen(files[i]) + 1;
+    }
+
+    /* k-way merge of the sorted documents, in (hash, doc) order */
+    typedef std::pair<ulong64,int> HeapEntry;
+    vector<HeapEntry> heap;
+    vector<int> cursor(count,0);
+    for (int i=0;i<count;i++){
+        if (batch.nbpoints[i] > 0)
+            heap.push_back(HeapEntry(batch.points[i][0].hash,i));
+    }
+    std::make_heap(heap.begin(),heap.end(),std::greater<HeapEntry>());
+
+    /* written beside the index and renamed over it once complete, so that a
+     * failed build keeps the old index and readers mapping it are not cut short
+     */
+    int res = -1;
+    string tmpname = string(filename) + ".tmp";
+    uint64_t sections[7];
+    int fd = -1;
+    if (_ph_text_index_layout(header,sections) == 0)
+        fd = open(tmpname.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd >= 0){
+        vector<ulong64> terms;
+        vector<uint64_t> term_start;
+        SectionWriter docs_out = { fd, (off_t)sizeof(TextIndexHeader), vector<char>() };
+        SectionWriter offsets_out = { fd, (off_t)sections[1], vector<char>() };
+
+        bool ok = true;
+        uint64_t posting = 0;
+        while (ok && !heap.empty()){
+            std::pop_heap(heap.begin(),heap.end(),std::greater<HeapEntry>());
+            HeapEntry top = heap.back();
+            heap.pop_back();
+            if (terms.empty() || terms.back() != top.first){
+                terms.push_back(top.first);
+                term_start.push_back(posting);
             }
-            if (minhash.hash != prev_minhash.hash){	 
-                TxtHash[(*nbpoints)].hash = minhash.hash;
-                TxtHash[(*nbpoints)++].index = minhash.index;
-                prev_minhash.hash = minhash.hash;
-                prev_minhash.index = minhash.index;
-
-            } else {
-                TxtHash[*nbpoints].hash = prev_minhash.hash;
-                TxtHash[(*nbpoints)++].index = prev_minhash.index;
+            /* all the postings of this document for this term */
+            int doc = top.second;
+            int &c = cursor[doc];
+            uint32_t doc32 = (uint32_t)doc;
+            while (ok && c < batch.nbpoints[doc] && batch.points[doc][c].hash == top.first){
+                uint64_t offset = (uint64_t)batch.points[doc][c].index;
+                ok = _ph_section_write(docs_out,&doc32,sizeof(doc32)) == 0
+                     && _ph_section_write(offsets_out,&offset,sizeof(offset)) == 0;
+                c++;
+                posting++;
             }
-            win_index = 0;
+            if (c < batch.nbpoints[doc]){
+                heap.push_back(HeapEntry(batch.points[doc][c].hash,doc));
+                std::push_heap(heap.begin(),heap.end(),std::greater<HeapEntry>());
+            }
+        }
+        term_start.push_back(posting);
+        header.nb_terms = terms.size();
+        ok = ok && _ph_text_index_layout(header,sections) == 0;
+
+        /* the tail sections follow the postings */
+        SectionWriter tail_out = { fd, (off_t)sections[2], vector<char>() };
+        vector<uint64_t> name_offsets(count);
+        uint64_t name_offset = 0;
+        for (int i=0;i<count;i++){
+            name_offsets[i] = name_offset;
+            name_offset += strlen(files[i]) + 1;
         }
+        ok = ok && _ph_section_flush(docs_out) == 0 && _ph_section_flush(offsets_out) == 0
+             && _ph_section_write(tail_out,terms.data(),terms.size()*sizeof(ulong64)) == 0
+             && _ph_section_write(tail_out,term_start.data(),term_start.size()*sizeof(uint64_t)) == 0
+             && _ph_section_write(tail_out,name_offsets.data(),name_offsets.size()*sizeof(uint64_t)) == 0;
+        for (int i=0;ok && i<count;i++)
+            ok = _ph_section_write(tail_out,files[i],strlen(files[i]) + 1) == 0;
+        ok = ok && _ph_section_flush(tail_out) == 0;
+
+        /* the header goes last, so a partial file never looks valid */
+        if (ok && ftruncate(fd,(off_t)sections[6]) == 0
+            && pwrite(fd,&header,sizeof(header),0) == (ssize_t)sizeof(header) && fsync(fd) == 0)
+            res = 0;
+        if (close(fd) < 0)
+            res = -1;
+        if (res == 0 && rename(tmpname.c_str(),filename) < 0)
+            res = -1;
+        if (res < 0)
+            unlink(tmpname.c_str());
+    }
+
+    for (int i=0;i<count;i++)
+        free(batch.points[i]);
+    free(batch.points);
+    free(batch.nbpoints);
+    return res;
+}
+#endif
+#endif
+
+static HashResults* _ph_hash_results_new(int count, int capacity){
+    HashResults *results = (HashResults*)calloc(1,sizeof(HashResults));
+    if (!results)
+        return NULL;
+    results->count = count;
+    results->arena = ph_hash_arena_new(sizeof(ulong64),capacity);
+    results->offsets = (int*)calloc(count+1,sizeof(int));
+    results->id_offsets = (uint32_t*)malloc(count*sizeof(uint32_t));
+    if (!results->arena || !results->offsets || !results->id_offsets){
+        ph_free_hash_results(results);
+        return NULL;
     }
+    return results;
+}
 
-    fclose(pfile);
-    return TxtHash;
+/* copy the ids into one pool, storing equal ids once */
+static int _ph_hash_results_set_ids(HashResults *results, char *files[]){
+    unordered_map<string,uint32_t> interned;
+    size_t pool_size = 0;
+    for (int i=0;i<results->count;i++){
+        if (interned.emplace(files[i],(uint32_t)pool_size).second)
+            pool_size += strlen(files[i]) + 1;
+    }
+    results->ids = (char*)malloc(pool_size ? pool_size : 1);
+    if (!results->ids)
+        return -1;
+    for (int i=0;i<results->count;i++){
+        uint32_t offset = interned[files[i]];
+        results->id_offsets[i] = offset;
+        strcpy(results->ids + offset,files[i]);
+    }
+    return 0;
 }
 
-TxtMatch* ph_compare_text_hashes(TxtHashPoint *hash1, int N1, TxtHashPoint *hash2,int N2, int *nbmatches){
+/* number the arena entries by the file they belong to */
+static int _ph_hash_results_set_owners(HashResults *results){
+    results->owners = (int*)malloc((results->arena->count ? results->arena->count : 1)*sizeof(int));
+    if (!results->owners)
+        return -1;
+    for (int i=0;i<results->count;i++){
+        for (int j=results->offsets[i];j<results->offsets[i+1];j++)
+            results->owners[j] = i;
+    }
+    return 0;
+}
+
+void ph_free_hash_results(HashResults *results){
+    if (results){
+        ph_hash_arena_free(results->arena);
+        free(results->offsets);
+        free(results->owners);
+        free(results->id_offsets);
+        free(results->ids);
+        free(results);
+    }
+}
+
+const char* ph_hash_results_id(const HashResults *results, int i){
+    if (!results || i < 0 || i >= results->count)
+        return NULL;
+    return results->ids + results->id_offsets[i];
+}
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_IMAGE_HASH)
+/* per file result slots written by the workers, compacted afterwards */
+typedef struct ph_image_hash_slots {
+    char **files;
+    ulong64 *hashes;
+    uint8_t *ok;
+} ImageHashSlots;
+
+static void ph_image_slot_task(int index, void *p){
+    ImageHashSlots *slots = (ImageHashSlots*)p;
+    slots->ok[index] = (ph_dct_imagehash(slots->files[index],slots->hashes[index]) == 0);
+}
 
-    int max_matches = (N1 >= N2) ? N1:N2;
-    TxtMatch *found_matches = (TxtMatch*)malloc(max_matches*sizeof(TxtMatch));
-    if (!found_matches){
+HashResults* ph_dct_image_hash_results(char *files[], int count, int threads){
+    if (!files || count <= 0)
         return NULL;
+
+    HashResults *results = _ph_hash_results_new(count,count);
+    double *costs = (double*)malloc(count*sizeof(double));
+    ImageHashSlots slots;
+    slots.files = files;
+    slots.hashes = (ulong64*)malloc(count*sizeof(ulong64));
+    slots.ok = (uint8_t*)calloc(count,1);
+    if (!results || !costs || !slots.hashes || !slots.ok || _ph_hash_results_set_ids(results,files) < 0){
+        ph_free_hash_results(results);
+        results = NULL;
+        goto cleanup;
     }
 
-    *nbmatches = 0;
-    int i,j;
-    for (i=0;i<N1;i++){
-        for (j=0;j<N2;j++){
-            if (hash1[i].hash == hash2[j].hash){
-                int m = i + 1;
-                int n = j + 1;
-                int cnt = 1;
-                while((m < N1)&&(n < N2)&&(hash1[m++].hash == hash2[n++].hash)){
-                    cnt++;
-                }
-                found_matches[*nbmatches].first_index = i;
-                found_matches[*nbmatches].second_index = j;
-                found_matches[*nbmatches].length = cnt;
-                (*nbmatches)++;
-            }
+    for (int i=0;i<count;i++){
+        struct stat fileinfo;
+        costs[i] = (stat(files[i],&fileinfo) == 0) ? (double)fileinfo.st_size : 0.0;
+    }
+    ph_run_tasks(count,costs,threads,ph_image_slot_task,&slots);
+
+    for (int i=0;i<count;i++){
+        if (slots.ok[i] && ph_hash_arena_add(results->arena,(const uint8_t*)&slots.hashes[i]) < 0){
+            ph_free_hash_results(results);
+            results = NULL;
+            goto cleanup;
         }
+        results->offsets[i+1] = results->arena->count;
     }
-    return found_matches;
+    if (_ph_hash_results_set_owners(results) < 0){
+        ph_free_hash_results(results);
+        results = NULL;
+    }
+
+cleanup:
+    free(costs);
+    free(slots.hashes);
+    free(slots.ok);
+    return results;
+}
+#endif
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_VIDEO_HASH)
+typedef struct ph_video_hash_slots {
+    char **files;
+    ulong64 **hashes;
+    int *lengths;
+} VideoHashSlots;
+
+static void ph_video_slot_task(int index, void *p){
+    VideoHashSlots *slots = (VideoHashSlots*)p;
+    slots->hashes[index] = ph_dct_videohash(slots->files[index],slots->lengths[index]);
 }
 
+HashResults* ph_dct_video_hash_results(char *files[], int count, int threads){
+    if (!files || count <= 0)
+        return NULL;
+
+    HashResults *results = _ph_hash_results_new(count,count);
+    double *costs = (double*)malloc(count*sizeof(double));
+    VideoHashSlots slots;
+    slots.files = files;
+    slots.hashes = (ulong64**)calloc(count,sizeof(ulong64*));
+    slots.lengths = (int*)calloc(count,sizeof(int));
+    if (!results || !costs || !slots.hashes || !slots.lengths || _ph_hash_results_set_ids(results,files) < 0){
+        ph_free_hash_results(results);
+        results = NULL;
+        goto cleanup;
+    }
+
+    for (int i=0;i<count;i++){
+        struct stat fileinfo;
+        costs[i] = (stat(files[i],&fileinfo) == 0) ? (double)fileinfo.st_size : 0.0;
+    }
+    ph_run_tasks(count,costs,threads,ph_video_slot_task,&slots);
+
+    for (int i=0;i<count;i++){
+        for (int j=0;slots.hashes[i] && j<slots.lengths[i];j++){
+            if (ph_hash_arena_add(results->arena,(const uint8_t*)&slots.hashes[i][j]) < 0){
+                ph_free_hash_results(results);
+                results = NULL;
+                goto cleanup;
+            }
+        }
+        results->offsets[i+1] = results->arena->count;
+    }
+    if (_ph_hash_results_set_owners(results) < 0){
+        ph_free_hash_results(results);
+        results = NULL;
+    }
+
+cleanup:
+    for (int i=0;slots.hashes && i<count;i++)
+        free(slots.hashes[i]);
+    free(costs);
+    free(slots.hashes);
+    free(slots.lengths);
+    return results;
+}
+#endif
@@ -74,8 +74,8 @@ using namespace std;
 #define ROUNDING_FACTOR(x) (((x) >= 0) ? 0.5 : -0.5) 
 
 #ifndef _WIN32
-typedef unsigned _uint64 ulong64;
-typedef signed _int64 long64;
+typedef unsigned long long ulong64;
+typedef signed long long long64;
 #else
 typedef unsigned long long ulong64;
 typedef signed long long long64;
@@ -154,6 +154,19 @@ typedef struct ph_projections {
 }Projections;
 #endif
 
+/*! /brief decoded luma image shared by the image hashes
+ *  The scaled variants are computed on first use and reused by every
+ *  hash that needs them. Not safe to share between threads.
+ */
+#ifdef HAVE_IMAGE_HASH
+typedef struct ph_luma_image {
+    CImg<uint8_t> *luma;        //full resolution luma channel
+    CImg<float> *dct32;         //7x7 mean filtered 32x32, input of the dct hash
+    CImg<uint8_t> *mh512;       //blurred, equalized 512x512, input of the mh hash
+    CImg<uint8_t> *bmb256;      //256x256, input of the bmb hash
+}LumaImage;
+#endif
+
 /*! /brief feature vector info
  */
 typedef struct ph_feature_vector {
@@ -190,6 +203,24 @@ typedef struct ph_match{
 
 #ifdef HAVE_PTHREAD
 int ph_num_threads();
+
+/* task run by ph_run_tasks, called from a worker thread */
+typedef void (*ph_task_func)(int index, void *arg);
+
+/* called from a worker thread for every finished hash of the batch functions */
+typedef void (*ph_hash_callback)(DP *dp, void *cookie);
+
+/** /brief run count tasks on a work stealing thread pool
+ *  Tasks are started in order of decreasing cost and spread over per thread
+ *  deques; an idle thread steals from the others until all are done.
+ *  /param count - int number of tasks
+ *  /param costs - double array of estimated cost per task (NULL to keep index order)
+ *  /param threads - int number of threads (0 for one per cpu)
+ *  /param func - ph_task_func called once for each index in [0,count)
+ *  /param arg - passed to func
+ *  /return int value - less than 0 for error
+ **/
+int ph_run_tasks(int count, const double *costs, int threads, ph_task_func func, void *arg);
 #endif
 
 /* /brief alloc a single data point
@@ -256,6 +287,55 @@ int ph_crosscorr(const Digest &x,const Digest &y,double &pcc, double threshold =
  */
 int _ph_image_digest(const CImg<uint8_t> &img,double sigma, double gamma,Digest &digest,int N=180);
 
+/*! /brief luma image
+ *  Decode an image file once into its luma channel.
+ *  /param file - string value for file name of input image
+ *  /param luma - (out) LumaImage, release with ph_luma_free
+ *  /return int value - less than 0 for error
+ */
+int ph_luma_load(const char *file, LumaImage &luma);
+
+/*! /brief luma image
+ *  Decode an in-memory JPEG file once into its luma channel.
+ *  /param buffer - byte array holding the encoded file
+ *  /param length - size_t length of buffer
+ *  /param luma - (out) LumaImage, release with ph_luma_free
+ *  /return int value - less than 0 for error
+ */
+int ph_luma_load_buffer(const uint8_t *buffer, size_t length, LumaImage &luma);
+
+/*! /brief luma image
+ *  Build a luma image from an already decoded image.
+ *  /param img - CImg object of the input image
+ *  /param luma - (out) LumaImage, release with ph_luma_free
+ *  /return int value - less than 0 for error
+ */
+int ph_luma_image(const CImg<uint8_t> &img, LumaImage &luma);
+
+/*! /brief luma image
+ *  Build a luma image from 8 bit luma pixels, e.g. a stored thumbnail.
+ *  /param pixels - byte array of width*height pixels, row by row
+ *  /param width - int width of the image
+ *  /param height - int height of the image
+ *  /param luma - (out) LumaImage, release with ph_luma_free
+ *  /return int value - less than 0 for error
+ */
+int ph_luma_pixels(const uint8_t *pixels, int width, int height, LumaImage &luma);
+
+/*! /brief reduce a luma image to a thumbnail
+ *  Scales the luma down by area averaging so that its longer side is at most size,
+ *  keeping the aspect ratio. Smaller images are left alone, so reducing a thumbnail
+ *  again changes nothing.
+ *  /param luma - LumaImage to reduce in place
+ *  /param size - int longest side
+ *  /return int value - less than 0 for error
+ */
+int ph_luma_thumbnail(LumaImage &luma, int size);
+
+/*! /brief free the images held by a LumaImage
+ */
+void ph_luma_free(LumaImage &luma);
+
 /*! /brief image digest
  *  Compute the image digest given the file name.
  *  /param file - string value for file name of input image.
@@ -266,6 +346,13 @@ int _ph_image_digest(const CImg<uint8_t> &img,double sigma, double gamma,Digest
  */
 int ph_image_digest(const char *file, double sigma, double gamma, Digest &digest,int N=180);
 
+/*! /brief image digest
+ *  Compute the image digest of an in-memory JPEG file.
+ *  /param buffer - byte array holding the encoded file
+ *  /param length - size_t length of buffer
+ */
+int ph_image_digest_buffer(const uint8_t *buffer, size_t length, double sigma, double gamma, Digest &digest,int N=180);
+
 
 /*! /brief compare 2 images
  *  /param imA - CImg object of first image 
@@ -306,21 +393,201 @@ static CImg<float>* ph_dct_matrix(const int N);
 int ph_dct_imagehash(const char* file,ulong64 &hash);
 
 int ph_bmb_imagehash(const char *file, uint8_t method, BinHash **ret_hash);
+
+/* same hashes computed from an in-memory JPEG file */
+int ph_dct_imagehash_buffer(const uint8_t *buffer, size_t length, ulong64 &hash);
+
+int ph_bmb_imagehash_buffer(const uint8_t *buffer, size_t length, uint8_t method, BinHash **ret_hash);
+
+/* same hashes computed from a decoded LumaImage */
+int _ph_dct_imagehash(LumaImage &luma,ulong64 &hash);
+
+/* the 8x8 low frequency dct coefficients the dct hash thresholds, see ph_dct_coeffs_hash */
+int _ph_dct_coeffs(LumaImage &luma, float *coeffs);
+
+int _ph_bmb_imagehash(LumaImage &luma, uint8_t method, BinHash **ret_hash);
 #endif
 
 #ifdef HAVE_PTHREAD
-DP** ph_dct_image_hashes(char *files[], int count, int threads = 0);
+/** /brief dct hashes of many image files, largest files first
+ *  /param callback - ph_hash_callback called as each hash finishes (may be NULL)
+ *  /param cookie - passed to callback
+ *  /return array of count DP pointers in the order of files (NULL for error)
+ **/
+DP** ph_dct_image_hashes(char *files[], int count, int threads = 0, ph_hash_callback callback = NULL, void *cookie = NULL);
+#endif
+
+#ifdef HAVE_IMAGE_HASH
+/*! /brief source of video frames, read one at a time
+ */
+typedef struct ph_frame_source {
+    /* decode the next frame, return 1 for a frame, 0 at the end, less than 0 for error */
+    int (*next_frame)(struct ph_frame_source *src, CImg<uint8_t> &frame);
+    void (*close)(struct ph_frame_source *src);
+    void *state;
+} FrameSource;
+
+/* called for each keyframe hash as ph_dct_videohash_stream finds it */
+typedef void (*ph_frame_hash_callback)(ulong64 hash, int frame_index, void *cookie);
+
+/** /brief frame source over the image files of a directory, in file name order
+ *  /param dirname - path of the directory
+ *  /param step - int, use every step-th file
+ *  /return FrameSource* (NULL for error), release with ph_frame_source_close
+ **/
+FrameSource* ph_image_sequence_source(const char *dirname, int step = 1);
+
+/** /brief close a frame source and free it
+ **/
+void ph_frame_source_close(FrameSource *src);
+
+/** /brief dct video hash, streamed
+ *  Reads the frames one at a time, detects shots on downsampled frames and
+ *  hashes one keyframe per shot, in constant memory.
+ *  /param src - FrameSource
+ *  /param callback - ph_frame_hash_callback called for every keyframe hash
+ *  /param cookie - passed to callback
+ *  /return int number of hashes, less than 0 for error
+ **/
+int ph_dct_videohash_stream(FrameSource *src, ph_frame_hash_callback callback, void *cookie);
+
+/** /brief dct video hash of a frame source, collected into an array
+ *  /param Length - (out) int number of hashes
+ *  /return ulong64 array (NULL for error)
+ **/
+ulong64* ph_dct_videohash_source(FrameSource *src, int &Length);
 #endif
 
 #ifdef HAVE_VIDEO_HASH
 static CImgList<uint8_t>* ph_getKeyFramesFromVideo(const char *filename);
 
+/** /brief frame source decoding a video file, every half second
+ **/
+FrameSource* ph_video_source(const char *filename);
+
 ulong64* ph_dct_videohash(const char *filename, int &Length);
 
-DP** ph_dct_video_hashes(char *files[], int count, int threads = 0);
+DP** ph_dct_video_hashes(char *files[], int count, int threads = 0, ph_hash_callback callback = NULL, void *cookie = NULL);
+#endif
 
+/*! /brief similarity of two video hashes
+ *  Longest common subsequence of the keyframe hashes, frames matching when
+ *  within threshold bits, divided by the length of the shorter video.
+ *  /return double value in [0,1], less than 0 for error
+ */
 double ph_dct_videohash_dist(ulong64 *hashA, int N1, ulong64 *hashB, int N2, int threshold=21);
-#endif
+
+/* inverted index over the keyframe hashes of a video collection */
+typedef struct ph_video_index VideoIndex;
+
+/* a video matching a clip */
+typedef struct ph_video_match {
+    int video;                  //index of the video in the VideoIndex
+    const char *id;             //id of the video, owned by the index
+    int offset;                 //keyframe of the video aligned with the clip start
+    int votes;                  //number of clip frames voting for this alignment
+    double similarity;          //ph_dct_videohash_dist of clip and video
+} VideoMatch;
+
+/** /brief alloc an empty video index
+ *  /param nb_chunks - int number of substrings each 64-bit hash is split into (1,2,4 or 8)
+ *  /return VideoIndex* (NULL for error)
+ **/
+VideoIndex* ph_video_index_new(int nb_chunks = 4);
+
+void ph_video_index_free(VideoIndex *index);
+
+/** /brief add the keyframe hashes of a video
+ *  /return int index of the video, less than 0 for error
+ **/
+int ph_video_index_add(VideoIndex *index, const char *id, const ulong64 *hashes, int N);
+
+/** /brief number of videos in the index
+ **/
+int ph_video_index_size(const VideoIndex *index);
+
+/** /brief find the videos containing a clip
+ *  Clip frames vote for (video, offset) through the substring tables, and
+ *  only the best voted candidates get the full sequence distance.
+ *  /param clip - keyframe hashes of the clip
+ *  /param N - int number of clip hashes
+ *  /param nbmatches - (out) int number of matches returned
+ *  /param max_results - int maximum number of matches returned
+ *  /param threshold - int hamming distance for two frames to match
+ *  /param probe_radius - int bits (0-2) flipped per substring when probing
+ *  /param candidates - int number of voted videos to verify
+ *  /return VideoMatch array by decreasing similarity, free with free() (NULL if none)
+ **/
+VideoMatch* ph_video_index_query(const VideoIndex *index, const ulong64 *clip, int N, int *nbmatches,
+                                 int max_results = 10, int threshold = 21, int probe_radius = 1, int candidates = 50);
+
+/* bit-sampling LSH index over equal length binary hashes (MH, BMB, ...) */
+typedef struct ph_lsh_index LSHIndex;
+
+/* a hash found by ph_lsh_index_query */
+typedef struct ph_lsh_match {
+    int id;                     //index of the hash in the LSHIndex, in order of ph_lsh_index_add
+    int distance;               //hamming distance to the query in bits
+} LSHMatch;
+
+/** /brief alloc an empty LSH index
+ *  More tables raise recall and memory, more bits per table make buckets
+ *  smaller and queries faster at lower recall.
+ *  /param hash_length - uint32_t length in bytes of the hashes
+ *  /param nb_tables - int number of hash tables
+ *  /param bits_per_table - int number of sampled bits keying each table (1-32)
+ *  /param seed - unsigned int seed of the sampled bit positions
+ *  /return LSHIndex* (NULL for error)
+ **/
+LSHIndex* ph_lsh_index_new(uint32_t hash_length, int nb_tables = 8, int bits_per_table = 16, unsigned int seed = 0);
+
+void ph_lsh_index_free(LSHIndex *index);
+
+/** /brief append a hash, searchable after the next ph_lsh_index_build
+ *  /return int id of the hash, less than 0 for error
+ **/
+int ph_lsh_index_add(LSHIndex *index, const uint8_t *hash);
+
+/** /brief number of hashes added
+ **/
+int ph_lsh_index_size(const LSHIndex *index);
+
+/** /brief (re)build the bucket tables over all added hashes
+ *  /return int value - less than 0 for error
+ **/
+int ph_lsh_index_build(LSHIndex *index);
+
+/** /brief closest hashes among the candidates of the probed buckets
+ *  /param hash - byte array of the index hash length
+ *  /param k - int maximum number of matches returned
+ *  /param probes - int buckets probed per table: the query's own, then those
+ *                  whose key differs by one, two or three sampled bits
+ *  /param max_distance - int largest distance returned, less than 0 for any
+ *  /param nbmatches - (out) int number of matches returned
+ *  /return LSHMatch array by increasing distance, free with free() (NULL if none)
+ **/
+LSHMatch* ph_lsh_index_query(const LSHIndex *index, const uint8_t *hash, int k, int probes, int max_distance,
+                             int *nbmatches);
+
+/** /brief dct hash of a block of coefficients
+*   The 64 coefficients are the 8x8 lowest frequencies of the dct image hash but the DC term,
+*   row by row: coeffs[8*v + u] has vertical frequency v+1 and horizontal frequency u+1.
+*   Bit i of the hash is set when coeffs[i] is above the median.
+*   /param coeffs - float array of 64 coefficients
+*   /return ulong64 hash, equal to ph_dct_imagehash of the image the coefficients come from
+**/
+ulong64 ph_dct_coeffs_hash(const float *coeffs);
+
+/** /brief dct hashes of the 8 flips and rotations of an image, from its coefficients
+*   Mirroring an image negates its odd horizontal (or vertical) frequencies and transposing
+*   it transposes the coefficient block, so the hashes of all dihedral variants follow from
+*   the stored coefficients without decoding the image again.
+*   /param coeffs - float array of 64 coefficients, see ph_dct_coeffs_hash
+*   /param hashes - (out) ulong64 array of 8 hashes: identity, horizontal flip, vertical flip,
+*                   rotation by 180, then the same four of the transposed image (transpose,
+*                   clockwise rotation by 90, by 270, anti-transpose)
+**/
+void ph_dct_dihedral_hashes(const float *coeffs, ulong64 *hashes);
 
 /* ! /brief dct video robust hash
  *   Compute video hash based on the dct of normalized video 32x32x64 cube
@@ -341,6 +608,9 @@ int ph_hamming_distance(const ulong64 hash1,const ulong64 hash2);
 DP** ph_read_imagehashes(const char *dirname,int capacity, int &count);
 
 /** /brief create MH image hash for filename image
+*   Like the other image hashes, it is computed from the luma channel. Images with more than
+*   3 channels (RGBA, CMYK) are reduced to their first 3 before the YCbCr conversion; versions
+*   before LumaImage hashed their first channel only, so their stored MH hashes differ.
 *   /param filename - string name of image file
 *   /param N - (out) int value for length of image hash returned
 *   /param alpha - int scale factor for marr wavelet (default=2)
@@ -348,6 +618,66 @@ DP** ph_read_imagehashes(const char *dirname,int capacity, int &count);
 *   /return uint8_t array
 **/
 uint8_t* ph_mh_imagehash(const char *filename, int &N, float alpha=2.0f, float lvl = 1.0f);
+
+uint8_t* _ph_mh_imagehash(LumaImage &luma, int &N, float alpha=2.0f, float lvl = 1.0f);
+
+uint8_t* ph_mh_imagehash_buffer(const uint8_t *buffer, size_t length, int &N, float alpha=2.0f, float lvl = 1.0f);
+
+/* hash types computed by ph_image_hashes */
+#define PH_HASH_DCT    0x01
+#define PH_HASH_MH     0x02
+#define PH_HASH_BMB    0x04
+#define PH_HASH_DIGEST 0x08
+#define PH_HASH_DCT_COEFFS 0x10
+#define PH_HASH_THUMBNAIL 0x20
+#define PH_HASH_ALL    0x3f
+
+/* parameters of the individual image hashes */
+typedef struct ph_hash_params {
+    float mh_alpha;             //scale factor for marr wavelet
+    float mh_level;             //level of scale factor
+    uint8_t bmb_method;         //1 for disjoint, 2 for overlapping blocks
+    double sigma;               //deviation of gaussian filter for the digest
+    double gamma;               //gamma correction for the digest
+    int N;                      //number of angles for the digest
+    int thumbnail_size;         //longest side the luma is reduced to before hashing, 0 for none
+} HashParams;
+
+/* result of ph_image_hashes */
+typedef struct ph_image_hashes {
+    int which;                  //PH_HASH_* bits of the hashes computed
+    ulong64 dct;
+    float dct_coeffs[64];       //coefficients behind the dct hash (PH_HASH_DCT_COEFFS)
+    uint8_t *mh;
+    int mh_length;
+    BinHash *bmb;
+    Digest digest;
+    uint8_t *thumbnail;         //luma pixels the hashes were computed from (PH_HASH_THUMBNAIL)
+    int thumbnail_width;
+    int thumbnail_height;
+} ImageHashes;
+
+/** /brief default hash parameters, same as the defaults of the single hash functions
+**/
+HashParams ph_default_hash_params();
+
+/** /brief compute several image hashes with a single decode
+*   /param file - string name of image file
+*   /param which - int PH_HASH_* bits of the hashes to compute
+*   /param hashes - (out) ImageHashes, release with ph_free_image_hashes
+*   /param params - HashParams, NULL for defaults
+*   /return int value - less than 0 if any requested hash failed
+**/
+int ph_image_hashes(const char *file, int which, ImageHashes &hashes, const HashParams *params = NULL);
+
+int ph_image_hashes_buffer(const uint8_t *buffer, size_t length, int which, ImageHashes &hashes, const HashParams *params = NULL);
+
+/* luma is reduced to params->thumbnail_size first */
+int _ph_image_hashes(LumaImage &luma, int which, ImageHashes &hashes, const HashParams *params = NULL);
+
+/** /brief free the hashes held by an ImageHashes
+**/
+void ph_free_image_hashes(ImageHashes &hashes);
 #endif
 /** /brief count number bits set in given byte
 *   /param val - uint8_t byte value
@@ -364,6 +694,112 @@ int ph_bitcount8(uint8_t val);
  **/
 double ph_hammingdistance2(uint8_t *hashA, int lenA, uint8_t *hashB, int lenB);
 
+/* contiguous arena of equal length binary hashes (MH, BMB, ...)
+ * each hash is zero padded to stride bytes (a multiple of 8) and
+ * the buffer is 64-byte aligned for the popcount kernels.
+ */
+typedef struct ph_hash_arena {
+    uint8_t *data;              //count*stride bytes
+    uint32_t hash_length;       //length of one hash in bytes
+    uint32_t stride;            //bytes between consecutive hashes
+    int count;                  //number of hashes stored
+    int capacity;               //number of hashes allocated
+} HashArena;
+
+/** /brief alloc an empty hash arena
+ *  /param hash_length - uint32_t length in bytes of each hash
+ *  /param capacity - int number of hashes to reserve space for
+ *  /return HashArena* (NULL for error)
+ **/
+HashArena* ph_hash_arena_new(uint32_t hash_length, int capacity);
+
+/** /brief free a hash arena and its data
+ **/
+void ph_hash_arena_free(HashArena *arena);
+
+/** /brief append a hash to the arena, growing it if needed
+ *  /param arena - HashArena
+ *  /param hash - byte array of arena->hash_length bytes
+ *  /return int index of the hash in the arena, -1 for error
+ **/
+int ph_hash_arena_add(HashArena *arena, const uint8_t *hash);
+
+/** /brief pointer to the i-th hash of the arena
+ **/
+const uint8_t* ph_hash_arena_at(const HashArena *arena, int i);
+
+/** /brief number of differing bits between two byte arrays of equal length
+ *  /param hashA - byte array for first hash
+ *  /param hashB - byte array for second hash
+ *  /param len - uint32_t length in bytes of both hashes
+ *  /return int hamming distance in bits
+ **/
+int ph_hamming_distance_bytes(const uint8_t *hashA, const uint8_t *hashB, uint32_t len);
+
+/** /brief hamming distances of one query against a range of an arena
+ *  Uses AVX2 or POPCNT when the cpu supports them.
+ *  /param query - byte array of arena->hash_length bytes
+ *  /param arena - HashArena of candidates
+ *  /param start - int index of first candidate
+ *  /param count - int number of candidates
+ *  /param dists - (out) int array of count distances in bits
+ *  /return int number of distances computed, -1 for error
+ **/
+int ph_hamming_distances(const uint8_t *query, const HashArena *arena, int start, int count, int *dists);
+
+/* results of a batch hash, held in a few contiguous arrays and freed at once
+ * with ph_free_hash_results. The arena can be passed straight to
+ * ph_hamming_distances.
+ */
+typedef struct ph_hash_results {
+    int count;                  //number of input files
+    HashArena *arena;           //all hashes of all files
+    int *offsets;               //hashes of file i are arena entries [offsets[i], offsets[i+1])
+    int *owners;                //file index of each arena entry
+    uint32_t *id_offsets;       //id of file i is the string at ids + id_offsets[i]
+    char *ids;                  //interned pool of nul terminated ids
+} HashResults;
+
+/** /brief free a HashResults and everything it holds
+ **/
+void ph_free_hash_results(HashResults *results);
+
+/** /brief id (file name) of the i-th file of a HashResults
+ **/
+const char* ph_hash_results_id(const HashResults *results, int i);
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_IMAGE_HASH)
+/** /brief dct hashes of many image files into a HashResults
+ *  one 8 byte arena entry per successfully hashed file.
+ *  /return HashResults* (NULL for error)
+ **/
+HashResults* ph_dct_image_hash_results(char *files[], int count, int threads = 0);
+#endif
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_VIDEO_HASH)
+/** /brief dct hashes of many video files into a HashResults
+ *  one 8 byte arena entry per keyframe.
+ *  /return HashResults* (NULL for error)
+ **/
+HashResults* ph_dct_video_hash_results(char *files[], int count, int threads = 0);
+#endif
+
+/** /brief peak cross correlations of one radial digest against many
+ *  Same values as ph_crosscorr, with the query centered once for the batch.
+ *  /param query - uint8_t array of size coefficients
+ *  /param digests - uint8_t array of count digests of size coefficients, one after the other
+ *  /param size - int number of coefficients of each digest
+ *  /param count - int number of digests
+ *  /param pcc - (out) double array of count peak correlations
+ *  /return int number of correlations computed, -1 for error
+ **/
+int ph_crosscorr_batch(const uint8_t *query, const uint8_t *digests, int size, int count, double *pcc);
+
+/** /brief hamming distance between two bmb hashes
+ *  /return int value for number of differing bits, -1 for error
+ **/
+int ph_bmb_distance(const BinHash *bh1, const BinHash *bh2);
+
 /** /brief get all the filenames in specified directory
  *  /param dirname - string value for path and filename
  *  /param cap - int value for upper limit to number of files
@@ -375,13 +811,26 @@ char** ph_readfilenames(const char *dirname,int &count);
 
 
 /** /brief textual hash for file
+ *  Winnowing: the rightmost minimum kgram hash of every window of
+ *  WindowLength kgrams is a fingerprint, each kept once.
  *  /param filename - char* name of file
  *  /param nbpoints - int length of array of return value (out)
  *  /return TxtHashPoint* array of hash points with respective index into file.
  **/
 TxtHashPoint* ph_texthash(const char *filename, int *nbpoints);
 
+/** /brief textual hash of a text held in memory
+ *  /param buffer - char array of the text
+ *  /param length - size_t length of buffer
+ *  /param nbpoints - int length of array of return value (out)
+ *  /return TxtHashPoint* array of hash points with respective index into buffer.
+ **/
+TxtHashPoint* ph_texthash_buffer(const char *buffer, size_t length, int *nbpoints);
+
 /** /brief compare 2 text hashes
+ *  Joins the fingerprints through a hash table built on the smaller hash
+ *  and reports each maximal run of consecutive equal fingerprints once,
+ *  ordered by first_index. Indices are positions in hash1 and hash2.
  *  /param hash1 -TxtHashPoint
  *  /param N1 - int length of hash1
  *  /param hash2 - TxtHashPoint
@@ -391,6 +840,68 @@ TxtHashPoint* ph_texthash(const char *filename, int *nbpoints);
  **/
 TxtMatch* ph_compare_text_hashes(TxtHashPoint *hash1, int N1, TxtHashPoint *hash2, int N2, int *nbmatches);
 
+#ifndef _WIN32
+/* persistent inverted index from text fingerprints to (document, offset),
+   memory mapped read-only */
+typedef struct ph_text_index TextIndex;
+
+/* a document sharing fingerprints with a query text */
+typedef struct ph_text_hit {
+    int doc;                    //index of the document in the TextIndex
+    const char *id;             //id of the document, owned by the index
+    int shared;                 //number of distinct query fingerprints in the document
+    double score;               //shared divided by the number of distinct query fingerprints
+} TextHit;
+
+#ifdef HAVE_PTHREAD
+/** /brief build a text index file from many text files
+ *  The files are hashed in parallel with ph_texthash; document i is files[i].
+ *  /param files - char** names of the text files, used as document ids
+ *  /param count - int number of files
+ *  /param filename - const char* name of the index file, replaced atomically through filename.tmp
+ *  /param threads - int number of threads (0 for the number of cores)
+ *  /return int value - less than 0 for error
+ **/
+int ph_text_index_build(char *files[], int count, const char *filename, int threads = 0);
+#endif
+
+/** /brief map an index file written by ph_text_index_build
+ *  Only the header and the section layout are checked here, so opening
+ *  does not read the postings; they are bounds-checked as they are used.
+ *  /return TextIndex* (NULL for error)
+ **/
+TextIndex* ph_text_index_open(const char *filename);
+
+void ph_text_index_close(TextIndex *index);
+
+/** /brief number of documents in the index
+ **/
+int ph_text_index_size(const TextIndex *index);
+
+/** /brief id (file name) of a document
+ **/
+const char* ph_text_index_id(const TextIndex *index, int doc);
+
+/** /brief postings of one fingerprint, ordered by document then offset
+ *  /param docs - (out) const uint32_t* documents, pointing into the index
+ *  /param offsets - (out) const uint64_t* byte offsets, pointing into the index
+ *  /return int number of postings, less than 0 for error or a corrupt posting list
+ **/
+int ph_text_index_postings(const TextIndex *index, ulong64 hash, const uint32_t **docs, const uint64_t **offsets);
+
+/** /brief documents sharing the most fingerprints with a text hash
+ *  Candidates for ph_compare_text_hashes.
+ *  /param hashes - TxtHashPoint* hash of the query text
+ *  /param N - int length of hashes
+ *  /param nbhits - (out) int number of hits returned
+ *  /param max_results - int maximum number of hits returned
+ *  /param min_shared - int minimum number of shared fingerprints of a hit
+ *  /return TextHit array by decreasing shared, free with free() (NULL if none)
+ **/
+TextHit* ph_text_index_query(const TextIndex *index, const TxtHashPoint *hashes, int N, int *nbhits,
+                             int max_results = 10, int min_shared = 1);
+#endif
+
 /* random char mapping for textual hash */
 
 static const ulong64 textkeys[256] = {
@@ -0,0 +1,439 @@
+#include "server.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+std::atomic<bool> stopRequested(false);
+
+void onStopSignal(int)
+{
+    stopRequested = true;
+}
+
+/**
+ * Connections accepted but not yet picked up by a worker, and the ones being served.
+ */
+class ConnectionQueue
+{
+public:
+    void push(int fd)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(fd);
+        }
+        ready.notify_one();
+    }
+
+    // Blocks until a connection is pending; returns -1 once closed.
+    int pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return closed || !pending.empty(); });
+        if (pending.empty())
+        {
+            return -1;
+        }
+        const int fd = pending.front();
+        pending.pop_front();
+        active.insert(fd);
+        return fd;
+    }
+
+    void done(int fd)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        active.erase(fd);
+        close(fd);
+    }
+
+    // Wakes all workers and ends the connections in progress.
+    void closeAll()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            for (int fd : pending)
+            {
+                close(fd);
+            }
+            pending.clear();
+            for (int fd : active)
+            {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+        ready.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<int> pending;
+    std::set<int> active;
+    bool closed = false;
+};
+
+bool sendAll(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        const ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void appendMatches(const ImageIndex &index, const std::vector<ImageMatch> &matches, std::string &body)
+{
+    for (const ImageMatch &match : matches)
+    {
+        body += std::to_string(match.distance);
+        body += ' ';
+        body += index.filename(match.image);
+        body += '\n';
+    }
+}
+
+/**
+ * Runs one request line. Returns false with an error message for malformed requests.
+ */
+bool runRequest(const ImageIndex &index, const std::string &line, size_t &count, std::string &body, std::string &error)
+{
+    std::istringstream request(line);
+    std::string command;
+    request >> command;
+
+    if (command == "exact")
+    {
+        std::string md5;
+        if (!(request >> md5))
+        {
+            error = "usage: exact <md5>";
+            return false;
+        }
+        const std::vector<uint32_t> images = index.findFileHash(md5);
+        for (uint32_t image : images)
+        {
+            body += "0 ";
+            body += index.filename(image);
+            body += '\n';
+        }
+        count = images.size();
+        return true;
+    }
+
+    if (command == "within" || command == "nearest")
+    {
+        std::string kindName;
+        std::string hex;
+        long long parameter = -1;
+        HashKind kind;
+        std::vector<uint8_t> hash;
+        if (!(request >> kindName >> hex >> parameter) || parameter < 0)
+        {
+            error = "usage: " + command + " <dct|mh|bmb> <hex> <" + (command == "within" ? "radius>" : "k>");
+            return false;
+        }
+        if (!parseHashKind(kindName, kind))
+        {
+            error = "unknown hash kind " + kindName;
+            return false;
+        }
+        // Several hashes, e.g. of the orientations of an image, are searched at once.
+        std::vector<uint8_t> hashes;
+        std::istringstream list(hex);
+        int hashCount = 0;
+        while (std::getline(list, hex, ','))
+        {
+            if (!parseHash(kind, hex, hash) || hash.size() != index.hashLength(kind))
+            {
+                error = "invalid " + kindName + " hash";
+                return false;
+            }
+            hashes.insert(hashes.end(), hash.begin(), hash.end());
+            ++hashCount;
+        }
+        if (hashCount == 0)
+        {
+            error = "invalid " + kindName + " hash";
+            return false;
+        }
+
+        const std::vector<ImageMatch> matches =
+            command == "within"
+                ? index.findWithinAny(kind, hashes.data(), hashCount, static_cast<int>(std::min(parameter, 1LL << 20)))
+                : index.findNearestAny(kind, hashes.data(), hashCount, static_cast<size_t>(parameter));
+        appendMatches(index, matches, body);
+        count = matches.size();
+        return true;
+    }
+
+    if (command == "cascade")
+    {
+        std::string kindName;
+        std::string hex;
+        std::string digestHex;
+        long long k = -1;
+        HashKind kind;
+        std::vector<uint8_t> hash;
+        std::vector<uint8_t> digest;
+        if (!(request >> kindName >> hex >> digestHex >> k) || k < 0)
+        {
+            error = "usage: cascade <dct|mh|bmb> <hex> <digest hex> <k>";
+            return false;
+        }
+        if (!parseHashKind(kindName, kind) || !parseHash(kind, hex, hash) || hash.size() != index.hashLength(kind))
+        {
+            error = "invalid " + kindName + " hash";
+            return false;
+        }
+        if (!parseHex(digestHex, digest) || digest.size() != static_cast<size_t>(index.digestSize()))
+        {
+            error = "invalid digest";
+            return false;
+        }
+
+        const std::vector<CascadeMatch> matches =
+            index.findCascade(kind, hash.data(), digest.data(), static_cast<size_t>(k));
+        char correlation[32];
+        for (const CascadeMatch &match : matches)
+        {
+            snprintf(correlation, sizeof(correlation), "%.4f ", match.correlation);
+            body += correlation;
+            body += std::to_string(match.distance);
+            body += ' ';
+            body += index.filename(match.image);
+            body += '\n';
+        }
+        count = matches.size();
+        return true;
+    }
+
+    error = "unknown request " + command;
+    return false;
+}
+
+void serveConnection(const ImageIndex &index, int fd, bool verbose)
+{
+    std::string buffer;
+    char chunk[4096];
+    for (;;)
+    {
+        size_t newline;
+        while ((newline = buffer.find('\n')) == std::string::npos)
+        {
+            const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return;
+            }
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+        std::string line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (line.empty())
+        {
+            continue;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        size_t count = 0;
+        std::string body;
+        std::string error;
+        const bool ok = runRequest(index, line, count, body, error);
+        const auto micros =
+            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        const std::string response = ok ? "ok " + std::to_string(count) + " " + std::to_string(micros) + "\n" + body
+                                        : "error " + error + "\n";
+        if (verbose)
+        {
+            std::ostringstream log;
+            log << line << " -> " << (ok ? std::to_string(count) + " results" : error) << " in " << micros << " us\n";
+            std::clog << log.str() << std::flush;
+        }
+        if (!sendAll(fd, response))
+        {
+            return;
+        }
+    }
+}
+
+} // namespace
+
+int serveQueries(const ImageIndex &index, const std::string &socketPath, int threads, bool verbose)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Invalid socket path " << socketPath << std::endl;
+        return 1;
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        std::cerr << "socket: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    unlink(socketPath.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listener, 64) < 0)
+    {
+        std::cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << std::endl;
+        close(listener);
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onStopSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    if (threads <= 0)
+    {
+        threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    ConnectionQueue connections;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i)
+    {
+        workers.emplace_back([&index, &connections, verbose] {
+            int fd;
+            while ((fd = connections.pop()) >= 0)
+            {
+                serveConnection(index, fd, verbose);
+                connections.done(fd);
+            }
+        });
+    }
+
+    std::clog << "Serving " << index.size() << " images on " << socketPath << " with " << threads << " threads"
+              << std::endl;
+
+    // Poll with a timeout so that a stop signal is noticed even when no client connects.
+    pollfd listening = {listener, POLLIN, 0};
+    while (!stopRequested)
+    {
+        const int ready = poll(&listening, 1, 200);
+        if (ready <= 0)
+        {
+            continue;
+        }
+        const int fd = accept(listener, nullptr, nullptr);
+        if (fd >= 0)
+        {
+            connections.push(fd);
+        }
+    }
+
+    close(listener);
+    unlink(socketPath.c_str());
+    connections.closeAll();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    std::clog << "Server stopped." << std::endl;
+    return 0;
+}
+
+bool requestServer(const std::string &socketPath, const std::string &request, std::string &header,
+                   std::vector<std::string> &lines)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || !sendAll(fd, request + "\n"))
+    {
+        close(fd);
+        return false;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // The server answers the single request and sees the end of the connection.
+    std::string response;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = recv(fd, chunk, sizeof(chunk), 0)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+        response.append(chunk, static_cast<size_t>(n));
+    }
+    close(fd);
+
+    std::istringstream answer(response);
+    if (!std::getline(answer, header))
+    {
+        return false;
+    }
+    lines.clear();
+    std::string line;
+    while (std::getline(answer, line))
+    {
+        lines.push_back(line);
+    }
+    return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "imageindex.h"
+
+/**
+ * Answers queries against index on a Unix domain socket until SIGINT or SIGTERM.
+ *
+ * The protocol is line based. Each request is one line, answered by a header line
+ * "ok <count> <microseconds>" followed by count lines "<distance> <filename>", or by one line
+ * "error <message>". Requests:
+ *
+ *   exact <md5>                      images with this file content hash
+ *   within <dct|mh|bmb> <hex> <r>    images within r bits of the hash
+ *   nearest <dct|mh|bmb> <hex> <k>   the k closest images
+ *                                    within and nearest also take several comma separated hashes,
+ *                                    and use the distance to the closest one
+ *   cascade <dct|mh|bmb> <hex> <digest hex> <k>
+ *                                    the k images whose radial digest correlates best with the given
+ *                                    one, among those closest to the hash; result lines are
+ *                                    "<correlation> <distance> <filename>"
+ *
+ * A client may send any number of requests on one connection. Connections are served by a pool of
+ * threads; threads = 0 uses one per core.
+ *
+ * Returns the process exit code.
+ */
+int serveQueries(const ImageIndex &index, const std::string &socketPath, int threads, bool verbose);
+
+/**
+ * Sends one request to a server listening on socketPath and reads its answer: the header line, and the
+ * result lines if the header is "ok". Returns false if no server answers.
+ */
+bool requestServer(const std::string &socketPath, const std::string &request, std::string &header,
+                   std::vector<std::string> &lines);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+
+/**
+ * Minimal test registry: TEST(name) defines a test that tests/main.cpp runs by name, CHECK counts and
+ * reports a failed condition without stopping the test.
+ */
+struct TestCase
+{
+    const char *name;
+    void (*run)();
+};
+
+std::vector<TestCase> &testCases();
+int &testFailures();
+
+struct TestRegistration
+{
+    TestRegistration(const char *name, void (*run)()) { testCases().push_back({name, run}); }
+};
+
+#define TEST(name)                                                                                                     \
+    static void name();                                                                                                \
+    static TestRegistration name##Registration(#name, name);                                                           \
+    static void name()
+
+#define CHECK(condition)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(condition))                                                                                              \
+        {                                                                                                              \
+            ++testFailures();                                                                                          \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl;                 \
+        }                                                                                                              \
+    } while (0)
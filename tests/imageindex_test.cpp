@@ -0,0 +1,335 @@
+#include "check.h"
+
+#include "imageindex.h"
+
+#include <SQLiteCpp/Statement.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <map>
+#include <numeric>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+const int imageCount = 6000;
+
+/**
+ * Synthetic library: random DCT coefficient blocks, a third of them noisy copies of an earlier block in
+ * one of the 8 orientations, so that there are near-duplicates at all distances and orientations.
+ */
+struct Library
+{
+    std::vector<std::array<float, 64>> coeffs;
+    std::vector<ulong64> hashes;
+    std::vector<std::array<ulong64, 8>> orientations;
+    SQLite::Database db;
+
+    Library() : coeffs(imageCount), hashes(imageCount), orientations(imageCount), db(":memory:", SQLite::OPEN_READWRITE)
+    {
+        std::mt19937 random(7);
+        std::normal_distribution<float> gauss(0, 1);
+        for (int i = 0; i < imageCount; ++i)
+        {
+            if (i == 0 || random() % 3 != 0)
+            {
+                for (float &c : coeffs[i])
+                {
+                    c = gauss(random);
+                }
+                continue;
+            }
+            // Same sign rule as ph_dct_dihedral_hashes
+            const int source = static_cast<int>(random() % i);
+            const int k = static_cast<int>(random() % 8);
+            for (int y = 0; y < 8; ++y)
+            {
+                for (int x = 0; x < 8; ++x)
+                {
+                    float c = k >> 2 ? coeffs[source][8 * x + y] : coeffs[source][8 * y + x];
+                    if (((k & 1) && (x & 1) == 0) != ((k & 2) && (y & 1) == 0))
+                    {
+                        c = -c;
+                    }
+                    coeffs[i][8 * y + x] = c + 0.15f * gauss(random);
+                }
+            }
+        }
+
+        db.exec("CREATE TABLE images (id INTEGER PRIMARY KEY, filename TEXT, time TEXT, fileHash TEXT, "
+                "dctHash INTEGER, mhHash BLOB, bmbHash BLOB, digest BLOB, dctCoeffs BLOB, thumbOffset INTEGER)");
+        db.exec("BEGIN");
+        SQLite::Statement insert(db, "INSERT INTO images (filename, fileHash, dctHash, dctCoeffs) VALUES (?, ?, ?, ?)");
+        for (int i = 0; i < imageCount; ++i)
+        {
+            hashes[i] = ph_dct_coeffs_hash(coeffs[i].data());
+            ph_dct_dihedral_hashes(coeffs[i].data(), orientations[i].data());
+            insert.reset();
+            insert.bind(1, "image" + std::to_string(i));
+            insert.bind(2, std::to_string(i));
+            insert.bind(3, static_cast<long long>(hashes[i]));
+            insert.bind(4, coeffs[i].data(), static_cast<int>(sizeof(coeffs[i])));
+            insert.exec();
+        }
+        db.exec("COMMIT");
+    }
+
+    int distance(int a, int b) const { return __builtin_popcountll(hashes[a] ^ hashes[b]); }
+
+    int orientedDistance(int a, int b) const
+    {
+        int closest = 64;
+        for (ulong64 oriented : orientations[a])
+        {
+            closest = std::min(closest, __builtin_popcountll(oriented ^ hashes[b]));
+        }
+        return closest;
+    }
+};
+
+Library &library()
+{
+    static Library instance;
+    return instance;
+}
+
+/**
+ * Single linkage clusters of the edges within radius, by union-find over all pairs; each cluster sorted.
+ */
+std::vector<std::vector<uint32_t>> bruteForceClusters(const std::vector<std::array<int, 3>> &edges, int radius)
+{
+    std::vector<int> parent(imageCount);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto root = [&](int x) {
+        while (parent[x] != x)
+        {
+            x = parent[x] = parent[parent[x]];
+        }
+        return x;
+    };
+    for (const std::array<int, 3> &edge : edges)
+    {
+        if (edge[2] <= radius)
+        {
+            parent[root(edge[0])] = root(edge[1]);
+        }
+    }
+    std::map<int, std::vector<uint32_t>> groups;
+    for (int i = 0; i < imageCount; ++i)
+    {
+        groups[root(i)].push_back(static_cast<uint32_t>(i));
+    }
+    std::vector<std::vector<uint32_t>> clusters;
+    for (auto &group : groups)
+    {
+        if (group.second.size() > 1)
+        {
+            clusters.push_back(group.second);
+        }
+    }
+    return clusters;
+}
+
+/**
+ * The (image, distance) pairs of a result, by image.
+ */
+std::vector<std::pair<uint32_t, int>> byImage(const std::vector<ImageMatch> &matches)
+{
+    std::vector<std::pair<uint32_t, int>> pairs;
+    for (const ImageMatch &match : matches)
+    {
+        pairs.emplace_back(match.image, match.distance);
+    }
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+}
+
+} // namespace
+
+TEST(clusterDctMatchesBruteForce)
+{
+    Library &images = library();
+    ImageIndex index(images.db, PH_HASH_DCT | PH_HASH_DCT_COEFFS);
+    CHECK(index.hasDctOrientations());
+
+    std::vector<std::array<int, 3>> plainEdges;
+    std::vector<std::array<int, 3>> orientedEdges;
+    for (int a = 0; a < imageCount; ++a)
+    {
+        for (int b = 0; b < imageCount; ++b)
+        {
+            const int oriented = images.orientedDistance(a, b);
+            if (oriented <= ImageIndex::maxClusterRadius)
+            {
+                orientedEdges.push_back({a, b, oriented});
+            }
+            if (a < b && images.distance(a, b) <= ImageIndex::maxClusterRadius)
+            {
+                plainEdges.push_back({a, b, images.distance(a, b)});
+            }
+        }
+    }
+
+    for (int radius = 0; radius <= ImageIndex::maxClusterRadius; ++radius)
+    {
+        for (bool orientations : {false, true})
+        {
+            std::vector<std::vector<uint32_t>> expected =
+                bruteForceClusters(orientations ? orientedEdges : plainEdges, radius);
+            std::vector<std::vector<uint32_t>> clusters = index.clusterDct(radius, 4, orientations);
+            for (size_t i = 1; i < clusters.size(); ++i)
+            {
+                CHECK(clusters[i - 1].size() >= clusters[i].size());
+            }
+            std::sort(expected.begin(), expected.end());
+            std::sort(clusters.begin(), clusters.end());
+            CHECK(clusters == expected);
+        }
+    }
+}
+
+TEST(findWithinMatchesBruteForce)
+{
+    Library &images = library();
+    ImageIndex index(images.db, PH_HASH_DCT);
+    std::mt19937_64 random(2);
+    // Radii up to 11 are answered by probing the substring tables, larger ones by a scan.
+    for (int radius = 0; radius <= 20; ++radius)
+    {
+        for (int query = 0; query < 20; ++query)
+        {
+            ulong64 hash = images.hashes[random() % imageCount];
+            for (int flips = static_cast<int>(random() % (radius + 2)); flips > 0; --flips)
+            {
+                hash ^= 1ULL << (random() % 64);
+            }
+            std::vector<ImageMatch> expected;
+            for (int i = 0; i < imageCount; ++i)
+            {
+                const int distance = __builtin_popcountll(images.hashes[i] ^ hash);
+                if (distance <= radius)
+                {
+                    expected.push_back({static_cast<uint32_t>(i), distance});
+                }
+            }
+            const std::vector<ImageMatch> matches =
+                index.findWithin(HashKind::Dct, reinterpret_cast<const uint8_t *>(&hash), radius);
+            for (size_t i = 1; i < matches.size(); ++i)
+            {
+                CHECK(matches[i - 1].distance <= matches[i].distance);
+            }
+            CHECK(byImage(matches) == byImage(expected));
+        }
+    }
+}
+
+TEST(findNearestMatchesBruteForce)
+{
+    Library &images = library();
+    ImageIndex index(images.db, PH_HASH_DCT);
+    std::mt19937_64 random(4);
+    for (int query = 0; query < 200; ++query)
+    {
+        ulong64 hash = images.hashes[random() % imageCount] ^ (1ULL << (random() % 64));
+        const size_t k = 1 + random() % 30;
+        std::vector<int> distances;
+        for (ulong64 stored : images.hashes)
+        {
+            distances.push_back(__builtin_popcountll(stored ^ hash));
+        }
+        std::sort(distances.begin(), distances.end());
+        const std::vector<ImageMatch> matches =
+            index.findNearest(HashKind::Dct, reinterpret_cast<const uint8_t *>(&hash), k);
+        CHECK(matches.size() == k);
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            CHECK(matches[i].distance == distances[i]);
+            CHECK(matches[i].distance == __builtin_popcountll(images.hashes[matches[i].image] ^ hash));
+        }
+    }
+}
+
+TEST(anyOrientationMatchesBruteForce)
+{
+    Library &images = library();
+    ImageIndex index(images.db, PH_HASH_DCT);
+    std::mt19937 random(6);
+    for (int query = 0; query < 300; ++query)
+    {
+        const int a = static_cast<int>(random() % imageCount);
+        const uint8_t *hashes = reinterpret_cast<const uint8_t *>(images.orientations[a].data());
+        std::vector<int> distances(imageCount);
+        for (int b = 0; b < imageCount; ++b)
+        {
+            distances[b] = images.orientedDistance(a, b);
+        }
+
+        const std::vector<ImageMatch> within = index.findWithinAny(HashKind::Dct, hashes, 8, 10);
+        CHECK(within.size() ==
+              static_cast<size_t>(std::count_if(distances.begin(), distances.end(), [](int d) { return d <= 10; })));
+        for (const ImageMatch &match : within)
+        {
+            CHECK(match.distance == distances[match.image]);
+        }
+
+        const std::vector<ImageMatch> nearest = index.findNearestAny(HashKind::Dct, hashes, 8, 5);
+        std::vector<int> sorted = distances;
+        std::sort(sorted.begin(), sorted.end());
+        CHECK(nearest.size() == 5);
+        for (size_t i = 0; i < nearest.size(); ++i)
+        {
+            CHECK(nearest[i].distance == sorted[i]);
+            CHECK(nearest[i].distance == distances[nearest[i].image]);
+        }
+    }
+}
+
+TEST(fileHashFilterFalsePositiveRate)
+{
+    // Distinct MD5-like file hashes, enough for the index to build its Bloom filter
+    auto md5 = [](uint64_t n) {
+        char hex[33];
+        snprintf(hex, sizeof(hex), "%016llx%016llx", static_cast<unsigned long long>(n * 0x9e3779b97f4a7c15ULL),
+                 static_cast<unsigned long long>((n + 1) * 0xc2b2ae3d27d4eb4fULL));
+        return std::string(hex);
+    };
+    const uint64_t stored = ImageIndex::fileHashFilterMinImages;
+    SQLite::Database db(":memory:", SQLite::OPEN_READWRITE);
+    db.exec("CREATE TABLE images (id INTEGER PRIMARY KEY, filename TEXT, time TEXT, fileHash TEXT, "
+            "dctHash INTEGER, mhHash BLOB, bmbHash BLOB, digest BLOB, dctCoeffs BLOB, thumbOffset INTEGER)");
+    db.exec("BEGIN");
+    SQLite::Statement insert(db, "INSERT INTO images (filename, fileHash) VALUES (?, ?)");
+    for (uint64_t i = 0; i < stored; ++i)
+    {
+        insert.reset();
+        insert.bind(1, "image" + std::to_string(i));
+        insert.bind(2, md5(i));
+        insert.exec();
+    }
+    db.exec("COMMIT");
+    ImageIndex index(db, 0);
+
+    size_t missed = 0;
+    for (uint64_t i = 0; i < stored; ++i)
+    {
+        missed += !index.mayHaveFileHash(md5(i));
+    }
+    CHECK(missed == 0);
+    CHECK(index.findFileHash(md5(17)) == std::vector<uint32_t>{17});
+
+    const uint64_t queries = 1000000;
+    size_t passed = 0;
+    for (uint64_t i = stored; i < stored + queries; ++i)
+    {
+        passed += index.mayHaveFileHash(md5(i));
+    }
+    CHECK(index.findFileHash(md5(stored)).empty());
+    const double rate = static_cast<double>(passed) / queries;
+    std::cout << "file hash filter: " << passed << " of " << queries << " absent hashes pass (" << 100 * rate
+              << " %)" << std::endl;
+    // 16 bits and 6 probes per key in 512 bit blocks give about 0.1 %
+    CHECK(rate < 0.003);
+}
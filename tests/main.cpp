@@ -0,0 +1,45 @@
+#include "check.h"
+
+#include <cstring>
+
+std::vector<TestCase> &testCases()
+{
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+int &testFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+/**
+ * Runs the tests named on the command line, or all of them. Exits with 1 if a check failed.
+ */
+int main(int argc, char *argv[])
+{
+    int run = 0;
+    for (const TestCase &test : testCases())
+    {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i)
+        {
+            selected = selected || std::strcmp(argv[i], test.name) == 0;
+        }
+        if (!selected)
+        {
+            continue;
+        }
+        const int failures = testFailures();
+        test.run();
+        std::cout << (testFailures() == failures ? "ok   " : "FAIL ") << test.name << std::endl;
+        ++run;
+    }
+    if (run == 0)
+    {
+        std::cerr << "No test matches." << std::endl;
+        return 1;
+    }
+    return testFailures() > 0 ? 1 : 0;
+}
@@ -0,0 +1,155 @@
+#include "check.h"
+
+#include "pHash.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+/**
+ * Longest common subsequence of two hash sequences, hashes within threshold bits counting as equal, by
+ * the textbook dynamic program, over the length of the shorter sequence.
+ */
+double lcsSimilarity(const std::vector<ulong64> &a, const std::vector<ulong64> &b, int threshold)
+{
+    std::vector<std::vector<int>> length(a.size() + 1, std::vector<int>(b.size() + 1, 0));
+    for (size_t i = 1; i <= a.size(); ++i)
+    {
+        for (size_t j = 1; j <= b.size(); ++j)
+        {
+            length[i][j] = __builtin_popcountll(a[i - 1] ^ b[j - 1]) <= threshold
+                               ? length[i - 1][j - 1] + 1
+                               : std::max(length[i - 1][j], length[i][j - 1]);
+        }
+    }
+    return static_cast<double>(length[a.size()][b.size()]) / std::min(a.size(), b.size());
+}
+
+/**
+ * The 64 DCT coefficients ph_dct_coeffs_hash takes, of a 32x32 image: frequencies 1 to 8 in both
+ * directions, vertical frequency major. The scale differs from pHash's DCT matrix by a constant factor,
+ * which does not move the median.
+ */
+void dctCoeffs(const std::vector<double> &image, float *coeffs)
+{
+    const double pi = std::acos(-1.0);
+    for (int v = 1; v <= 8; ++v)
+    {
+        for (int u = 1; u <= 8; ++u)
+        {
+            double sum = 0;
+            for (int y = 0; y < 32; ++y)
+            {
+                for (int x = 0; x < 32; ++x)
+                {
+                    sum += image[32 * y + x] * std::cos(pi * (2 * x + 1) * u / 64) * std::cos(pi * (2 * y + 1) * v / 64);
+                }
+            }
+            coeffs[8 * (v - 1) + (u - 1)] = static_cast<float>(sum);
+        }
+    }
+}
+
+} // namespace
+
+TEST(videohashDistMatchesDynamicProgram)
+{
+    std::mt19937_64 random(3);
+    for (int round = 0; round < 300; ++round)
+    {
+        std::vector<ulong64> a(1 + random() % 200);
+        std::vector<ulong64> b(1 + random() % 200);
+        // Few distinct frames with single bit noise, so that many frames match
+        const ulong64 frames[4] = {random(), random(), random(), random()};
+        for (ulong64 &hash : a)
+        {
+            hash = frames[random() % 4] ^ (1ULL << (random() % 64)) ^ (random() % 3 ? 0 : random());
+        }
+        for (ulong64 &hash : b)
+        {
+            hash = frames[random() % 4] ^ (1ULL << (random() % 64));
+        }
+        const int threshold = static_cast<int>(random() % 40);
+        CHECK(ph_dct_videohash_dist(a.data(), static_cast<int>(a.size()), b.data(), static_cast<int>(b.size()),
+                                    threshold) == lcsSimilarity(a, b, threshold));
+    }
+}
+
+#ifdef HAVE_IMAGE_HASH
+TEST(crosscorrBatchMatchesCrosscorr)
+{
+    std::mt19937 random(1);
+    const int size = 40;
+    const int count = 500;
+    std::vector<uint8_t> query(size);
+    std::vector<uint8_t> digests(size * count);
+    for (uint8_t &coeff : query)
+    {
+        coeff = static_cast<uint8_t>(random());
+    }
+    for (uint8_t &coeff : digests)
+    {
+        coeff = static_cast<uint8_t>(random());
+    }
+    // A shifted copy of the query, and a constant digest without variance
+    for (int i = 0; i < size; ++i)
+    {
+        digests[i] = query[(i + 7) % size];
+        digests[size + i] = 5;
+    }
+
+    std::vector<double> pcc(count);
+    CHECK(ph_crosscorr_batch(query.data(), digests.data(), size, count, pcc.data()) == count);
+    Digest x = {nullptr, query.data(), size};
+    for (int c = 0; c < count; ++c)
+    {
+        Digest y = {nullptr, &digests[size * c], size};
+        double expected = 0;
+        ph_crosscorr(x, y, expected);
+        CHECK(std::fabs(pcc[c] - expected) < 1e-12);
+    }
+    CHECK(std::fabs(pcc[0] - 1) < 1e-12);
+}
+#endif
+
+TEST(dihedralHashesMatchTransformedImages)
+{
+    std::mt19937 random(5);
+    std::uniform_real_distribution<double> pixel(0, 255);
+    for (int round = 0; round < 100; ++round)
+    {
+        std::vector<double> image(32 * 32);
+        for (double &value : image)
+        {
+            value = pixel(random);
+        }
+        float coeffs[64];
+        dctCoeffs(image, coeffs);
+        ulong64 derived[8];
+        ph_dct_dihedral_hashes(coeffs, derived);
+        CHECK(derived[0] == ph_dct_coeffs_hash(coeffs));
+
+        // Orientation k transposes the image if k & 4, then mirrors it horizontally if k & 1 and
+        // vertically if k & 2.
+        for (int k = 0; k < 8; ++k)
+        {
+            std::vector<double> oriented(32 * 32);
+            for (int y = 0; y < 32; ++y)
+            {
+                for (int x = 0; x < 32; ++x)
+                {
+                    const int sx = k & 1 ? 31 - x : x;
+                    const int sy = k & 2 ? 31 - y : y;
+                    oriented[32 * y + x] = k & 4 ? image[32 * sx + sy] : image[32 * sy + sx];
+                }
+            }
+            float orientedCoeffs[64];
+            dctCoeffs(oriented, orientedCoeffs);
+            CHECK(derived[k] == ph_dct_coeffs_hash(orientedCoeffs));
+        }
+    }
+}
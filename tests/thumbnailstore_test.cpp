@@ -0,0 +1,166 @@
+#include "check.h"
+
+#include "thumbnailstore.h"
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+/**
+ * A store file in a fresh temporary directory, removed with it.
+ */
+struct TemporaryStore
+{
+    std::string directory;
+    std::string path;
+
+    TemporaryStore()
+    {
+        const char *tmp = std::getenv("TMPDIR");
+        std::string pattern = std::string(tmp ? tmp : "/tmp") + "/imgcmp_test.XXXXXX";
+        if (!mkdtemp(&pattern[0]))
+        {
+            throw std::runtime_error("Cannot create a temporary directory");
+        }
+        directory = pattern;
+        path = directory + "/images.db.thumbs";
+    }
+
+    ~TemporaryStore()
+    {
+        unlink(path.c_str());
+        rmdir(directory.c_str());
+    }
+};
+
+std::vector<uint8_t> thumbnail(int width, int height, int seed)
+{
+    std::vector<uint8_t> pixels(static_cast<size_t>(width) * height);
+    for (size_t i = 0; i < pixels.size(); ++i)
+    {
+        pixels[i] = static_cast<uint8_t>(i * 31 + seed);
+    }
+    return pixels;
+}
+
+bool holds(const ThumbnailStore &store, int64_t offset, const std::vector<uint8_t> &expected, int expectedWidth,
+           int expectedHeight)
+{
+    const uint8_t *pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    return store.read(offset, pixels, width, height) && width == expectedWidth && height == expectedHeight &&
+           std::vector<uint8_t>(pixels, pixels + expected.size()) == expected;
+}
+
+bool opens(const std::string &path, ThumbnailStore::Mode mode)
+{
+    try
+    {
+        ThumbnailStore store(path, mode);
+        return true;
+    }
+    catch (const std::runtime_error &)
+    {
+        return false;
+    }
+}
+
+} // namespace
+
+TEST(thumbnailStoreRoundTrip)
+{
+    TemporaryStore file;
+    const std::vector<uint8_t> wide = thumbnail(256, 192, 1);
+    const std::vector<uint8_t> tall = thumbnail(3, 700, 2);
+    int64_t wideOffset = -1;
+    int64_t tallOffset = -1;
+    {
+        ThumbnailStore store(file.path, ThumbnailStore::Truncate);
+        wideOffset = store.append(wide.data(), 256, 192);
+        tallOffset = store.append(tall.data(), 3, 700);
+        CHECK(store.append(wide.data(), 0, 192) == -1);
+        CHECK(store.append(wide.data(), 0x10000, 1) == -1);
+        CHECK(store.sync());
+    }
+    CHECK(wideOffset > 0);
+    CHECK(tallOffset == wideOffset + 4 + 256 * 192);
+
+    ThumbnailStore store(file.path, ThumbnailStore::Read);
+    CHECK(holds(store, wideOffset, wide, 256, 192));
+    CHECK(holds(store, tallOffset, tall, 3, 700));
+    const uint8_t *pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    CHECK(!store.read(0, pixels, width, height));
+    CHECK(!store.read(tallOffset + 4 + 3 * 700, pixels, width, height));
+    CHECK(!store.read(-4, pixels, width, height));
+    CHECK(store.append(wide.data(), 256, 192) == -1);
+}
+
+TEST(thumbnailStoreAppendAfterReopen)
+{
+    TemporaryStore file;
+    const std::vector<uint8_t> first = thumbnail(64, 48, 3);
+    const std::vector<uint8_t> second = thumbnail(48, 64, 4);
+    int64_t firstOffset = -1;
+    int64_t secondOffset = -1;
+    {
+        ThumbnailStore store(file.path, ThumbnailStore::Truncate);
+        firstOffset = store.append(first.data(), 64, 48);
+    }
+    {
+        ThumbnailStore store(file.path, ThumbnailStore::Append);
+        secondOffset = store.append(second.data(), 48, 64);
+    }
+    CHECK(secondOffset == firstOffset + 4 + 64 * 48);
+
+    ThumbnailStore store(file.path, ThumbnailStore::Read);
+    CHECK(holds(store, firstOffset, first, 64, 48));
+    CHECK(holds(store, secondOffset, second, 48, 64));
+
+    // Truncate starts over
+    {
+        ThumbnailStore truncated(file.path, ThumbnailStore::Truncate);
+        CHECK(truncated.append(second.data(), 48, 64) == firstOffset);
+    }
+}
+
+TEST(thumbnailStoreRejectsDamagedFiles)
+{
+    TemporaryStore file;
+    const std::vector<uint8_t> pixels = thumbnail(32, 32, 5);
+    int64_t first = -1;
+    int64_t second = -1;
+    {
+        ThumbnailStore store(file.path, ThumbnailStore::Truncate);
+        first = store.append(pixels.data(), 32, 32);
+        second = store.append(pixels.data(), 32, 32);
+    }
+
+    // A record cut short by a crash is not returned, the ones before it are.
+    CHECK(truncate(file.path.c_str(), second + 4 + 32 * 32 - 1) == 0);
+    {
+        ThumbnailStore store(file.path, ThumbnailStore::Read);
+        CHECK(holds(store, first, pixels, 32, 32));
+        const uint8_t *read = nullptr;
+        int width = 0;
+        int height = 0;
+        CHECK(!store.read(second, read, width, height));
+    }
+
+    // Cut inside the magic, or another file
+    CHECK(truncate(file.path.c_str(), 5) == 0);
+    CHECK(!opens(file.path, ThumbnailStore::Read));
+    CHECK(!opens(file.path, ThumbnailStore::Append));
+    std::ofstream(file.path, std::ios::trunc) << "not a thumbnail store";
+    CHECK(!opens(file.path, ThumbnailStore::Read));
+    CHECK(!opens(file.path + ".missing", ThumbnailStore::Read));
+}
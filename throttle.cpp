@@ -0,0 +1,295 @@
+#include "throttle.h"
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace
+{
+
+// Control loop of the throttle
+const double adjustSeconds = 1.0;
+const double minFactor = 1.0 / 64;
+const double factorStep = 1.0 / 16;
+// A device counts as busy when its latency exceeds twice the baseline plus this slack, so that the noise
+// of sub-millisecond SSD reads does not throttle.
+const double latencySlackSeconds = 0.002;
+// The baseline drifts up by this factor per second, so that a permanent change is eventually accepted.
+const double baselineDrift = 1.01;
+// Sleeps are cut short to notice new limits
+const double maxSleepSeconds = 0.1;
+
+#ifdef __linux__
+// From linux/ioprio.h, which older kernel headers lack
+const int ioprioWhoProcess = 1;
+const int ioprioClassIdle = 3;
+const int ioprioClassShift = 13;
+#endif
+
+bool parseBytes(const std::string &text, double &value)
+{
+    std::istringstream in(text);
+    double number = 0;
+    if (!(in >> number) || number < 0)
+    {
+        return false;
+    }
+    std::string suffix;
+    in >> suffix;
+    if (!in.eof())
+    {
+        return false;
+    }
+    if (!suffix.empty())
+    {
+        const size_t unit = std::string("KMG").find(static_cast<char>(std::toupper(suffix[0])));
+        if (suffix.size() > 1 || unit == std::string::npos)
+        {
+            return false;
+        }
+        for (size_t u = 0; u <= unit; ++u)
+        {
+            number *= 1024;
+        }
+    }
+    value = number;
+    return true;
+}
+
+} // namespace
+
+bool parseScanLimits(const std::string &text, ScanLimits &limits)
+{
+    const size_t comma = text.find(',');
+    if (comma == std::string::npos)
+    {
+        return false;
+    }
+    ScanLimits parsed;
+    std::istringstream filesField(text.substr(comma + 1));
+    if (!parseBytes(text.substr(0, comma), parsed.bytesPerSecond) || !(filesField >> parsed.filesPerSecond) ||
+        !(filesField >> std::ws).eof() || parsed.filesPerSecond < 0)
+    {
+        return false;
+    }
+    limits = parsed;
+    return true;
+}
+
+void TokenBucket::refill(Clock::time_point now)
+{
+    const double elapsed = std::chrono::duration<double>(now - last).count();
+    tokens = std::min(ratePerSecond, tokens + elapsed * ratePerSecond);
+    last = now;
+}
+
+void TokenBucket::setRate(double rate, Clock::time_point now)
+{
+    if (ratePerSecond > 0)
+    {
+        refill(now);
+    }
+    else
+    {
+        tokens = 0;
+    }
+    ratePerSecond = rate;
+    tokens = std::min(tokens, ratePerSecond);
+    last = now;
+}
+
+double TokenBucket::take(double amount, Clock::time_point now)
+{
+    if (ratePerSecond <= 0)
+    {
+        return 0;
+    }
+    refill(now);
+    if (tokens < 0)
+    {
+        return -tokens / ratePerSecond;
+    }
+    tokens -= amount;
+    return 0;
+}
+
+Throttle::Throttle(const ScanLimits &limits, const std::string &limitsFile, bool verbose)
+    : limitsFile(limitsFile), verbose(verbose), configured(limits), windowStart(Clock::now())
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    reloadLimits();
+    applyRates(windowStart);
+}
+
+void Throttle::setLimits(const ScanLimits &limits)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    configured = limits;
+    applyRates(Clock::now());
+}
+
+ScanLimits Throttle::limits() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return configured;
+}
+
+double Throttle::share() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return factor;
+}
+
+void Throttle::acquireFile()
+{
+    acquire(files, 1, takenFiles);
+}
+
+void Throttle::acquireBytes(size_t count)
+{
+    acquire(bytes, static_cast<double>(count), takenBytes);
+}
+
+void Throttle::acquire(TokenBucket &bucket, double amount, double &taken)
+{
+    for (;;)
+    {
+        double wait = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const Clock::time_point now = Clock::now();
+            adjust(now);
+            wait = bucket.take(amount, now);
+            if (wait <= 0)
+            {
+                taken += amount;
+                return;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(std::min(wait, maxSleepSeconds)));
+    }
+}
+
+void Throttle::reportLatency(uint64_t device, double seconds)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Latency &latency = latencies[device];
+    latency.sum += seconds;
+    ++latency.count;
+}
+
+void Throttle::adjust(Clock::time_point now)
+{
+    const double elapsed = std::chrono::duration<double>(now - windowStart).count();
+    if (elapsed < adjustSeconds)
+    {
+        return;
+    }
+
+    bool busy = false;
+    for (auto &entry : latencies)
+    {
+        Latency &latency = entry.second;
+        if (latency.count == 0)
+        {
+            continue;
+        }
+        const double mean = latency.sum / latency.count;
+        if (latency.baseline > 0 && mean > 2 * latency.baseline + latencySlackSeconds)
+        {
+            busy = true;
+        }
+        latency.baseline = latency.baseline > 0 ? std::min(mean, latency.baseline * baselineDrift) : mean;
+        latency.sum = 0;
+        latency.count = 0;
+    }
+
+    const double previous = factor;
+    if (busy)
+    {
+        if (factor == 1)
+        {
+            // Unlimited rates need a starting point to back off from.
+            pinned.filesPerSecond = std::max(1.0, takenFiles / elapsed);
+            pinned.bytesPerSecond = takenBytes / elapsed;
+        }
+        factor = std::max(minFactor, factor / 2);
+    }
+    else
+    {
+        factor = std::min(1.0, factor + factorStep);
+    }
+    if (factor == 1)
+    {
+        pinned = ScanLimits();
+    }
+    takenFiles = 0;
+    takenBytes = 0;
+    windowStart = now;
+
+    reloadLimits();
+    applyRates(now);
+    if (verbose && factor != previous)
+    {
+        std::clog << "Background scan at " << static_cast<int>(100 * factor + 0.5) << "% of its read rate"
+                  << std::endl;
+    }
+}
+
+void Throttle::reloadLimits()
+{
+    struct stat info;
+    if (limitsFile.empty() || stat(limitsFile.c_str(), &info) != 0 || info.st_mtime == limitsTime)
+    {
+        return;
+    }
+    limitsTime = info.st_mtime;
+    std::ifstream file(limitsFile);
+    std::string text;
+    std::getline(file, text);
+    ScanLimits limits;
+    if (!parseScanLimits(text, limits))
+    {
+        std::cerr << limitsFile << " must hold <bytes per second>,<files per second>; keeping the limits."
+                  << std::endl;
+        return;
+    }
+    configured = limits;
+    if (verbose)
+    {
+        std::clog << "Background scan limits " << text << " from " << limitsFile << std::endl;
+    }
+}
+
+void Throttle::applyRates(Clock::time_point now)
+{
+    const double fileCeiling = configured.filesPerSecond > 0 ? configured.filesPerSecond : pinned.filesPerSecond;
+    const double byteCeiling = configured.bytesPerSecond > 0 ? configured.bytesPerSecond : pinned.bytesPerSecond;
+    files.setRate(fileCeiling * factor, now);
+    bytes.setRate(byteCeiling * factor, now);
+}
+
+bool Throttle::enterBackground(int niceLevel)
+{
+#ifdef __linux__
+    // Both apply to the calling thread and are inherited by the threads it creates.
+    const bool idle =
+        syscall(SYS_ioprio_set, ioprioWhoProcess, 0, ioprioClassIdle << ioprioClassShift) == 0;
+    const bool nice = setpriority(PRIO_PROCESS, 0, niceLevel) == 0;
+    return idle && nice;
+#else
+    (void)niceLevel;
+    return true;
+#endif
+}
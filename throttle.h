@@ -0,0 +1,137 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+
+/**
+ * Rates a background scan may read at. 0 is unlimited.
+ */
+struct ScanLimits
+{
+    double bytesPerSecond = 0;
+    double filesPerSecond = 0;
+};
+
+/**
+ * Parses "<bytes per second>,<files per second>". The bytes may carry a K, M or G suffix (powers of 1024),
+ * e.g. "20M,50". Returns false for anything else.
+ */
+bool parseScanLimits(const std::string &text, ScanLimits &limits);
+
+/**
+ * Token bucket holding at most one second of its rate. Not thread safe.
+ */
+class TokenBucket
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * Changes the rate; 0 lets everything through.
+     */
+    void setRate(double rate, Clock::time_point now);
+
+    double rate() const { return ratePerSecond; }
+
+    /**
+     * Takes amount tokens and returns 0, or returns the seconds to wait before trying again. Taking may
+     * leave the bucket in debt, so that an amount larger than the bucket still passes; the debt is paid off
+     * before the next take.
+     */
+    double take(double amount, Clock::time_point now);
+
+private:
+    void refill(Clock::time_point now);
+
+    double ratePerSecond = 0;
+    double tokens = 0;
+    Clock::time_point last;
+};
+
+/**
+ * Paces the reads of a background scan so that it does not slow down the services sharing the host.
+ *
+ * Reads are limited to the configured bytes and files per second. On top of that, the throttle watches the
+ * latency of the first read of every file per device: when it rises well above the lowest latency seen,
+ * someone else is using the disk, and the rates are halved, down to 1/64. They grow back by 1/16 per
+ * second once the latency is back to normal. An unlimited rate is first pinned to the rate measured just
+ * before.
+ *
+ * The limits can be changed while the scan runs, with setLimits() or by rewriting the limits file, which is
+ * read again whenever its modification time changes.
+ *
+ * All methods are thread safe.
+ */
+class Throttle
+{
+public:
+    /**
+     * limitsFile is optional; if it exists when the scan starts, it overrides limits.
+     */
+    Throttle(const ScanLimits &limits, const std::string &limitsFile, bool verbose);
+
+    void setLimits(const ScanLimits &limits);
+    ScanLimits limits() const;
+
+    /**
+     * Fraction of the limits currently allowed because of the read latency, in (0, 1].
+     */
+    double share() const;
+
+    /**
+     * Waits until the next file may be opened.
+     */
+    void acquireFile();
+
+    /**
+     * Waits until bytes may be read.
+     */
+    void acquireBytes(size_t bytes);
+
+    /**
+     * Reports how long a read from device took to start delivering data.
+     */
+    void reportLatency(uint64_t device, double seconds);
+
+    /**
+     * Moves the calling thread, and the threads it starts afterwards, to the idle I/O class and to
+     * niceLevel, so that they only get the disk and CPU others leave unused. Linux only; elsewhere nothing
+     * happens. Returns false if either could not be set.
+     */
+    static bool enterBackground(int niceLevel);
+
+private:
+    using Clock = TokenBucket::Clock;
+
+    struct Latency
+    {
+        double baseline = 0; // lowest recent mean, 0 before the first
+        double sum = 0;
+        size_t count = 0;
+    };
+
+    void acquire(TokenBucket &bucket, double amount, double &taken);
+    void adjust(Clock::time_point now);
+    void reloadLimits();
+    void applyRates(Clock::time_point now);
+
+    const std::string limitsFile;
+    const bool verbose;
+
+    mutable std::mutex mutex;
+    ScanLimits configured;
+    ScanLimits pinned; // measured rates standing in for unlimited ones while throttled
+    std::time_t limitsTime = 0;
+    double factor = 1;
+    TokenBucket files;
+    TokenBucket bytes;
+    std::map<uint64_t, Latency> latencies;
+    Clock::time_point windowStart;
+    double takenFiles = 0;
+    double takenBytes = 0;
+};
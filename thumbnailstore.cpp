@@ -0,0 +1,126 @@
+#include "thumbnailstore.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+static const char thumbnailMagic[] = "IMGTHMB1";
+
+ThumbnailStore::ThumbnailStore(const std::string &filename, Mode mode)
+{
+    const int flags = mode == Read ? O_RDONLY : O_RDWR | O_CREAT | (mode == Truncate ? O_TRUNC : 0);
+    fd = open(filename.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot open " + filename + ": " + strerror(errno));
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+    {
+        close(fd);
+        throw std::runtime_error("Cannot stat " + filename + ": " + strerror(errno));
+    }
+    end = info.st_size;
+
+    if (end == 0 && mode != Read)
+    {
+        if (pwrite(fd, thumbnailMagic, headerSize, 0) != static_cast<ssize_t>(headerSize))
+        {
+            close(fd);
+            throw std::runtime_error("Cannot write " + filename + ": " + strerror(errno));
+        }
+        end = headerSize;
+        return;
+    }
+
+    char magic[headerSize];
+    if (end < static_cast<int64_t>(headerSize) || pread(fd, magic, headerSize, 0) != static_cast<ssize_t>(headerSize) ||
+        memcmp(magic, thumbnailMagic, headerSize) != 0)
+    {
+        close(fd);
+        throw std::runtime_error(filename + " is not a thumbnail store");
+    }
+
+    if (mode == Read)
+    {
+        mapSize = static_cast<size_t>(end);
+        void *mapped = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Cannot map " + filename + ": " + strerror(errno));
+        }
+        map = static_cast<const uint8_t *>(mapped);
+    }
+}
+
+ThumbnailStore::~ThumbnailStore()
+{
+    if (map)
+    {
+        munmap(const_cast<uint8_t *>(map), mapSize);
+    }
+    close(fd);
+}
+
+int64_t ThumbnailStore::append(const uint8_t *pixels, int width, int height)
+{
+    if (map || !pixels || width <= 0 || height <= 0 || width > 0xffff || height > 0xffff)
+    {
+        return -1;
+    }
+    const size_t size = static_cast<size_t>(width) * height;
+    std::vector<uint8_t> record(4 + size);
+    record[0] = static_cast<uint8_t>(width);
+    record[1] = static_cast<uint8_t>(width >> 8);
+    record[2] = static_cast<uint8_t>(height);
+    record[3] = static_cast<uint8_t>(height >> 8);
+    memcpy(record.data() + 4, pixels, size);
+
+    size_t written = 0;
+    while (written < record.size())
+    {
+        const ssize_t n = pwrite(fd, record.data() + written, record.size() - written, end + written);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        written += static_cast<size_t>(n);
+    }
+    const int64_t offset = end;
+    end += static_cast<int64_t>(record.size());
+    return offset;
+}
+
+bool ThumbnailStore::sync()
+{
+    return fdatasync(fd) == 0;
+}
+
+bool ThumbnailStore::read(int64_t offset, const uint8_t *&pixels, int &width, int &height) const
+{
+    if (!map || offset < static_cast<int64_t>(headerSize) || offset + 4 > end)
+    {
+        return false;
+    }
+    const uint8_t *record = map + offset;
+    width = record[0] | record[1] << 8;
+    height = record[2] | record[3] << 8;
+    if (width == 0 || height == 0 || offset + 4 + static_cast<int64_t>(width) * height > end)
+    {
+        return false;
+    }
+    pixels = record + 4;
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Append-only file of the luma thumbnails the image hashes are computed from, kept next to the image
+ * database so that hashes can be recomputed without reading or decoding the original files.
+ *
+ * A thumbnail is addressed by the offset of its record: uint16 width, uint16 height, then width * height
+ * luma bytes, row by row. The file starts with an 8 byte magic.
+ */
+class ThumbnailStore
+{
+public:
+    enum Mode
+    {
+        Read,     // memory-maps the existing file
+        Append,   // adds thumbnails after the existing ones
+        Truncate  // starts an empty file, for a rescan
+    };
+
+    /**
+     * Opens the store. Throws std::runtime_error if the file cannot be opened or is not a thumbnail store.
+     */
+    ThumbnailStore(const std::string &filename, Mode mode);
+    ~ThumbnailStore();
+
+    ThumbnailStore(const ThumbnailStore &) = delete;
+    ThumbnailStore &operator=(const ThumbnailStore &) = delete;
+
+    /**
+     * The store belonging to a database file.
+     */
+    static std::string pathFor(const std::string &database) { return database + ".thumbs"; }
+
+    /**
+     * Appends a thumbnail and returns its offset, or -1 if it could not be written.
+     */
+    int64_t append(const uint8_t *pixels, int width, int height);
+
+    /**
+     * Flushes the appended thumbnails to disk. Call before committing rows that refer to them.
+     */
+    bool sync();
+
+    /**
+     * The thumbnail at offset, pointing into the mapped file; false if there is no complete record there.
+     * Only for stores opened with Read. Safe to call from several threads.
+     */
+    bool read(int64_t offset, const uint8_t *&pixels, int &width, int &height) const;
+
+private:
+    static const size_t headerSize = 8;
+
+    int fd = -1;
+    int64_t end = 0;
+    const uint8_t *map = nullptr;
+    size_t mapSize = 0;
+};